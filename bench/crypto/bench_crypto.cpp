@@ -0,0 +1,181 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the bt_crypto backends on the operations the stack does at run
+// time: signing write commands (bt_crypto_sign_att, AES-CMAC) and the
+// security function e (bt_crypto_e, a single AES block). Every backend's
+// results are checked against the others before timing. Results are written
+// as JSON, as with bench_minipro.
+//
+//   bench_crypto [--iterations <n>] [--output <file>]
+
+#include <time.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "crypto.h"
+}
+
+namespace
+{
+
+struct Backend
+{
+  const char * name;
+  enum bt_crypto_backend backend;
+};
+
+const Backend backends[] = {
+  {"kernel", BT_CRYPTO_BACKEND_KERNEL},
+  {"portable", BT_CRYPTO_BACKEND_PORTABLE},
+  {"aesni", BT_CRYPTO_BACKEND_AESNI},
+};
+
+struct Result
+{
+  const char * name;
+  bool available;
+  double sign_ns;
+  double e_ns;
+};
+
+uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// A signed Drive command as it goes over the air: the ATT opcode, the
+// handle and the 10-byte packet
+const uint8_t key[16] = {
+  0xd8, 0x51, 0x59, 0x48, 0x45, 0x1f, 0xea, 0x32, 0x0d, 0xc0, 0x5a, 0x2e, 0x88, 0x30, 0x81, 0x88,
+};
+const uint8_t pdu[13] = {0xd2, 0x0e, 0x00, 0x55, 0xaa, 0x06, 0x0a, 0x03, 0x7b, 0x00, 0x00, 0x00, 0x00};
+
+}  // namespace
+
+int main(int argc, char ** argv)
+{
+  long iterations = 100000;
+  std::string output = "bench_crypto.json";
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--iterations" && i + 1 < argc) {
+      iterations = std::atol(argv[++i]);
+    } else if (arg == "--output" && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--iterations <n>] [--output <file>]" << std::endl;
+      return -1;
+    }
+  }
+
+  struct bt_crypto * crypto = bt_crypto_new();
+  if (!crypto) {
+    std::cerr << "Failed to create the crypto context" << std::endl;
+    return -1;
+  }
+
+  std::vector<Result> results;
+  uint8_t reference_signature[12];
+  uint8_t reference_e[16];
+  bool have_reference = false;
+
+  try {
+    for (const Backend & backend : backends) {
+      Result result{backend.name, false, 0.0, 0.0};
+      if (!bt_crypto_set_backend(crypto, backend.backend)) {
+        results.push_back(result);
+        continue;
+      }
+      result.available = true;
+
+      uint8_t signature[12];
+      uint8_t plaintext[16] = {};
+      uint8_t encrypted[16];
+      if (!bt_crypto_sign_att(crypto, key, pdu, sizeof(pdu), 1, signature) ||
+        !bt_crypto_e(crypto, key, plaintext, encrypted))
+      {
+        throw std::runtime_error(std::string("Backend failed: ") + backend.name);
+      }
+
+      if (!have_reference) {
+        memcpy(reference_signature, signature, sizeof(signature));
+        memcpy(reference_e, encrypted, sizeof(encrypted));
+        have_reference = true;
+      } else if (memcmp(signature, reference_signature, sizeof(signature)) ||
+        memcmp(encrypted, reference_e, sizeof(encrypted)))
+      {
+        throw std::runtime_error(std::string("Backend disagrees with the others: ") + backend.name);
+      }
+
+      uint64_t start = now_ns();
+      for (long i = 0; i < iterations; i++) {
+        bt_crypto_sign_att(crypto, key, pdu, sizeof(pdu), i, signature);
+      }
+      result.sign_ns = double(now_ns() - start) / iterations;
+
+      start = now_ns();
+      for (long i = 0; i < iterations; i++) {
+        plaintext[0] = i;
+        bt_crypto_e(crypto, key, plaintext, encrypted);
+      }
+      result.e_ns = double(now_ns() - start) / iterations;
+
+      results.push_back(result);
+    }
+  } catch (std::exception & ex) {
+    std::cerr << "Exception: " << ex.what() << std::endl;
+    bt_crypto_unref(crypto);
+    return -1;
+  }
+
+  bt_crypto_unref(crypto);
+
+  FILE * out = fopen(output.c_str(), "w");
+  if (!out) {
+    std::cerr << "Failed to open " << output << std::endl;
+    return -1;
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"benchmark\": \"bench_crypto\",\n");
+  fprintf(out, "  \"iterations\": %ld,\n", iterations);
+  fprintf(out, "  \"backends\": {\n");
+  for (std::size_t i = 0; i < results.size(); i++) {
+    const Result & r = results[i];
+    fprintf(out, "    \"%s\": ", r.name);
+    if (r.available) {
+      fprintf(out, "{\"sign_att_ns\": %.1f, \"e_ns\": %.1f}", r.sign_ns, r.e_ns);
+    } else {
+      fprintf(out, "null");
+    }
+    fprintf(out, "%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "  }\n");
+  fprintf(out, "}\n");
+  fclose(out);
+
+  return 0;
+}
@@ -0,0 +1,536 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end benchmark of the MiniPro/LEClient/bluez stack against the
+// in-process Simulator. Drive commands are issued from the mainloop thread,
+// as the drive pacer does, and timed from encode to the writev() that puts
+// them on the socket. Results are written as JSON so that runs of different
+// versions can be compared.
+//
+//   bench_minipro [--duration <s>] [--notify-rate <Hz>] [--output <file>]
+
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "mainloop.h"
+}
+
+#include "minipro/minipro.hpp"
+#include "minipro/simulator.hpp"
+
+using jeronibot::minipro::MiniPro;
+using jeronibot::minipro::Simulator;
+using namespace std::chrono_literals;
+
+namespace
+{
+
+// Allocations made on the mainloop thread, where the stack does its work
+thread_local bool count_allocations{false};
+std::atomic<uint64_t> allocations{0};
+
+void
+count_allocation()
+{
+  if (count_allocations) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+uint64_t
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t
+thread_cpu_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class BenchMiniPro : public MiniPro
+{
+public:
+  explicit BenchMiniPro(int fd)
+  : MiniPro(fd)
+  {
+  }
+
+  uint64_t get_frame_count() const { return frames_.load(std::memory_order_relaxed); }
+
+protected:
+  void handle_frame(const jeronibot::minipro::packet::Frame & frame) override
+  {
+    frames_.fetch_add(1, std::memory_order_relaxed);
+    MiniPro::handle_frame(frame);
+  }
+
+  std::atomic<uint64_t> frames_{0};
+};
+
+// Runs on the mainloop thread off a 1 ms timeout, keeping up to window_
+// drive commands in flight between drive() and writev()
+class Driver
+{
+public:
+  enum Phase { Idle, Enter, Drive, Exit, Stop };
+
+  static constexpr std::size_t max_window = 1024;
+  static constexpr std::size_t max_samples = 1 << 22;
+
+  explicit Driver(MiniPro & minipro)
+  : minipro_(minipro)
+  {
+    latencies_.reserve(max_samples);
+  }
+
+  void start()
+  {
+    if (minipro_.invoke([this] {return mainloop_add_timeout(minipro_.get_mainloop(), 1, tick, this, nullptr);}) < 0) {
+      throw std::runtime_error("Driver: Failed to add timeout");
+    }
+  }
+
+  void set_phase(Phase phase)
+  {
+    phase_.store(phase, std::memory_order_release);
+    requested_.fetch_add(1, std::memory_order_acq_rel);
+  }
+  void set_window(std::size_t window) { window_.store(std::min(window, max_window)); }
+
+  // Wait for a tick that started after this call, so that it has acted on
+  // the last set_phase() and published fresh counters
+  void sync()
+  {
+    uint64_t requested = requested_.fetch_add(1, std::memory_order_acq_rel) + 1;
+    while (acknowledged_.load(std::memory_order_acquire) < requested) {
+      std::this_thread::sleep_for(1ms);
+    }
+  }
+
+  void drain()
+  {
+    sync();
+    while (written_.load(std::memory_order_acquire) != issued_.load(std::memory_order_acquire)) {
+      std::this_thread::sleep_for(1ms);
+    }
+  }
+
+  // Only valid while the driver is drained
+  std::vector<uint32_t> take_latencies()
+  {
+    std::vector<uint32_t> latencies(latencies_);
+    latencies_.clear();
+    return latencies;
+  }
+
+  struct Sample
+  {
+    uint64_t time_ns;
+    uint64_t cpu_ns;
+    uint64_t allocations;
+    uint64_t written;
+  };
+
+  Sample sample()
+  {
+    sync();
+    return {
+      now_ns(),
+      loop_cpu_ns_.load(std::memory_order_acquire),
+      allocations.load(std::memory_order_relaxed),
+      written_.load(std::memory_order_acquire)};
+  }
+
+  // Called from the writev() wrapper, on the mainloop thread
+  void on_writev(const struct iovec * iov, int iovcnt, uint64_t t)
+  {
+    if (iovcnt != 1 || iov[0].iov_len < 9) {
+      return;
+    }
+
+    // WRITE_CMD to the TX handle carrying a SetDrive frame
+    const uint8_t * pdu = static_cast<const uint8_t *>(iov[0].iov_base);
+    if (pdu[0] != BT_ATT_OP_WRITE_CMD || pdu[1] != 0x0e || pdu[2] != 0x00 ||
+      pdu[8] != jeronibot::minipro::packet::SetDrive)
+    {
+      return;
+    }
+
+    uint64_t written = written_.load(std::memory_order_relaxed);
+    if (written == issued_.load(std::memory_order_relaxed)) {
+      return;
+    }
+
+    if (latencies_.size() < max_samples) {
+      latencies_.push_back(static_cast<uint32_t>(t - encode_ns_[written % max_window]));
+    }
+    written_.store(written + 1, std::memory_order_release);
+  }
+
+protected:
+  static void tick(int id, void * user_data)
+  {
+    Driver * This = (Driver *) user_data;
+    count_allocations = true;
+
+    uint64_t requested = This->requested_.load(std::memory_order_acquire);
+
+    switch (This->phase_.load(std::memory_order_acquire)) {
+      case Enter:
+        This->minipro_.enter_remote_control_mode();
+        This->phase_.store(Idle, std::memory_order_relaxed);
+        break;
+
+      case Drive:
+        {
+          uint64_t issued = This->issued_.load(std::memory_order_relaxed);
+          std::size_t window = This->window_.load(std::memory_order_relaxed);
+          while (issued - This->written_.load(std::memory_order_relaxed) < window) {
+            This->encode_ns_[issued % max_window] = now_ns();
+            This->minipro_.drive(static_cast<int16_t>(issued), static_cast<int16_t>(-issued));
+            This->issued_.store(++issued, std::memory_order_release);
+          }
+        }
+        break;
+
+      case Exit:
+        This->minipro_.exit_remote_control_mode();
+        This->phase_.store(Idle, std::memory_order_relaxed);
+        break;
+
+      case Stop:
+        This->acknowledged_.store(requested, std::memory_order_release);
+        return;
+
+      case Idle:
+        break;
+    }
+
+    This->loop_cpu_ns_.store(thread_cpu_ns(), std::memory_order_release);
+    This->acknowledged_.store(requested, std::memory_order_release);
+    mainloop_modify_timeout(This->minipro_.get_mainloop(), id, 1);
+  }
+
+  MiniPro & minipro_;
+
+  std::atomic<Phase> phase_{Idle};
+  std::atomic<std::size_t> window_{1};
+  std::atomic<uint64_t> requested_{0};
+  std::atomic<uint64_t> acknowledged_{0};
+  std::atomic<uint64_t> loop_cpu_ns_{0};
+
+  std::atomic<uint64_t> issued_{0};
+  std::atomic<uint64_t> written_{0};
+  uint64_t encode_ns_[max_window];
+  std::vector<uint32_t> latencies_;
+};
+
+Driver * driver{nullptr};
+
+struct Percentiles
+{
+  uint32_t p50{0}, p90{0}, p99{0}, p999{0}, max{0};
+};
+
+Percentiles
+percentiles(std::vector<uint32_t> samples)
+{
+  Percentiles p;
+  if (samples.empty()) {
+    return p;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  auto at = [&samples](double q) {return samples[static_cast<std::size_t>(q * (samples.size() - 1))];};
+
+  p.p50 = at(0.5);
+  p.p90 = at(0.9);
+  p.p99 = at(0.99);
+  p.p999 = at(0.999);
+  p.max = samples.back();
+  return p;
+}
+
+// Percentiles as recorded by bt_att
+Percentiles
+percentiles(const struct bt_att_histogram & histogram)
+{
+  auto at = [&histogram](double q) {return static_cast<uint32_t>(bt_att_histogram_percentile(&histogram, q));};
+
+  Percentiles p;
+  p.p50 = at(50);
+  p.p90 = at(90);
+  p.p99 = at(99);
+  p.p999 = at(99.9);
+  p.max = histogram.max;
+  return p;
+}
+
+void
+print_percentiles(FILE * out, const char * name, const Percentiles & p, std::size_t count, bool last)
+{
+  fprintf(out,
+    "      \"%s\": {\"samples\": %zu, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}%s\n",
+    name, count, p.p50, p.p90, p.p99, p.p999, p.max, last ? "" : ",");
+}
+
+double
+per(double value, double count)
+{
+  return count > 0 ? value / count : 0.0;
+}
+
+}  // namespace
+
+// bench_minipro links with --wrap for writev, malloc, calloc and realloc, so
+// that commands can be timestamped as io_send() puts them on the socket and
+// bluez's allocations can be counted; C++ allocations go through operator new
+extern "C" {
+ssize_t __real_writev(int fd, const struct iovec * iov, int iovcnt);
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+ssize_t
+__wrap_writev(int fd, const struct iovec * iov, int iovcnt)
+{
+  uint64_t t = now_ns();
+  ssize_t ret = __real_writev(fd, iov, iovcnt);
+  if (ret > 0 && driver) {
+    driver->on_writev(iov, iovcnt, t);
+  }
+  return ret;
+}
+
+void *
+__wrap_malloc(size_t size)
+{
+  count_allocation();
+  return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+  count_allocation();
+  return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void * ptr, size_t size)
+{
+  count_allocation();
+  return __real_realloc(ptr, size);
+}
+}
+
+void *
+operator new(std::size_t size)
+{
+  count_allocation();
+  if (void * ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void
+operator delete(void * ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void
+operator delete(void * ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+int main(int argc, char ** argv)
+{
+  double duration = 2.0;
+  double notify_rate = 2500.0;
+  std::string output = "bench_minipro.json";
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--duration" && i + 1 < argc) {
+      duration = std::atof(argv[++i]);
+    } else if (arg == "--notify-rate" && i + 1 < argc) {
+      notify_rate = std::atof(argv[++i]);
+    } else if (arg == "--output" && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--duration <s>] [--notify-rate <Hz>] [--output <file>]" << std::endl;
+      return -1;
+    }
+  }
+
+  auto phase_time = std::chrono::duration<double>(duration);
+
+  try {
+    Simulator simulator(units::frequency::hertz_t(10));
+    BenchMiniPro minipro(simulator.get_client_handle());
+    minipro.enable_notifications();
+
+    Driver bench_driver(minipro);
+    driver = &bench_driver;
+    bench_driver.start();
+
+    bench_driver.set_phase(Driver::Enter);
+    bench_driver.sync();
+    for (int i = 0; i < 200 && !simulator.get_vehicle_state().remote_control; i++) {
+      std::this_thread::sleep_for(10ms);
+    }
+    if (!simulator.get_vehicle_state().remote_control) {
+      throw std::runtime_error("Simulator did not enter remote control mode");
+    }
+
+    // Idle baseline: the driver's own tick and the 10 Hz telemetry
+    auto idle_start = bench_driver.sample();
+    std::this_thread::sleep_for(phase_time);
+    auto idle_end = bench_driver.sample();
+    double idle_s = (idle_end.time_ns - idle_start.time_ns) / 1e9;
+    double idle_cpu_ns_per_s = per(idle_end.cpu_ns - idle_start.cpu_ns, idle_s);
+    double idle_allocations_per_s = per(idle_end.allocations - idle_start.allocations, idle_s);
+
+    // Unloaded latency: one command in flight at a time
+    bench_driver.set_window(1);
+    bench_driver.set_phase(Driver::Drive);
+    std::this_thread::sleep_for(phase_time);
+    bench_driver.set_phase(Driver::Idle);
+    bench_driver.drain();
+    auto unloaded = bench_driver.take_latencies();
+
+    // Throughput: keep the ATT write queue full
+    uint64_t delivered_start = simulator.get_drive_count();
+    bench_driver.set_window(Driver::max_window);
+    minipro.reset_latency_stats();
+    auto drive_start = bench_driver.sample();
+    bench_driver.set_phase(Driver::Drive);
+    std::this_thread::sleep_for(phase_time);
+    bench_driver.set_phase(Driver::Idle);
+    bench_driver.drain();
+    auto drive_end = bench_driver.sample();
+    auto loaded = bench_driver.take_latencies();
+    auto command_queue = minipro.get_latency_stats().command_queue;
+
+    std::this_thread::sleep_for(100ms);
+    uint64_t delivered = simulator.get_drive_count() - delivered_start;
+
+    double drive_s = (drive_end.time_ns - drive_start.time_ns) / 1e9;
+    double commands = drive_end.written - drive_start.written;
+    double drive_cpu_ns = (drive_end.cpu_ns - drive_start.cpu_ns) - idle_cpu_ns_per_s * drive_s;
+    double drive_allocations = (drive_end.allocations - drive_start.allocations) - idle_allocations_per_s * drive_s;
+
+    // Notification ingest
+    uint64_t frames_start = minipro.get_frame_count();
+    uint64_t sent_start = simulator.get_notification_count();
+    simulator.set_telemetry_rate(units::frequency::hertz_t(notify_rate));
+    minipro.reset_latency_stats();
+    auto notify_start = bench_driver.sample();
+    std::this_thread::sleep_for(phase_time);
+    auto notify_end = bench_driver.sample();
+    auto notify_interval = minipro.get_latency_stats().notify_interval;
+    simulator.set_telemetry_rate(units::frequency::hertz_t(10));
+    uint64_t frames = minipro.get_frame_count() - frames_start;
+    uint64_t sent = simulator.get_notification_count() - sent_start;
+
+    double notify_s = (notify_end.time_ns - notify_start.time_ns) / 1e9;
+    double notify_cpu_ns = (notify_end.cpu_ns - notify_start.cpu_ns) - idle_cpu_ns_per_s * notify_s;
+    double notify_allocations = (notify_end.allocations - notify_start.allocations) - idle_allocations_per_s * notify_s;
+
+    bench_driver.set_phase(Driver::Exit);
+    bench_driver.sync();
+    bench_driver.set_phase(Driver::Stop);
+    bench_driver.sync();
+
+    FILE * out = fopen(output.c_str(), "w");
+    if (!out) {
+      throw std::runtime_error("Failed to open " + output);
+    }
+
+    auto unloaded_p = percentiles(unloaded);
+    auto loaded_p = percentiles(loaded);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"bench_minipro\",\n");
+    fprintf(out, "  \"duration_s\": %.3f,\n", duration);
+    fprintf(out, "  \"idle\": {\n");
+    fprintf(out, "    \"cpu_ns_per_s\": %.0f,\n", idle_cpu_ns_per_s);
+    fprintf(out, "    \"allocations_per_s\": %.1f\n", idle_allocations_per_s);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"drive\": {\n");
+    fprintf(out, "    \"commands\": %.0f,\n", commands);
+    fprintf(out, "    \"delivered\": %lu,\n", delivered);
+    fprintf(out, "    \"commands_per_s\": %.1f,\n", per(commands, drive_s));
+    fprintf(out, "    \"cpu_ns_per_command\": %.1f,\n", per(drive_cpu_ns, commands));
+    fprintf(out, "    \"allocations_per_command\": %.3f,\n", per(drive_allocations, commands));
+    fprintf(out, "    \"encode_to_writev_ns\": {\n");
+    print_percentiles(out, "unloaded", unloaded_p, unloaded.size(), false);
+    print_percentiles(out, "loaded", loaded_p, loaded.size(), true);
+    fprintf(out, "    },\n");
+    fprintf(out, "    \"att_queue_ns\": {\n");
+    print_percentiles(out, "loaded", percentiles(command_queue), command_queue.count, true);
+    fprintf(out, "    }\n");
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"notify\": {\n");
+    fprintf(out, "    \"sent\": %lu,\n", sent);
+    fprintf(out, "    \"received\": %lu,\n", frames);
+    fprintf(out, "    \"notifications_per_s\": %.1f,\n", per(frames, notify_s));
+    fprintf(out, "    \"cpu_ns_per_notification\": %.1f,\n", per(notify_cpu_ns, frames));
+    fprintf(out, "    \"allocations_per_notification\": %.3f,\n", per(notify_allocations, frames));
+    fprintf(out, "    \"interval_ns\": {\n");
+    print_percentiles(out, "received", percentiles(notify_interval), notify_interval.count, true);
+    fprintf(out, "    }\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+    fclose(out);
+
+    std::cerr << "drive: " << per(commands, drive_s) << " cmds/s, p50 " << unloaded_p.p50 << " ns unloaded, "
+              << per(drive_cpu_ns, commands) << " ns CPU/cmd, " << per(drive_allocations, commands) << " allocs/cmd" << std::endl;
+    std::cerr << "notify: " << per(frames, notify_s) << " notifications/s, " << per(notify_cpu_ns, frames)
+              << " ns CPU/notification" << std::endl;
+    std::cerr << "Wrote " << output << std::endl;
+
+    driver = nullptr;
+  } catch (std::exception & ex) {
+    std::cerr << "Exception: " << ex.what() << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,117 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLUETOOTH__ADAPTER_POOL_HPP_
+#define BLUETOOTH__ADAPTER_POOL_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+extern "C" {
+#include "bluetooth.h"
+}
+
+namespace bluetooth {
+
+// The local Bluetooth adapters, and the LE connections this process has on
+// each. Controllers only take a handful of LE links each, so connections
+// are spread over all adapters that are up rather than left to the kernel,
+// which puts them all on the first one
+class AdapterPool
+{
+public:
+  struct Adapter
+  {
+    int dev_id;
+    bdaddr_t address;
+    std::size_t connections;
+    // Estimated share of the radio's time taken by the connections, where 1
+    // is all of it
+    double airtime;
+  };
+
+  // A connection's place on an adapter, given back when destroyed
+  class Lease
+  {
+  public:
+    Lease() = default;
+    Lease(Lease && other) noexcept;
+    Lease & operator=(Lease && other) noexcept;
+    Lease(const Lease &) = delete;
+    Lease & operator=(const Lease &) = delete;
+    ~Lease();
+
+    bool valid() const { return pool_ != nullptr; }
+    int get_device_id() const { return dev_id_; }
+    const bdaddr_t & get_address() const { return address_; }
+
+    // The connection interval (in 1.25 ms units), once it's known
+    void set_interval(uint16_t interval);
+
+  protected:
+    friend class AdapterPool;
+
+    void release();
+
+    AdapterPool * pool_{nullptr};
+    int dev_id_{-1};
+    bdaddr_t address_{};
+    uint16_t interval_{0};
+  };
+
+  static AdapterPool & instance();
+
+  // A place on the adapter with the least airtime in use, then the fewest
+  // connections; an invalid lease if no adapter is up
+  Lease acquire();
+
+  std::vector<Adapter> get_adapters();
+
+  // Radio time assumed for each connection event, which is about one data
+  // packet and its acknowledgement on the 1M PHY
+  static constexpr std::chrono::microseconds event_airtime{625};
+
+  // The interval assumed until a connection sets its own: 50 ms, the
+  // kernel's default maximum
+  static constexpr uint16_t default_interval{40};
+
+protected:
+  AdapterPool() = default;
+
+  struct State
+  {
+    bdaddr_t address;
+    std::size_t connections{0};
+    double airtime{0.0};
+    bool up{false};
+  };
+
+  // Picks up adapters that came and went; with mutex_ held
+  void enumerate();
+  static int add_adapter_cb(int dd, int dev_id, long arg);
+
+  static double get_airtime(uint16_t interval);
+
+  std::mutex mutex_;
+  std::map<int, State> adapters_;
+};
+
+}  // namespace bluetooth
+
+#endif  // BLUETOOTH__ADAPTER_POOL_HPP_
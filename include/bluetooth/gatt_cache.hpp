@@ -0,0 +1,44 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLUETOOTH__GATT_CACHE_HPP_
+#define BLUETOOTH__GATT_CACHE_HPP_
+
+#include <string>
+
+struct gatt_db;
+
+namespace bluetooth {
+
+// On-disk copy of a discovered GATT database. Loading a cache into an empty
+// gatt_db lets bt_gatt_client skip service discovery; the cache is trusted
+// until the server reports a change with a Service Changed indication
+class GattCache
+{
+public:
+  // Write every service in db to path, replacing the previous cache
+  static bool save(struct gatt_db * db, const std::string & path);
+
+  // Populate an empty db from path. On failure db is left empty
+  static bool load(struct gatt_db * db, const std::string & path);
+
+  static void remove(const std::string & path);
+
+  // Cache file for a device address within dir
+  static std::string get_path(const std::string & dir, const std::string & device_address);
+};
+
+}  // namespace bluetooth
+
+#endif  // BLUETOOTH__GATT_CACHE_HPP_
@@ -30,11 +30,21 @@ namespace bluetooth {
 class L2CapSocket
 {
 public:
-  L2CapSocket(bdaddr_t * src, bdaddr_t * dst, uint8_t dst_type = BDADDR_LE_RANDOM, int sec = BT_SECURITY_LOW);
+  // A nonblocking socket returns while the connection is still being set
+  // up; it becomes writable once connected, with SO_ERROR telling the outcome
+  L2CapSocket(
+    bdaddr_t * src, bdaddr_t * dst, uint8_t dst_type = BDADDR_LE_RANDOM, int sec = BT_SECURITY_LOW,
+    bool nonblocking = false);
   ~L2CapSocket();
 
   int get_handle() { return fd_; }
 
+  // HCI handle of the LE connection underneath, or -1
+  int get_connection_handle();
+
+  // Index of the adapter the connection goes through (as in hciX), or -1
+  int get_device_id();
+
 protected:
   int fd_{-1};
   const int ATT_CID{4};
@@ -15,11 +15,22 @@
 #ifndef BLUETOOTH__LE_CLIENT_HPP_
 #define BLUETOOTH__LE_CLIENT_HPP_
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <span>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <stdint.h>
 
@@ -29,16 +40,144 @@ extern "C" {
 #include "uuid.h"
 #include "gatt-db.h"
 #include "gatt-client.h"
+#include "mainloop.h"
 }
 
+#include "bluetooth/adapter_pool.hpp"
 #include "bluetooth/l2_cap_socket.hpp"
+#include "bluetooth/read_batch.hpp"
+#include "util/mpsc_queue.hpp"
 
 namespace bluetooth {
 
 class LEClient
 {
 public:
-  LEClient(const std::string & device_address, uint8_t dst_type = BDADDR_LE_RANDOM, int sec = BT_SECURITY_LOW, uint16_t mtu = 0);
+  // Selects the primary services within [start, end] whose UUID matches; an
+  // empty uuid matches any service
+  struct DiscoveryRange
+  {
+    uint16_t start{0x0001};
+    uint16_t end{0xffff};
+    std::string uuid;
+  };
+
+  // What write_value() without response does once max_queued commands are
+  // waiting to be written to the socket
+  enum class WritePolicy
+  {
+    Block,              // the caller waits for room; nothing is dropped
+    DropOldest,         // the oldest waiting command is dropped
+    ReplaceSameHandle,  // a command still waiting for the same handle is
+                        // always overwritten in place, keeping its turn;
+                        // otherwise like DropOldest
+  };
+
+  struct WriteStats
+  {
+    uint64_t submitted{0};
+    uint64_t dropped{0};
+    uint64_t replaced{0};
+  };
+
+  // LE connection parameters, in the units the controller uses
+  struct ConnectionParameters
+  {
+    uint16_t min_interval;         // 1.25 ms
+    uint16_t max_interval;         // 1.25 ms
+    uint16_t latency;              // connection events the peripheral may skip
+    uint16_t supervision_timeout;  // 10 ms
+  };
+
+  // Every connection event is available for a command: 7.5 ms, and a lost
+  // link is noticed within a second
+  static constexpr ConnectionParameters low_latency_teleop{6, 6, 0, 100};
+
+  // 100-200 ms, and the peripheral may sleep through 4 events when it has
+  // nothing to say; plenty for telemetry while parked
+  static constexpr ConnectionParameters idle_telemetry{80, 160, 4, 600};
+
+  // 15-30 ms with a 4 s supervision timeout, for riding out a weak link
+  // instead of dropping it
+  static constexpr ConnectionParameters robust_teleop{12, 24, 0, 400};
+
+  // The link as last sampled from the controller. A reading the controller
+  // doesn't support keeps its previous value
+  struct LinkQuality
+  {
+    int8_t rssi{0};             // dBm
+    int8_t tx_power{0};         // dBm
+    uint8_t link_quality{0};    // the controller's own figure; 0 if unreported
+    float score{1.0f};          // smoothed; 1 is a strong link, 0 one about to drop
+    uint64_t samples{0};
+  };
+
+  // How the link monitor samples the link and scores it. The score is the
+  // RSSI placed between rssi_weak (0) and rssi_strong (1), capped by the
+  // link quality where the controller reports one
+  struct LinkMonitorPolicy
+  {
+    std::chrono::milliseconds period{250};
+    float smoothing{0.25f};  // weight of each new sample in the score
+    int8_t rssi_strong{-60};
+    int8_t rssi_weak{-90};
+  };
+
+  // ATT latency histograms in nanoseconds, recorded by bt_att since the
+  // connection was set up or last reset. bt_att_histogram_percentile()
+  // reads percentiles off them
+  struct LatencyStats
+  {
+    struct bt_att_histogram request_queue;    // request queued until written
+    struct bt_att_histogram command_queue;    // command queued until written
+    struct bt_att_histogram notify_interval;  // between notifications
+    // Request written until its response is handled, by request opcode
+    std::map<uint8_t, struct bt_att_histogram> round_trip;
+  };
+
+  // What happens when the link drops. With reconnection enabled, attempts
+  // start right away and then back off exponentially from initial_delay up to
+  // max_delay, going on until the client is stopped. Otherwise the mainloop
+  // stops, as it always did
+  struct ReconnectPolicy
+  {
+    bool enabled{true};
+    std::chrono::milliseconds initial_delay{100};
+    std::chrono::milliseconds max_delay{5000};
+  };
+
+  struct ReconnectStats
+  {
+    uint64_t disconnects{0};
+    uint64_t reconnects{0};
+    uint64_t attempts{0};
+    // From the link dropping to on_reconnected() having queued the restore
+    std::chrono::nanoseconds last_outage{0};
+    std::chrono::nanoseconds max_outage{0};
+  };
+
+  // Opens a new ATT socket to the peer, connected or with a nonblocking
+  // connect in progress; returns -1 if there is none to be had right now
+  using Connector = std::function<int()>;
+
+  // Clients created from an address connect through the least loaded of the
+  // local adapters, see AdapterPool
+  //
+  // With a cache_dir, the discovered GATT database is kept on disk per device
+  // address and service discovery is skipped on the next connection
+  //
+  // With discovery_ranges, only the selected services (plus the GATT service,
+  // for Service Changed) are discovered while connecting; discover_services()
+  // fills in the rest on demand
+  LEClient(const std::string & device_address, uint8_t dst_type = BDADDR_LE_RANDOM, int sec = BT_SECURITY_LOW, uint16_t mtu = 0,
+    const std::string & cache_dir = std::string(), const std::vector<DiscoveryRange> & discovery_ranges = {});
+
+  // Run the client over an already-connected SOCK_SEQPACKET socket carrying
+  // ATT PDUs, such as one end of a socketpair. The client takes ownership of fd.
+  // cache_path, if given, is the GATT cache file to use for this peer. Such a
+  // client only reconnects once it has been given a connector
+  explicit LEClient(int fd, uint16_t mtu = 0, const std::string & cache_path = std::string(),
+    const std::vector<DiscoveryRange> & discovery_ranges = {});
 
   // GattClient
   static void ready_cb(bool success, uint8_t att_ecode, void * user_data);
@@ -46,8 +185,45 @@ public:
   static void service_changed_cb(uint16_t start_handle, uint16_t end_handle, void * user_data);
   static void service_removed_cb(struct gatt_db_attribute * attr, void * user_data);
   static void att_disconnect_cb(int err, void * user_data);
+  static void gatt_debug_cb(const char * str, void * user_data);
+
+  virtual ~LEClient();
 
-  ~LEClient();
+  // Stops the mainloop thread; no callbacks are invoked after this returns.
+  // Commands still queued by then are run on the calling thread
+  void stop();
+
+  // Runs work on the mainloop thread, which owns the ATT transport and the
+  // GATT client. Any number of threads may post concurrently; work posted
+  // from the mainloop thread itself runs right away, and once the loop has
+  // stopped, on the posting thread with one thread at a time.
+  // All of the methods below go through here and are safe to call from any
+  // thread, except that the blocking ones must not be called from callbacks
+  void post(std::function<void()> work);
+
+  // Like post(), but waits for work to finish and returns its result
+  template<typename Work>
+  auto invoke(Work && work) -> decltype(work())
+  {
+    if (in_mainloop()) {
+      return work();
+    }
+
+    std::packaged_task<decltype(work())()> task(std::forward<Work>(work));
+    auto result = task.get_future();
+    post([&task] {task();});
+    return result.get();
+  }
+
+  // The client's own event loop, for adding fds and timeouts to it from
+  // work run on the mainloop thread. Each client runs one on a thread of
+  // its own, so clients don't share or stop each other's loops
+  struct mainloop * get_mainloop() const { return loop_.get(); }
+
+  // Discover the services in [start, end] that weren't discovered while
+  // connecting. Blocks until done; not callable from the mainloop thread
+  bool discover_services(uint16_t start = 0x0001, uint16_t end = 0xffff);
+  static void discover_services_cb(bool success, uint8_t att_ecode, void * user_data);
 
   int get_security();
   void set_security(int level);	// BT_SECURITY_SDP, LOW, MEDIUM, HIGH
@@ -57,14 +233,45 @@ public:
   void read_multiple(uint16_t * handles, uint8_t num_handles);
   static void read_multiple_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
 
+  // Reads every value in batch with one round trip, an ATT Read Multiple
+  // request (or a plain Read for a batch of one), and decodes them into out.
+  // Blocks until the response is in; not callable from the mainloop thread
+  template<typename T>
+  bool read_batch(const ReadBatch<T> & batch, T & out)
+  {
+    return read_multiple(batch.get_handles(),
+             [&batch, &out](std::span<const uint8_t> response) {return batch.decode(response, out);});
+  }
+
+  // Like read_batch(), handing the whole response to decode on the mainloop
+  // thread while the caller waits
+  using ResponseDecoder = std::function<bool(std::span<const uint8_t> response)>;
+  bool read_multiple(const std::vector<uint16_t> & handles, const ResponseDecoder & decode);
+
   void read_value(uint16_t handle);
   static void read_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
 
-  void register_notify(uint16_t value_handle);
+  unsigned int register_notify(uint16_t value_handle);
   static void notify_cb(uint16_t value_handle, const uint8_t * value, uint16_t length, void * user_data);
   static void register_notify_cb(uint16_t att_ecode, void * user_data);
 
+  // Subscribes callback to the notifications/indications on value_handle; it
+  // is called on the mainloop thread instead of on_notify(). Incoming values
+  // are dispatched by handle, so the cost per value doesn't grow with the
+  // number of subscriptions. unregister_notify() takes the returned id
+  using NotifyCallback = std::function<void(uint16_t value_handle, std::span<const uint8_t> value)>;
+  unsigned int register_notify(uint16_t value_handle, NotifyCallback callback);
+  static void subscriber_notify_cb(uint16_t value_handle, const uint8_t * value, uint16_t length, void * user_data);
+  static void subscriber_destroy_cb(void * user_data);
+
+  // Signs the write commands sent with signed_write using key (the CSRK).
+  // The sign counter belongs to this client and carries over reconnects and
+  // re-keying; it's only set when passed in. The peer rejects counters it
+  // has seen, so store get_sign_counter() with the key and pass it back in
+  // next time
   void set_sign_key(uint8_t key[16]);
+  void set_sign_key(uint8_t key[16], uint32_t sign_counter);
+  uint32_t get_sign_counter();
   static bool local_counter(uint32_t * sign_cnt, void * user_data);
 
   void unregister_notify(unsigned int id);
@@ -75,15 +282,172 @@ public:
   static void write_long_cb(bool success, bool reliable_error, uint8_t att_ecode, void * user_data);
 
   void write_prepare(unsigned int id, uint16_t handle, uint16_t offset, uint8_t * value, unsigned int length);
-  void write_value(uint16_t handle, uint8_t * value, int length, bool without_response = false, bool signed_write = false);
+  void write_value(uint16_t handle, const uint8_t * value, int length, bool without_response = false, bool signed_write = false);
   static void write_cb(bool success, uint8_t att_ecode, void * user_data);
 
+  // Bounds the write commands in flight between write_value() and the
+  // socket; max_queued == 0 (the default) leaves them unbounded. Block only
+  // holds back other threads, as the mainloop thread can't wait on itself
+  void set_write_policy(WritePolicy policy, std::size_t max_queued);
+
+  // Write commands submitted but not written to the socket yet
+  std::size_t get_write_queue_depth() const { return write_depth_.load(std::memory_order_relaxed); }
+  WriteStats get_write_stats() const;
+
+  LatencyStats get_latency_stats();
+  void reset_latency_stats();
+
+  // connector replaces the one used to reconnect, if given; clients created
+  // from a device address have one to begin with
+  void set_reconnect_policy(const ReconnectPolicy & policy, Connector connector = nullptr);
+  ReconnectStats get_reconnect_stats();
+  bool is_connected() const { return connected_.load(std::memory_order_acquire); }
+
+  // Asks the controller to update the connection parameters and waits for
+  // the update to complete, which takes a few connection events. Needs a
+  // Bluetooth connection (not one passed in as an fd) and CAP_NET_RAW
+  bool update_connection(const ConnectionParameters & parameters);
+  bool can_update_connection() const { return has_address_; }
+
+  // Index of the adapter the client connects through (as in hciX), or -1 if
+  // that's up to the kernel
+  int get_adapter_id() const { return adapter_lease_.get_device_id(); }
+
+  // Samples RSSI, link quality and TX power every period. The HCI commands
+  // are sent from the mainloop and their results are picked up as they
+  // arrive, so the ATT traffic never waits on them. Needs a Bluetooth
+  // connection and CAP_NET_RAW
+  bool start_link_monitor();
+  bool start_link_monitor(const LinkMonitorPolicy & policy);
+  void stop_link_monitor();
+  LinkQuality get_link_quality() const;
+
 protected:
+  // Called on the mainloop thread for each notification/indication received
+  // on a handle registered with register_notify
+  virtual void on_notify(uint16_t value_handle, const uint8_t * value, uint16_t length);
+
+  // Called on the mainloop thread once a dropped link is back up and the GATT
+  // client is ready again. Notification registrations belong to the old
+  // client; bring the peer back to where it was without waiting on anything
+  virtual void on_reconnected() {}
+
+  // Called on the mainloop thread each time the link monitor has a sample
+  virtual void on_link_quality(const LinkQuality & /*quality*/) {}
+
+  // A read_multiple() waiting for its response. It's only completed by the
+  // destroy callback, the last use of it on the mainloop thread, which also
+  // runs when the request goes away unanswered, e.g. with the connection
+  struct BatchRead
+  {
+    const ResponseDecoder & decode;
+    std::promise<bool> done;
+    bool decoded{false};
+  };
+
+  static void read_batch_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data);
+  static void read_batch_destroy_cb(void * user_data);
+
+  // Write request that doesn't wait for the response; failures are printed
+  void write_value_async(uint16_t handle, const uint8_t * value, int length);
+  static void write_async_cb(bool success, uint8_t att_ecode, void * user_data);
+
+  // Sets up ATT and the GATT client on fd_ and waits for discovery to finish
+  void init(uint16_t mtu);
+
+  // Creates the ATT transport and the GATT client on fd, and drops them
+  bool attach(int fd);
+  void detach();
+
+  // Reconnection, all on the mainloop thread
+  void schedule_reconnect();
+  int open_connection();
+  static void reconnect_timeout_cb(int id, void * user_data);
+  static void connect_cb(int fd, uint32_t events, void * user_data);
+
+  // Link monitor, all on the mainloop thread
+  bool open_link_monitor(int dev_id);
+  void close_link_monitor();
+  void handle_link_event(const uint8_t * event, std::size_t length);
+  static void link_sample_cb(int id, void * user_data);
+  static void link_event_cb(int fd, uint32_t events, void * user_data);
+
+  // GATT database cache; empty if caching is disabled
+  std::string cache_path_;
+  bool cache_loaded_{false};
+
+  // The update completes at an instant at least 6 connection events out,
+  // which with a relaxed interval and slave latency can take seconds
+  static constexpr int connection_update_timeout_ms{5000};
+
+  // Queues a write command on the mainloop thread, applying the policy
+  void send_write_command(uint16_t handle, bool signed_write, const uint8_t * value, uint16_t length);
+  static void write_command_done_cb(void * user_data);
+
+  // Gives back the slot write_value() took, waking writers blocked on it
+  void release_write_slot();
+
+  // Write commands waiting in the ATT write queue, oldest first. They leave
+  // it in order, so write_command_done_cb always retires the front entry
+  struct WriteCommand
+  {
+    unsigned int id;
+    uint16_t handle;
+  };
+
+  std::deque<WriteCommand> write_commands_;
+  std::atomic<WritePolicy> write_policy_{WritePolicy::Block};
+  std::atomic<uint32_t> write_max_queued_{0};
+  std::atomic<uint32_t> write_depth_{0};
+  std::atomic<uint64_t> writes_submitted_{0};
+  std::atomic<uint64_t> writes_dropped_{0};
+  std::atomic<uint64_t> writes_replaced_{0};
+
+  // Services to discover while connecting; all if empty
+  std::vector<DiscoveryRange> discovery_ranges_;
+
+  std::unique_ptr<struct mainloop, decltype(&mainloop_free)> loop_{nullptr, mainloop_free};
+
   // Bluetooth socket
   int fd_{-1};                       
   struct bt_att * att_{nullptr};
   std::unique_ptr<L2CapSocket> l2_cap_socket_;
 
+  // Where the socket connects to, for clients created from an address
+  AdapterPool::Lease adapter_lease_;
+  bool has_address_{false};
+  bdaddr_t src_addr_{};
+  bdaddr_t dst_addr_{};
+  uint8_t dst_type_{BDADDR_LE_RANDOM};
+  int sec_{BT_SECURITY_LOW};
+  uint16_t mtu_{0};
+
+  ReconnectPolicy reconnect_policy_;
+  Connector connector_;
+  ReconnectStats reconnect_stats_;
+  std::atomic<bool> connected_{false};
+  bool reconnecting_{false};
+  bool reconnect_pending_{false};
+  int reconnect_timeout_id_{-1};
+  int connecting_fd_{-1};
+  std::chrono::milliseconds reconnect_delay_{0};
+  std::chrono::steady_clock::time_point disconnect_time_;
+
+  // Mainloop thread only; set on each new ATT transport by attach()
+  std::optional<std::array<uint8_t, 16>> sign_key_;
+  uint32_t sign_counter_{0};
+
+  LinkMonitorPolicy link_policy_;
+  bool link_monitoring_{false};
+  int link_timeout_id_{-1};
+  int link_dd_{-1};      // HCI socket of the adapter the link goes through
+  int link_dev_id_{-1};
+  int link_handle_{-1};
+  unsigned int link_pending_{0};  // commands of the last round still outstanding
+  unsigned int link_skipped_{0};
+  LinkQuality link_quality_;
+  mutable std::mutex link_mutex_;  // guards link_quality_ for other threads
+
   // GattClient
   struct gatt_db * db_{nullptr};
   struct bt_gatt_client * gatt_{nullptr};
@@ -91,6 +455,28 @@ protected:
   void process_input();
   std::unique_ptr<std::thread> input_thread_;
 
+  // Commands posted by other threads, drained on the mainloop thread when
+  // mainloop_wakeup() wakes the loop
+  struct Command : jeronibot::util::MpscQueue<Command>::Node
+  {
+    std::function<void()> work;
+  };
+
+  bool in_mainloop() const;
+
+  // Whether a request started now can complete: the loop is there to see
+  // the response and the link is up. Called from work run by invoke()
+  bool can_request() const;
+  void run_commands();
+  static void wakeup_cb(void * user_data);
+
+  jeronibot::util::MpscQueue<Command> commands_;
+  std::atomic<std::thread::id> loop_thread_id_;
+  std::atomic<bool> loop_running_{false};
+
+  // Serializes work run on the calling threads once the loop is down
+  std::recursive_mutex stopped_mutex_;
+
   std::mutex mutex_;
   std::condition_variable cv_;
   bool ready_{false};
@@ -98,6 +484,7 @@ protected:
 public:
   // TODO(mjeronimo): move to utils (or GattClient)
   static void print_uuid(const bt_uuid_t * uuid);
+  static const char * uuid_to_string(const bt_uuid_t * uuid, char (&uuid_str)[MAX_LEN_UUID_STR]);
   static void print_included_data(struct gatt_db_attribute * attr, void * user_data);
   static void print_descriptor(struct gatt_db_attribute * attr, void * user_data);
   static void print_characteristic(struct gatt_db_attribute * attr, void * user_data);
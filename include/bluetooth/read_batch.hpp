@@ -0,0 +1,104 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLUETOOTH__READ_BATCH_HPP_
+#define BLUETOOTH__READ_BATCH_HPP_
+
+#include <cstddef>
+#include <functional>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include <stdint.h>
+
+namespace bluetooth {
+
+// A set of characteristic values that are read together, with a single ATT
+// Read Multiple request, and decoded straight into a T. The response is the
+// values back to back with nothing in between, so all but the last one need
+// a fixed size; the last one gets whatever is left. It all has to fit in
+// ATT_MTU - 1 bytes, as a longer response is cut short. Set up once, then
+// poll with LEClient::read_batch()
+template<typename T>
+class ReadBatch
+{
+public:
+  using Decoder = std::function<void(std::span<const uint8_t> value, T & out)>;
+
+  // A value of size bytes; size 0 takes the rest of the response, so only
+  // the last value may have it
+  ReadBatch & add(uint16_t handle, std::size_t size, Decoder decoder)
+  {
+    if (!entries_.empty() && entries_.back().size == 0) {
+      throw std::logic_error("ReadBatch: Only the last value can have a variable size");
+    }
+
+    handles_.push_back(handle);
+    entries_.push_back({size, std::move(decoder)});
+    fixed_size_ += size;
+    return *this;
+  }
+
+  // A little-endian integer (or enum) of sizeof(V) bytes, into out.*member
+  template<typename V>
+  ReadBatch & add(uint16_t handle, V T::* member)
+  {
+    static_assert(std::is_integral_v<V> || std::is_enum_v<V>, "Only integers can be decoded without a decoder");
+
+    return add(handle, sizeof(V), [member](std::span<const uint8_t> value, T & out) {
+               uint64_t raw = 0;
+               for (std::size_t i = 0; i < sizeof(V); i++) {
+                 raw |= uint64_t(value[i]) << (8 * i);
+               }
+               out.*member = static_cast<V>(raw);
+             });
+  }
+
+  const std::vector<uint16_t> & get_handles() const { return handles_; }
+
+  // Hands each value in a response to its decoder; false if the response is
+  // too short to hold them
+  bool decode(std::span<const uint8_t> response, T & out) const
+  {
+    if (response.size() < fixed_size_) {
+      return false;
+    }
+
+    std::size_t offset = 0;
+    for (const Entry & entry : entries_) {
+      std::size_t size = entry.size ? entry.size : response.size() - offset;
+      entry.decoder(response.subspan(offset, size), out);
+      offset += size;
+    }
+
+    return true;
+  }
+
+protected:
+  struct Entry
+  {
+    std::size_t size;
+    Decoder decoder;
+  };
+
+  std::vector<uint16_t> handles_;
+  std::vector<Entry> entries_;
+  std::size_t fixed_size_{0};
+};
+
+}  // namespace bluetooth
+
+#endif  // BLUETOOTH__READ_BATCH_HPP_
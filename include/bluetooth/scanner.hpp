@@ -0,0 +1,143 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLUETOOTH__SCANNER_HPP_
+#define BLUETOOTH__SCANNER_HPP_
+
+#include <atomic>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+extern "C" {
+#include "bluetooth.h"
+#include "hci.h"
+}
+
+namespace bluetooth {
+
+// One advertising report. The views point into the HCI event being
+// dispatched, so they're only valid for the duration of the callback
+struct Advertisement
+{
+  // AD types from the Core Specification Supplement, Part A
+  enum Type : uint8_t
+  {
+    Flags = 0x01,
+    IncompleteServiceUuid16 = 0x02,
+    CompleteServiceUuid16 = 0x03,
+    ShortenedLocalName = 0x08,
+    CompleteLocalName = 0x09,
+    TxPowerLevel = 0x0a,
+    ManufacturerData = 0xff,
+  };
+
+  bdaddr_t address;
+  uint8_t address_type;  // LE_PUBLIC_ADDRESS or LE_RANDOM_ADDRESS
+  uint8_t event_type;    // ADV_IND, ADV_DIRECT_IND, ..., SCAN_RSP
+  int8_t rssi;           // dBm, 127 if unavailable
+  std::span<const uint8_t> data;
+
+  // The payload of the first AD structure of the given type, or an empty span
+  std::span<const uint8_t> find(uint8_t type) const;
+
+  // The complete local name, or the shortened one; empty if neither was sent
+  std::string_view local_name() const;
+
+  std::span<const uint8_t> manufacturer_data() const { return find(ManufacturerData); }
+
+  // Whether uuid is in the (complete or incomplete) 16-bit service UUID list
+  bool has_service_uuid16(uint16_t uuid) const;
+};
+
+// Streams LE advertising reports from an adapter. Known devices can be put
+// on the controller's accept list, in which case the controller drops the
+// advertisements of everyone else and the host isn't woken up for them
+class Scanner
+{
+public:
+  struct Parameters
+  {
+    // Active scanning asks for scan responses as well (which is usually where
+    // the name is)
+    bool active{false};
+
+    // In units of 0.625 ms; window <= interval
+    uint16_t interval{0x0010};
+    uint16_t window{0x0010};
+
+    // Have the controller report each device only once per scan
+    bool filter_duplicates{true};
+  };
+
+  // Called on the scanner's thread
+  using Callback = std::function<void(const Advertisement & advertisement)>;
+
+  // dev_id is the index of the adapter (as in hciX); -1 picks the first one
+  explicit Scanner(int dev_id = -1);
+  ~Scanner();
+
+  Scanner(const Scanner &) = delete;
+  Scanner & operator=(const Scanner &) = delete;
+
+  // Restricts the scan to the given devices. The list is loaded into the
+  // controller by start(), so it can't be changed while scanning
+  void add_device(const std::string & address, uint8_t address_type = LE_RANDOM_ADDRESS);
+  void clear_devices();
+
+  bool start(Callback callback);
+  bool start(Callback callback, const Parameters & parameters);
+  void stop();
+
+  bool is_scanning() const { return thread_.joinable(); }
+
+  // Reports that didn't make it past the host-side address check, which
+  // only applies when the accept list is too small for all of the devices
+  uint64_t get_filtered() const { return filtered_.load(std::memory_order_relaxed); }
+
+protected:
+  struct Device
+  {
+    bdaddr_t address;
+    uint8_t address_type;
+  };
+
+  bool load_accept_list();
+  bool is_known(const bdaddr_t & address, uint8_t address_type) const;
+
+  void run();
+  void dispatch(const uint8_t * event, std::size_t length);
+
+  int dev_id_{-1};
+  int dd_{-1};
+  int stop_fd_{-1};
+
+  std::vector<Device> devices_;
+  bool host_filter_{false};
+  std::atomic<uint64_t> filtered_{0};
+
+  Callback callback_;
+  std::thread thread_;
+
+  const int hci_timeout_ms{1000};
+};
+
+}  // namespace bluetooth
+
+#endif  // BLUETOOTH__SCANNER_HPP_
@@ -0,0 +1,80 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__MINIPRO_DECODER_HPP_
+#define MINIPRO__MINIPRO_DECODER_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <span>
+
+#include "minipro/packet.hpp"
+
+namespace jeronibot::minipro::packet
+{
+
+// A decoded frame. The payload refers either into the buffer that was passed
+// to Decoder::feed() or into the decoder's reassembly buffer, so it is only
+// valid for the duration of the callback
+struct Frame
+{
+  uint8_t type;
+  uint8_t operation;
+  uint8_t parameter;
+  std::span<const uint8_t> payload;
+};
+
+// Incremental decoder for 0x55aa frames. Frames that arrive whole within a
+// single notification are decoded in place; frames that are split across
+// notifications are reassembled in a fixed-size internal buffer
+class Decoder
+{
+public:
+  using FrameCallback = std::function<void(const Frame &)>;
+
+  struct Stats
+  {
+    uint64_t frames{0};
+    uint64_t checksum_errors{0};
+    uint64_t discarded_bytes{0};
+  };
+
+  explicit Decoder(FrameCallback callback);
+  Decoder() = delete;
+
+  void feed(std::span<const uint8_t> data);
+  void reset() { fill_ = 0; }
+
+  const Stats & get_stats() const { return stats_; }
+
+  // The length field is one byte, so this is the largest frame on the wire
+  static constexpr std::size_t max_frame_size = header_size + UINT8_MAX;
+
+protected:
+  std::size_t feed_unbuffered(std::span<const uint8_t> data);
+  std::size_t feed_buffered(std::span<const uint8_t> data);
+  bool emit(std::span<const uint8_t> frame);
+
+  FrameCallback callback_;
+  Stats stats_;
+
+  std::array<uint8_t, max_frame_size> buffer_;
+  std::size_t fill_{0};
+};
+
+}  // namespace jeronibot::minipro::packet
+
+#endif  // MINIPRO__MINIPRO_DECODER_HPP_
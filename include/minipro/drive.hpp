@@ -22,14 +22,25 @@
 namespace jeronibot::minipro::packet
 {
 
-class Drive : public Packet
+class Drive : public Packet<Command, ControlDriveBase, SetDrive, 4>
 {
 public:
-  Drive(uint16_t throttle, uint16_t steering);
+  constexpr Drive(uint16_t throttle, uint16_t steering)
+  : Packet({lo(throttle), hi(throttle), lo(steering), hi(steering)})
+  {
+  }
+
   Drive() = delete;
 };
 
+static_assert(Drive::size == 12, "Drive: unexpected wire size");
+static_assert(Drive(0x1234, 0xabcd).get_bytes()[2] == 0x06, "Drive: bad length");
+static_assert(Drive(0x1234, 0xabcd).get_bytes()[5] == SetDrive, "Drive: bad parameter");
+static_assert(Drive(0x1234, 0xabcd).get_bytes()[6] == 0x34, "Drive: throttle is not little-endian");
+static_assert(Drive(0x1234, 0xabcd).get_bytes()[9] == 0xab, "Drive: steering is not little-endian");
+static_assert(Drive(0x1234, 0xabcd).get_bytes()[10] == 0xb3, "Drive: bad checksum");
+static_assert(Drive(0x1234, 0xabcd).get_bytes()[11] == 0xfd, "Drive: bad checksum");
+
 }  // namespace jeronibot::minipro::packet
 
 #endif  // MINIPRO__MINIPRO_DRIVE_HPP_
-
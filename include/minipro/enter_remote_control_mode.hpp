@@ -20,13 +20,23 @@
 namespace jeronibot::minipro::packet
 {
 
-class EnterRemoteControlMode : public Packet
+class EnterRemoteControlMode : public Packet<Command, ControlDriveBase, EnableRemoteControl, 2>
 {
 public:
-  EnterRemoteControlMode();
+  constexpr EnterRemoteControlMode()
+  : Packet({lo(0x0001), hi(0x0001)})
+  {
+  }
 };
 
+static_assert(EnterRemoteControlMode::size == 10, "EnterRemoteControlMode: unexpected wire size");
+static_assert(EnterRemoteControlMode().get_bytes()[0] == 0x55, "EnterRemoteControlMode: bad header");
+static_assert(EnterRemoteControlMode().get_bytes()[1] == 0xaa, "EnterRemoteControlMode: bad header");
+static_assert(EnterRemoteControlMode().get_bytes()[2] == 0x04, "EnterRemoteControlMode: bad length");
+static_assert(EnterRemoteControlMode().get_bytes()[6] == 0x01, "EnterRemoteControlMode: bad payload");
+static_assert(EnterRemoteControlMode().get_bytes()[8] == 0x73, "EnterRemoteControlMode: bad checksum");
+static_assert(EnterRemoteControlMode().get_bytes()[9] == 0xff, "EnterRemoteControlMode: bad checksum");
+
 }  // namespace jeronibot::minipro::packet
 
 #endif  // MINIPRO__MINIPRO_ENTER_REMOTE_CONTROL_MODE_HPP_
-
@@ -20,13 +20,20 @@
 namespace jeronibot::minipro::packet
 {
 
-class ExitRemoteControlMode : public Packet
+class ExitRemoteControlMode : public Packet<Command, ControlDriveBase, EnableRemoteControl, 2>
 {
 public:
-  ExitRemoteControlMode();
+  constexpr ExitRemoteControlMode()
+  : Packet({lo(0x0000), hi(0x0000)})
+  {
+  }
 };
 
-}  // namespace jeronibot::minipro:;packet
+static_assert(ExitRemoteControlMode::size == 10, "ExitRemoteControlMode: unexpected wire size");
+static_assert(ExitRemoteControlMode().get_bytes()[6] == 0x00, "ExitRemoteControlMode: bad payload");
+static_assert(ExitRemoteControlMode().get_bytes()[8] == 0x74, "ExitRemoteControlMode: bad checksum");
+static_assert(ExitRemoteControlMode().get_bytes()[9] == 0xff, "ExitRemoteControlMode: bad checksum");
 
-#endif  // MINIPRO__MINIPRO_EXIT_REMOTE_CONTROL_MODE_HPP_
+}  // namespace jeronibot::minipro::packet
 
+#endif  // MINIPRO__MINIPRO_EXIT_REMOTE_CONTROL_MODE_HPP_
@@ -15,12 +15,17 @@
 #ifndef MINIPRO__MINIPRO_HPP_
 #define MINIPRO__MINIPRO_HPP_
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <future>
+#include <mutex>
 #include <string>
-#include <vector>
 
 #include "bluetooth/le_client.hpp"
+#include "minipro/decoder.hpp"
 #include "minipro/packet.hpp"
+#include "minipro/telemetry.hpp"
 #include "util/units.hpp"
 
 namespace jeronibot::minipro
@@ -29,13 +34,21 @@ namespace jeronibot::minipro
 class MiniPro : public bluetooth::LEClient
 {
 public:
-  explicit MiniPro(const std::string & bt_address);
+  // cache_dir enables the on-disk GATT cache, see LEClient
+  explicit MiniPro(const std::string & bt_address, const std::string & cache_dir = std::string());
+  // Talk to a vehicle over an already-connected ATT socket, e.g. a Simulator
+  explicit MiniPro(int fd, const std::string & cache_path = std::string());
   MiniPro() = delete;
+  ~MiniPro() override;
 
-  units::velocity::miles_per_hour_t get_current_speed();
-  units::current::ampere_t get_battery_level();
-  units::voltage::volt_t get_voltage();
-  units::temperature::fahrenheit_t get_vehicle_temperature();
+  // The getters read the latest telemetry reported by the vehicle without
+  // blocking or going over the air, so they are safe to call every tick
+  Telemetry get_telemetry() const { return telemetry_.get(); }
+
+  units::velocity::miles_per_hour_t get_current_speed() const;
+  units::current::ampere_t get_battery_level() const;
+  units::voltage::volt_t get_voltage() const;
+  units::temperature::fahrenheit_t get_vehicle_temperature() const;
 
   void enable_notifications();
   void disable_notifications();
@@ -44,12 +57,104 @@ public:
   void drive(int16_t throttle, int16_t steering);
   void exit_remote_control_mode();
 
+  // While the drive pacer runs, drive() only posts the newest command to a
+  // single-slot mailbox and returns; the mainloop thread sends whatever is
+  // newest at the given rate, so stale commands are never sent
+  void start_drive_pacer(units::frequency::hertz_t rate);
+  void stop_drive_pacer();
+
+  // Connection parameters switched to when entering and after exiting
+  // remote control mode, on Bluetooth connections. The switch happens in
+  // the background, as the controller takes a few connection events
+  void set_connection_profiles(const ConnectionParameters & driving, const ConnectionParameters & parked);
+
+  // When the link comes back, the last drive command is only resent if it
+  // was issued this recently; otherwise the vehicle is told to stand still
+  static constexpr std::chrono::milliseconds restore_drive_max_age{250};
+
+  // How the drive pacer and the connection back off while the link monitor
+  // (see LEClient::start_link_monitor) scores the link as weak. Below
+  // degraded_score the pacer slows down to degraded_rate and, in remote
+  // control mode, the connection switches to degraded_profile, with its
+  // longer supervision timeout. Both are restored once the score is back
+  // above recovered_score
+  struct LinkAdaptation
+  {
+    float degraded_score{0.35f};
+    float recovered_score{0.55f};
+    units::frequency::hertz_t degraded_rate{10};
+    ConnectionParameters degraded_profile{robust_teleop};
+  };
+
+  void set_link_adaptation(const LinkAdaptation & adaptation);
+  void disable_link_adaptation();
+  bool is_link_degraded() const { return link_degraded_.load(std::memory_order_relaxed); }
+
 protected:
-  void send_packet(packet::Packet & packet);
-  void write_config_value(uint16_t value);
+  template<typename PacketT>
+  void send_packet(const PacketT & packet)
+  {
+    const auto & bytes = packet.get_bytes();
+    write_value(tx_service_handle_, bytes.data(), bytes.size(), true);
+  }
+
+  // Without wait, the write goes out behind whatever is queued and the
+  // response isn't waited for
+  void write_config_value(uint16_t value, bool wait = true);
+
+  // Re-enables notifications, then re-enters remote control mode and resends
+  // the last safe drive command, all pipelined on the new connection
+  void on_reconnected() override;
+
+  // Moves between the driving and the degraded settings as the score
+  // crosses the adaptation thresholds
+  void on_link_quality(const LinkQuality & quality) override;
+
+  // Feeds the vehicle's notifications to the decoder
+  unsigned int subscribe_telemetry();
 
+  // Called on the mainloop thread for each valid frame the vehicle sends
+  virtual void handle_frame(const packet::Frame & frame);
+
+  // The vehicle's serial service, the only one MiniPro needs discovered
+  static constexpr const char * uart_service_uuid{"6e400001-b5a3-f393-e0a9-e50e24dcca9e"};
+
+  const uint16_t notify_value_handle_{0x000b};
   const uint16_t config_service_handle_{0x000c};
   const uint16_t tx_service_handle_{0x00e};
+
+  static void drive_pacer_cb(int id, void * user_data);
+
+  void switch_connection_profile(const ConnectionParameters & profile);
+
+  // The driving profile, or the degraded one while the link is weak. Only
+  // called on the mainloop thread, which owns the profiles
+  ConnectionParameters get_driving_profile() const;
+
+  // Written and read on the mainloop thread only
+  ConnectionParameters driving_profile_{low_latency_teleop};
+  ConnectionParameters parked_profile_{idle_telemetry};
+  std::future<bool> connection_update_;
+  std::mutex connection_update_mutex_;  // switched from the mainloop thread too
+
+  LinkAdaptation link_adaptation_;
+  bool link_adaptation_enabled_{false};
+  std::atomic<bool> link_degraded_{false};
+  std::atomic<unsigned int> degraded_period_ms_{0};
+
+  // Throttle in the low 16 bits, steering in the next 16 and has_command
+  // set once anything has been posted
+  static constexpr uint64_t has_command{1ull << 32};
+  std::atomic<uint64_t> drive_mailbox_{0};
+  std::atomic<unsigned int> pacer_period_ms_{0};
+  std::atomic<int64_t> last_drive_ns_{0};  // steady_clock
+  std::atomic<bool> remote_control_{false};
+  std::atomic<bool> notifications_enabled_{false};
+  int pacer_timeout_id_{-1};
+
+  unsigned int notify_id_{0};
+  packet::Decoder decoder_;
+  TelemetryCache telemetry_;
 };
 
 }  // namespace jeronibot::minipro
@@ -15,31 +15,84 @@
 #ifndef MINIPRO__MINIPRO_PACKET_HPP_
 #define MINIPRO__MINIPRO_PACKET_HPP_
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <vector>
 
 namespace jeronibot::minipro::packet
 {
 
+enum packet_type : uint8_t { Command = 0xa, Notification = 0xd };
+enum operation : uint8_t { GetSetValue = 0x01, ControlDriveBase = 0x03 };
+enum parameter : uint8_t
+{
+  // Telemetry registers, reported by the vehicle in Notification packets
+  CurrentSpeed = 0x26, BodyTemperature = 0x3e, BatteryVoltage = 0x47, BatteryCurrent = 0x50,
+
+  EnableRemoteControl = 0x7a, SetDrive = 0x7b
+};
+
+// Wire layout of a MiniPRO packet:
+//
+//   0x55 0xaa | length | type | operation | parameter | payload... | checksum (LE)
+//
+// where length counts the payload and the checksum, and the checksum is the
+// inverted 16-bit sum of length, type, operation, parameter and payload
+constexpr uint16_t header{0x55aa};
+constexpr std::size_t header_size{6};
+constexpr std::size_t checksum_size{2};
+
+constexpr uint8_t lo(uint16_t value) { return static_cast<uint8_t>(value & 0xff); }
+constexpr uint8_t hi(uint16_t value) { return static_cast<uint8_t>(value >> 8); }
+
+template<uint8_t Type, uint8_t Operation, uint8_t Parameter, std::size_t PayloadSize>
 class Packet
 {
 public:
-  Packet(const uint8_t type, const uint8_t operation, const uint8_t parameter);
+  static constexpr std::size_t payload_size = PayloadSize;
+  static constexpr std::size_t size = header_size + PayloadSize + checksum_size;
+  static constexpr uint8_t length = PayloadSize + checksum_size;
 
-  std::vector<uint8_t> get_bytes();
+  using Payload = std::array<uint8_t, PayloadSize>;
+  using Bytes = std::array<uint8_t, size>;
+
+  static_assert(length <= UINT8_MAX, "Packet: payload does not fit the length field");
+
+  constexpr const Bytes & get_bytes() const { return bytes_; }
 
 protected:
-  enum packet_type : uint8_t { Command = 0xa, Notification = 0xd };
-  enum operation : uint8_t { GetSetValue = 0x01, ControlDriveBase = 0x03 };
-  enum parameter : uint8_t { EnableRemoteControl = 0x7a, SetDrive = 0x7b };
-
-  const uint16_t header_{ 0x55aa };
-  uint8_t length_{0};
-  const uint8_t type_{0};
-  const uint8_t operation_{0};
-  const uint8_t parameter_{0};
-  std::vector<uint8_t> payload_;
-  uint16_t checksum_{0};
+  constexpr explicit Packet(const Payload & payload)
+  : bytes_(encode(payload))
+  {
+  }
+
+  static constexpr Bytes encode(const Payload & payload)
+  {
+    Bytes bytes{};
+
+    bytes[0] = hi(header);
+    bytes[1] = lo(header);
+    bytes[2] = length;
+    bytes[3] = Type;
+    bytes[4] = Operation;
+    bytes[5] = Parameter;
+
+    // The constant part of the checksum folds away at compile time, leaving
+    // only the payload bytes to be summed
+    uint16_t sum = length + Type + Operation + Parameter;
+    for (std::size_t i = 0; i < PayloadSize; i++) {
+      bytes[header_size + i] = payload[i];
+      sum += payload[i];
+    }
+
+    uint16_t checksum = sum ^ 0xffff;
+    bytes[header_size + PayloadSize] = lo(checksum);
+    bytes[header_size + PayloadSize + 1] = hi(checksum);
+
+    return bytes;
+  }
+
+  Bytes bytes_;
 };
 
 }  // namespace jeronibot::minipro::packet
@@ -0,0 +1,152 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__MINIPRO_SIMULATOR_HPP_
+#define MINIPRO__MINIPRO_SIMULATOR_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "minipro/decoder.hpp"
+#include "util/units.hpp"
+
+namespace jeronibot::minipro
+{
+
+// In-process stand-in for a MiniPRO. It serves the vehicle's GATT table over
+// one end of a SOCK_SEQPACKET socketpair, executes the packets written to it
+// and reports telemetry as notifications. Hand get_client_handle() to a
+// MiniPro (or any LEClient) in place of an L2CAP connection
+class Simulator
+{
+public:
+  // Every PDU the simulator sends is delayed by link_latency, standing in for
+  // the connection interval of a real link
+  explicit Simulator(
+    units::frequency::hertz_t telemetry_rate = units::frequency::hertz_t(10),
+    std::chrono::microseconds link_latency = std::chrono::microseconds(7500));
+  ~Simulator();
+
+  // The client end of the socketpair. Ownership passes to the caller; an
+  // LEClient closes it when it is destroyed
+  int get_client_handle() { return client_fd_; }
+
+  // Drops the link as a vehicle going out of range would. Like the real
+  // vehicle, it leaves remote control mode and stops notifying
+  void disconnect();
+
+  // Accepts a new connection, dropping the current one if there is one, and
+  // returns the client end; use it as an LEClient's reconnect connector
+  int connect();
+
+  // Report telemetry at this rate while notifications are enabled
+  void set_telemetry_rate(units::frequency::hertz_t rate);
+
+  struct VehicleState
+  {
+    bool remote_control{false};
+    bool notifications{false};
+    int16_t throttle{0};
+    int16_t steering{0};
+    double speed{0};          // km/h
+    double voltage{63.0};     // V
+    double current{0};        // A
+    double temperature{25.0};  // degC
+  };
+
+  VehicleState get_vehicle_state();
+
+  uint64_t get_drive_count() const { return drive_count_.load(std::memory_order_relaxed); }
+  uint64_t get_notification_count() const { return notification_count_.load(std::memory_order_relaxed); }
+
+  // Handles of the vehicle's GATT table, matching the real device
+  static constexpr uint16_t notify_value_handle{0x000b};
+  static constexpr uint16_t config_handle{0x000c};
+  static constexpr uint16_t tx_value_handle{0x000e};
+
+protected:
+  struct Attribute
+  {
+    uint16_t handle;
+    std::vector<uint8_t> type;   // 2 or 16 bytes, little-endian
+    std::vector<uint8_t> value;
+    uint16_t group_end;          // services only
+  };
+
+  void build_attribute_table();
+  void add_service(uint16_t handle, uint16_t end, std::vector<uint8_t> uuid);
+  void add_characteristic(uint16_t handle, uint8_t properties, std::vector<uint8_t> uuid, std::vector<uint8_t> value);
+  void add_descriptor(uint16_t handle, uint16_t uuid, std::vector<uint8_t> value);
+  Attribute * find_attribute(uint16_t handle);
+
+  void run();
+  void handle_pdu(const uint8_t * pdu, std::size_t length);
+  void handle_read_by_group_type(const uint8_t * pdu, std::size_t length);
+  void handle_find_by_type_value(const uint8_t * pdu, std::size_t length);
+  void handle_read_by_type(const uint8_t * pdu, std::size_t length);
+  void handle_find_information(const uint8_t * pdu, std::size_t length);
+  void handle_read(const uint8_t * pdu, std::size_t length);
+  void handle_read_multiple(const uint8_t * pdu, std::size_t length);
+  void handle_write(uint8_t opcode, const uint8_t * pdu, std::size_t length);
+  void handle_frame(const packet::Frame & frame);
+
+  void send_pdu(std::vector<uint8_t> pdu);
+  void flush_pending(std::chrono::steady_clock::time_point now);
+  void send_error(uint8_t request_opcode, uint16_t handle, uint8_t ecode);
+  void send_telemetry();
+  void step_model(double dt);
+  void wakeup();
+
+  // Drops the state the vehicle only keeps for the life of a connection
+  void reset_link();
+
+  int fd_{-1};
+  int client_fd_{-1};
+  int wakeup_fd_{-1};
+  uint16_t mtu_{23};
+
+  // PDUs waiting out the link latency, in the order they were sent
+  std::chrono::microseconds link_latency_;
+  std::deque<std::pair<std::chrono::steady_clock::time_point, std::vector<uint8_t>>> pending_;
+
+  std::vector<Attribute> attributes_;
+  packet::Decoder decoder_;
+
+  std::mutex mutex_;
+  VehicleState state_;
+  std::atomic<unsigned int> telemetry_period_us_{0};
+  std::chrono::steady_clock::time_point last_step_;
+
+  std::atomic<uint64_t> drive_count_{0};
+  std::atomic<uint64_t> notification_count_{0};
+
+  // Server end of the connection accepted by connect(), adopted by the
+  // simulator thread; guarded by mutex_
+  int next_fd_{-1};
+  std::atomic<bool> drop_link_{false};
+
+  std::atomic<bool> should_exit_{false};
+  std::unique_ptr<std::thread> thread_;
+};
+
+}  // namespace jeronibot::minipro
+
+#endif  // MINIPRO__MINIPRO_SIMULATOR_HPP_
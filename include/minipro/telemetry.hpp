@@ -0,0 +1,57 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MINIPRO__MINIPRO_TELEMETRY_HPP_
+#define MINIPRO__MINIPRO_TELEMETRY_HPP_
+
+#include <chrono>
+#include <cstdint>
+
+#include "minipro/decoder.hpp"
+#include "util/seq_lock.hpp"
+
+namespace jeronibot::minipro
+{
+
+// Most recent raw register values reported by the vehicle, in the units the
+// vehicle uses on the wire
+struct Telemetry
+{
+  int16_t speed{0};            // 0.001 km/h
+  int16_t battery_current{0};  // 0.01 A
+  uint16_t voltage{0};         // 0.01 V
+  int16_t temperature{0};      // 0.1 degC
+
+  // When any of the values above last changed; zero if nothing was received
+  std::chrono::steady_clock::time_point timestamp;
+};
+
+// Telemetry snapshot updated by the mainloop thread as frames are decoded and
+// read by any number of threads without locking
+class TelemetryCache
+{
+public:
+  // Writer side; only called on the mainloop thread
+  bool update(const packet::Frame & frame);
+
+  Telemetry get() const { return snapshot_.load(); }
+
+protected:
+  Telemetry current_;
+  util::SeqLock<Telemetry> snapshot_;
+};
+
+}  // namespace jeronibot::minipro
+
+#endif  // MINIPRO__MINIPRO_TELEMETRY_HPP_
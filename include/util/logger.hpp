@@ -0,0 +1,342 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__LOGGER_HPP_
+#define UTIL__LOGGER_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// Log statements below this level are compiled out: 0 keeps everything, 5
+// (Off) removes them all
+#ifndef JERONIBOT_LOG_LEVEL
+#define JERONIBOT_LOG_LEVEL 0
+#endif
+
+namespace jeronibot::util
+{
+
+enum class LogLevel : uint8_t
+{
+  Trace,
+  Debug,
+  Info,
+  Warn,
+  Error,
+  Off,
+};
+
+// A byte string to be logged as hex, e.g. an attribute value. At most
+// max_length bytes are kept; use "%s" for it in the format
+struct LogBytes
+{
+  static constexpr std::size_t max_length{128};
+
+  const uint8_t * data;
+  std::size_t length;
+};
+
+// How each kind of argument is stored in a log record and turned back into
+// something printf takes on the logging thread. Scalars are copied as is;
+// strings are copied (up to max_length) since they may not outlive the call
+template<typename T, typename Enable = void>
+struct LogArg
+{
+  static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>,
+    "Only scalars, strings and LogBytes can be logged");
+
+  static std::size_t size(const T &) { return sizeof(T); }
+  static void encode(uint8_t *& p, const T & value) { std::memcpy(p, &value, sizeof(T)); p += sizeof(T); }
+  static T decode(const uint8_t *& p, std::deque<std::string> &)
+  {
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+  }
+};
+
+template<>
+struct LogArg<const char *>
+{
+  static constexpr std::size_t max_length{256};
+
+  static std::size_t size(const char * value) { return sizeof(uint16_t) + length(value); }
+  static std::size_t length(const char * value) { return value ? strnlen(value, max_length) : 0; }
+
+  static void encode(uint8_t *& p, const char * value)
+  {
+    uint16_t n = length(value);
+    std::memcpy(p, &n, sizeof(n));
+    std::memcpy(p + sizeof(n), value, n);
+    p += sizeof(n) + n;
+  }
+
+  static const char * decode(const uint8_t *& p, std::deque<std::string> & scratch)
+  {
+    uint16_t n;
+    std::memcpy(&n, p, sizeof(n));
+    scratch.emplace_back(reinterpret_cast<const char *>(p + sizeof(n)), n);
+    p += sizeof(n) + n;
+    return scratch.back().c_str();
+  }
+};
+
+template<>
+struct LogArg<LogBytes>
+{
+  static std::size_t size(const LogBytes & value) { return sizeof(uint8_t) + length(value); }
+  static std::size_t length(const LogBytes & value) { return std::min(value.length, LogBytes::max_length); }
+
+  static void encode(uint8_t *& p, const LogBytes & value)
+  {
+    uint8_t n = length(value);
+    *p = n;
+    std::memcpy(p + 1, value.data, n);
+    p += 1 + n;
+  }
+
+  // Formatted here rather than by the caller: "01 02 03"
+  static const char * decode(const uint8_t *& p, std::deque<std::string> & scratch)
+  {
+    static constexpr char hexdigits[] = "0123456789abcdef";
+
+    uint8_t n = *p++;
+    std::string & hex = scratch.emplace_back();
+    for (uint8_t i = 0; i < n; i++) {
+      if (i) {
+        hex += ' ';
+      }
+      hex += hexdigits[p[i] >> 4];
+      hex += hexdigits[p[i] & 0xf];
+    }
+    p += n;
+    return hex.c_str();
+  }
+};
+
+// What an argument is stored as: arrays and char pointers become strings
+template<typename T>
+using log_arg_t = std::conditional_t<std::is_convertible_v<const T &, const char *>, const char *, std::decay_t<T>>;
+
+// Asynchronous logger. Each thread writes binary records (a timestamp, the
+// format string and the raw arguments) into a ring buffer of its own, which
+// takes no locks and never blocks: a record that doesn't fit is dropped and
+// counted. A background thread merges the rings in timestamp order and does
+// the formatting and the I/O. Format strings must be string literals, as
+// only the pointer is recorded
+class Logger
+{
+public:
+  static Logger & instance();
+
+  static bool enabled(LogLevel level) { return level >= level_.load(std::memory_order_relaxed); }
+  static void set_level(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+  static LogLevel get_level() { return level_.load(std::memory_order_relaxed); }
+
+  // Where formatted records go; stdout by default
+  void set_output(FILE * output);
+
+  template<typename... Args>
+  void log(LogLevel level, const char * format, const Args &... args)
+  {
+    std::size_t size = sizeof(Record) + (LogArg<log_arg_t<Args>>::size(args) + ... + 0);
+
+    Buffer * buffer = thread_buffer();
+    uint8_t * p = buffer->reserve(size);
+    if (!p) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    Record * record = reinterpret_cast<Record *>(p);
+    record->size = Buffer::align(size);
+    record->level = level;
+    record->timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+    record->format = format;
+    record->print = &print<log_arg_t<Args>...>;
+
+    p += sizeof(Record);
+    (LogArg<log_arg_t<Args>>::encode(p, args), ...);
+
+    buffer->commit();
+  }
+
+  // Waits until everything logged before the call has been written out
+  void flush();
+
+  // Records dropped because their thread's ring was full
+  uint64_t get_dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+protected:
+  Logger();
+  Logger(const Logger &) = delete;
+  Logger & operator=(const Logger &) = delete;
+
+  using PrintFn = void (*)(FILE *, const char *, const uint8_t *, std::deque<std::string> &);
+
+  struct Record
+  {
+    uint32_t size;  // including this header and padding; a null print marks a gap
+    LogLevel level;
+    int64_t timestamp;
+    const char * format;
+    PrintFn print;
+  };
+
+  template<typename... Args>
+  static void print(FILE * output, const char * format, const uint8_t * p, std::deque<std::string> & scratch)
+  {
+    // Braced initialization decodes the arguments left to right
+    std::tuple<decltype(LogArg<Args>::decode(p, scratch))...> args{LogArg<Args>::decode(p, scratch)...};
+    std::apply([&](auto... values) {print_format(output, format, values...);}, args);
+  }
+
+  template<typename... Args>
+  static void print_format(FILE * output, const char * format, Args... args)
+  {
+    if constexpr (sizeof...(Args) == 0) {
+      std::fputs(format, output);
+    } else {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+      std::fprintf(output, format, args...);
+#pragma GCC diagnostic pop
+    }
+  }
+
+  // Single-producer, single-consumer byte ring: the owning thread appends
+  // records, the logging thread consumes them
+  struct Buffer
+  {
+    static constexpr std::size_t capacity{64 * 1024};
+
+    static constexpr std::size_t align(std::size_t size) { return (size + 7) & ~std::size_t(7); }
+
+    // Room for size bytes, contiguous, or null if the ring is full
+    uint8_t * reserve(std::size_t size)
+    {
+      size = align(size);
+      uint64_t head = head_.load(std::memory_order_relaxed);
+      std::size_t offset = head & (capacity - 1);
+      std::size_t contiguous = capacity - offset;
+
+      // A record never wraps; the end of the ring is skipped instead
+      std::size_t needed = size > contiguous ? contiguous + size : size;
+      if (head + needed - tail_cache_ > capacity) {
+        tail_cache_ = tail_.load(std::memory_order_acquire);
+        if (head + needed - tail_cache_ > capacity) {
+          return nullptr;
+        }
+      }
+
+      if (size > contiguous) {
+        if (contiguous >= sizeof(Record)) {
+          Record * gap = reinterpret_cast<Record *>(data_.get() + offset);
+          gap->size = contiguous;
+          gap->print = nullptr;
+        }
+        head += contiguous;
+        offset = 0;
+      }
+
+      reserved_ = head + size;
+      return data_.get() + offset;
+    }
+
+    void commit() { head_.store(reserved_, std::memory_order_release); }
+
+    alignas(64) std::atomic<uint64_t> head_{0};
+    uint64_t reserved_{0};
+    uint64_t tail_cache_{0};
+
+    alignas(64) std::atomic<uint64_t> tail_{0};
+
+    // Set once the owning thread has exited; freed when drained
+    std::atomic<bool> retired_{false};
+    std::unique_ptr<uint8_t[]> data_{new uint8_t[capacity]};
+  };
+
+  // Registers a ring for the calling thread on its first record
+  struct BufferHandle
+  {
+    BufferHandle();
+    ~BufferHandle();
+
+    Buffer * buffer;
+  };
+
+  static Buffer * thread_buffer()
+  {
+    thread_local BufferHandle handle;
+    return handle.buffer;
+  }
+
+  void run();
+  void drain();
+
+  static inline std::atomic<LogLevel> level_{LogLevel::Info};
+
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<FILE *> output_{stdout};
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  std::condition_variable flushed_cv_;
+  std::vector<Buffer *> buffers_;
+  uint64_t flush_requested_{0};
+  uint64_t flushed_{0};
+  std::thread thread_;
+};
+
+// Whether statements at level are compiled in at all. Compared as levels,
+// as an int comparison against the default of 0 trips -Wtype-limits
+constexpr bool log_compiled(LogLevel level)
+{
+  return level >= static_cast<LogLevel>(JERONIBOT_LOG_LEVEL);
+}
+
+}  // namespace jeronibot::util
+
+#define JERONIBOT_LOG(level, ...) \
+  do { \
+    if constexpr (::jeronibot::util::log_compiled(level)) { \
+      if (::jeronibot::util::Logger::enabled(level)) { \
+        ::jeronibot::util::Logger::instance().log(level, __VA_ARGS__); \
+      } \
+    } \
+  } while (0)
+
+#define JERONIBOT_LOG_TRACE(...) JERONIBOT_LOG(::jeronibot::util::LogLevel::Trace, __VA_ARGS__)
+#define JERONIBOT_LOG_DEBUG(...) JERONIBOT_LOG(::jeronibot::util::LogLevel::Debug, __VA_ARGS__)
+#define JERONIBOT_LOG_INFO(...) JERONIBOT_LOG(::jeronibot::util::LogLevel::Info, __VA_ARGS__)
+#define JERONIBOT_LOG_WARN(...) JERONIBOT_LOG(::jeronibot::util::LogLevel::Warn, __VA_ARGS__)
+#define JERONIBOT_LOG_ERROR(...) JERONIBOT_LOG(::jeronibot::util::LogLevel::Error, __VA_ARGS__)
+
+#endif  // UTIL__LOGGER_HPP_
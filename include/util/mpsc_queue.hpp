@@ -0,0 +1,81 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__MPSC_QUEUE_HPP_
+#define UTIL__MPSC_QUEUE_HPP_
+
+#include <atomic>
+
+namespace jeronibot::util
+{
+
+// Intrusive multi-producer, single-consumer queue. Producers push with a
+// single CAS and never block each other; the consumer takes everything that
+// has been pushed so far in one exchange and walks it in FIFO order. T must
+// derive from MpscQueue<T>::Node, and the queue never owns the nodes
+template<typename T>
+class MpscQueue
+{
+public:
+  struct Node
+  {
+    Node * next{nullptr};
+  };
+
+  MpscQueue() = default;
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue & operator=(const MpscQueue &) = delete;
+
+  // Safe to call from any thread. Returns true if the queue was empty, in
+  // which case the caller is the one that has to wake the consumer up
+  bool push(T * item)
+  {
+    Node * node = item;
+    Node * head = head_.load(std::memory_order_relaxed);
+    do {
+      node->next = head;
+    } while (!head_.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+
+    return head == nullptr;
+  }
+
+  // Consumer side. Takes every item pushed so far and returns the oldest,
+  // with the rest linked in push order; use next() to walk them
+  T * take_all()
+  {
+    Node * node = head_.exchange(nullptr, std::memory_order_acquire);
+
+    // The stack is newest first; reverse it to get submission order
+    Node * oldest = nullptr;
+    while (node) {
+      Node * next = node->next;
+      node->next = oldest;
+      oldest = node;
+      node = next;
+    }
+
+    return static_cast<T *>(oldest);
+  }
+
+  static T * next(T * item) { return static_cast<T *>(static_cast<Node *>(item)->next); }
+
+  bool empty() const { return head_.load(std::memory_order_relaxed) == nullptr; }
+
+protected:
+  std::atomic<Node *> head_{nullptr};
+};
+
+}  // namespace jeronibot::util
+
+#endif  // UTIL__MPSC_QUEUE_HPP_
@@ -0,0 +1,92 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTIL__SEQ_LOCK_HPP_
+#define UTIL__SEQ_LOCK_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace jeronibot::util
+{
+
+// Single-writer sequence lock. The writer never blocks and readers never
+// take a lock; a reader that overlaps a store simply retries. The value is
+// held in relaxed atomic words so that the overlapping copy is well defined
+template<typename T>
+class SeqLock
+{
+public:
+  static_assert(std::is_trivially_copyable_v<T>, "SeqLock: T must be trivially copyable");
+
+  SeqLock()
+  {
+    store(T{});
+  }
+
+  explicit SeqLock(const T & value)
+  {
+    store(value);
+  }
+
+  // Must only be called from one thread at a time
+  void store(const T & value)
+  {
+    std::array<uint64_t, words> buffer{};
+    std::memcpy(buffer.data(), &value, sizeof(T));
+
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (std::size_t i = 0; i < words; i++) {
+      data_[i].store(buffer[i], std::memory_order_relaxed);
+    }
+
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  T load() const
+  {
+    std::array<uint64_t, words> buffer;
+    uint32_t before;
+    uint32_t after;
+
+    do {
+      before = seq_.load(std::memory_order_acquire);
+      for (std::size_t i = 0; i < words; i++) {
+        buffer[i] = data_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq_.load(std::memory_order_relaxed);
+    } while (before != after || (before & 1));
+
+    T value;
+    std::memcpy(static_cast<void *>(&value), buffer.data(), sizeof(T));
+    return value;
+  }
+
+protected:
+  static constexpr std::size_t words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint32_t> seq_{0};
+  std::array<std::atomic<uint64_t>, words> data_;
+};
+
+}  // namespace jeronibot::util
+
+#endif  // UTIL__SEQ_LOCK_HPP_
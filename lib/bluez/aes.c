@@ -0,0 +1,416 @@
+/**
+ * @file aes.c
+ * @brief AES-128 and AES-CMAC in userspace, for crypto.c
+ *
+ * Uses AES-NI where the CPU has it and a portable implementation
+ * elsewhere. Keys, blocks and MACs are in the order FIPS-197 and RFC 4493
+ * use, most significant octet first, as with the kernel's AF_ALG ciphers.
+ *
+ * The portable implementation looks up the S-box by secret data, so unlike
+ * AES-NI it isn't constant time.
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2020  Michael Jeronimo
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AESNI 1
+#endif
+
+#include "aes.h"
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint8_t rcon[10] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36,
+};
+
+/**
+ * Whether impl can run on this CPU
+ *
+ * @param impl		implementation to check
+ * @return		true if it can be used
+ */
+bool bt_aes_impl_supported(enum bt_aes_impl impl)
+{
+	switch (impl) {
+	case BT_AES_IMPL_PORTABLE:
+		return true;
+	case BT_AES_IMPL_AESNI:
+#ifdef HAVE_AESNI
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("aes") &&
+					__builtin_cpu_supports("sse2");
+#else
+		return false;
+#endif
+	}
+
+	return false;
+}
+
+/**
+ * The fastest implementation this CPU supports
+ *
+ * @return		AES-NI if available, the portable one otherwise
+ */
+enum bt_aes_impl bt_aes_best_impl(void)
+{
+	if (bt_aes_impl_supported(BT_AES_IMPL_AESNI))
+		return BT_AES_IMPL_AESNI;
+
+	return BT_AES_IMPL_PORTABLE;
+}
+
+static void expand_key(const uint8_t key[16], uint8_t round_keys[11 * 16])
+{
+	uint8_t *w = round_keys;
+	int i;
+
+	memcpy(w, key, 16);
+
+	for (i = 16; i < 11 * 16; i += 4) {
+		uint8_t t[4];
+
+		memcpy(t, w + i - 4, 4);
+
+		if (i % 16 == 0) {
+			/* RotWord, SubWord and the round constant */
+			uint8_t t0 = t[0];
+
+			t[0] = sbox[t[1]] ^ rcon[i / 16 - 1];
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[t0];
+		}
+
+		w[i] = w[i - 16] ^ t[0];
+		w[i + 1] = w[i - 15] ^ t[1];
+		w[i + 2] = w[i - 14] ^ t[2];
+		w[i + 3] = w[i - 13] ^ t[3];
+	}
+}
+
+static inline uint8_t xtime(uint8_t x)
+{
+	return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+static void encrypt_portable(const uint8_t round_keys[11 * 16],
+					const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t s[16], t[16];
+	int round, i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ round_keys[i];
+
+	for (round = 1; round <= 10; round++) {
+		/* SubBytes and ShiftRows; the state is column major */
+		for (i = 0; i < 16; i++)
+			t[i] = sbox[s[(i + 4 * (i % 4)) % 16]];
+
+		/* MixColumns, skipped in the last round */
+		if (round < 10) {
+			for (i = 0; i < 16; i += 4) {
+				uint8_t a0 = t[i], a1 = t[i + 1];
+				uint8_t a2 = t[i + 2], a3 = t[i + 3];
+				uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+
+				t[i] = a0 ^ all ^ xtime(a0 ^ a1);
+				t[i + 1] = a1 ^ all ^ xtime(a1 ^ a2);
+				t[i + 2] = a2 ^ all ^ xtime(a2 ^ a3);
+				t[i + 3] = a3 ^ all ^ xtime(a3 ^ a0);
+			}
+		}
+
+		for (i = 0; i < 16; i++)
+			s[i] = t[i] ^ round_keys[16 * round + i];
+	}
+
+	memcpy(out, s, 16);
+}
+
+#ifdef HAVE_AESNI
+__attribute__((target("aes,sse2")))
+static void encrypt_aesni(const uint8_t round_keys[11 * 16],
+					const uint8_t in[16], uint8_t out[16])
+{
+	const __m128i *rk = (const __m128i *) round_keys;
+	__m128i b;
+	int i;
+
+	b = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+						_mm_loadu_si128(rk));
+
+	for (i = 1; i < 10; i++)
+		b = _mm_aesenc_si128(b, _mm_loadu_si128(rk + i));
+
+	b = _mm_aesenclast_si128(b, _mm_loadu_si128(rk + 10));
+
+	_mm_storeu_si128((__m128i *) out, b);
+}
+#endif
+
+/**
+ * Encrypt a single block with AES-128
+ *
+ * @param aes		key set up with bt_aes128_init
+ * @param in		plaintext block
+ * @param out		ciphertext block, may be the same as in
+ */
+void bt_aes128_encrypt(const struct bt_aes128 *aes, const uint8_t in[16],
+						uint8_t out[16])
+{
+#ifdef HAVE_AESNI
+	if (aes->impl == BT_AES_IMPL_AESNI) {
+		encrypt_aesni(aes->round_keys, in, out);
+		return;
+	}
+#endif
+
+	encrypt_portable(aes->round_keys, in, out);
+}
+
+/* Shift left by one bit, folding the carry back in as RFC 4493 does */
+static void cmac_subkey(const uint8_t in[16], uint8_t out[16])
+{
+	uint8_t msb = in[0] & 0x80;
+	int i;
+
+	for (i = 0; i < 15; i++)
+		out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+
+	out[15] = (in[15] << 1) ^ (msb ? 0x87 : 0x00);
+}
+
+/**
+ * Set up an AES-128 key, and the AES-CMAC subkeys that go with it
+ *
+ * @param aes		context to set up
+ * @param impl		implementation to use, see bt_aes_impl_supported
+ * @param key		128-bit key
+ */
+void bt_aes128_init(struct bt_aes128 *aes, enum bt_aes_impl impl,
+						const uint8_t key[16])
+{
+	uint8_t l[16];
+
+	aes->impl = impl;
+	expand_key(key, aes->round_keys);
+
+	memset(l, 0, sizeof(l));
+	bt_aes128_encrypt(aes, l, l);
+
+	cmac_subkey(l, aes->k1);
+	cmac_subkey(aes->k1, aes->k2);
+}
+
+/* Number of blocks CMAC processes for a message of msg_len octets */
+static size_t cmac_blocks(size_t msg_len)
+{
+	return msg_len ? (msg_len + 15) / 16 : 1;
+}
+
+/*
+ * XOR block i of msg into x. The last block is padded if short (or empty)
+ * and masked with K2, or masked with K1 if complete
+ */
+static void cmac_xor_block(const struct bt_aes128 *aes, const uint8_t *msg,
+					size_t msg_len, size_t i, uint8_t x[16])
+{
+	size_t last_len, j;
+
+	if (i < cmac_blocks(msg_len) - 1) {
+		for (j = 0; j < 16; j++)
+			x[j] ^= msg[16 * i + j];
+		return;
+	}
+
+	last_len = msg_len - 16 * i;
+
+	if (last_len == 16) {
+		for (j = 0; j < 16; j++)
+			x[j] ^= msg[16 * i + j] ^ aes->k1[j];
+		return;
+	}
+
+	for (j = 0; j < last_len; j++)
+		x[j] ^= msg[16 * i + j];
+	x[last_len] ^= 0x80;
+
+	for (j = 0; j < 16; j++)
+		x[j] ^= aes->k2[j];
+}
+
+/**
+ * AES-CMAC as specified in RFC 4493
+ *
+ * @param aes		key set up with bt_aes128_init
+ * @param msg		message to authenticate
+ * @param msg_len	length of msg, in octets
+ * @param mac		128-bit message authentication code
+ */
+void bt_aes_cmac(const struct bt_aes128 *aes, const uint8_t *msg,
+						size_t msg_len, uint8_t mac[16])
+{
+	uint8_t x[16];
+	size_t blocks, i;
+
+	blocks = cmac_blocks(msg_len);
+
+	memset(x, 0, sizeof(x));
+
+	for (i = 0; i < blocks; i++) {
+		cmac_xor_block(aes, msg, msg_len, i, x);
+		bt_aes128_encrypt(aes, x, i == blocks - 1 ? mac : x);
+	}
+}
+
+/* Number of CMACs bt_aes_cmac_batch keeps in flight at once */
+#define CMAC_LANES	4
+
+#ifdef HAVE_AESNI
+/*
+ * Encrypt a block for each lane. The lanes are independent, so each
+ * round's AESENC instructions overlap instead of waiting on each other
+ */
+__attribute__((target("aes,sse2")))
+static void encrypt_aesni_lanes(const uint8_t round_keys[11 * 16],
+				uint8_t blocks[CMAC_LANES][16], unsigned int lanes)
+{
+	const __m128i *rk = (const __m128i *) round_keys;
+	__m128i b[CMAC_LANES], k;
+	unsigned int l;
+	int i;
+
+	k = _mm_loadu_si128(rk);
+	for (l = 0; l < lanes; l++)
+		b[l] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) blocks[l]),
+									k);
+
+	for (i = 1; i < 10; i++) {
+		k = _mm_loadu_si128(rk + i);
+		for (l = 0; l < lanes; l++)
+			b[l] = _mm_aesenc_si128(b[l], k);
+	}
+
+	k = _mm_loadu_si128(rk + 10);
+	for (l = 0; l < lanes; l++)
+		_mm_storeu_si128((__m128i *) blocks[l],
+					_mm_aesenclast_si128(b[l], k));
+}
+#endif
+
+/**
+ * AES-CMAC of several messages under the same key. With AES-NI up to
+ * CMAC_LANES messages are processed side by side, which takes little more
+ * time than one of them alone
+ *
+ * @param aes		key set up with bt_aes128_init
+ * @param msgs		messages to authenticate, and where their MACs go
+ * @param count		number of messages
+ */
+void bt_aes_cmac_batch(const struct bt_aes128 *aes,
+			const struct bt_aes_cmac_msg *msgs, unsigned int count)
+{
+#ifdef HAVE_AESNI
+	uint8_t x[CMAC_LANES][16];
+	size_t blocks[CMAC_LANES], max_blocks, i;
+	unsigned int n, l, lanes;
+#endif
+	unsigned int m;
+
+#ifdef HAVE_AESNI
+	if (aes->impl == BT_AES_IMPL_AESNI) {
+		for (n = 0; n < count; n += lanes) {
+			lanes = count - n < CMAC_LANES ? count - n : CMAC_LANES;
+
+			max_blocks = 0;
+			for (l = 0; l < lanes; l++) {
+				blocks[l] = cmac_blocks(msgs[n + l].len);
+				if (blocks[l] > max_blocks)
+					max_blocks = blocks[l];
+				memset(x[l], 0, 16);
+			}
+
+			/* Lanes that are done just go along for the ride */
+			for (i = 0; i < max_blocks; i++) {
+				for (l = 0; l < lanes; l++)
+					if (i < blocks[l])
+						cmac_xor_block(aes, msgs[n + l].msg,
+							msgs[n + l].len, i, x[l]);
+
+				encrypt_aesni_lanes(aes->round_keys, x, lanes);
+
+				for (l = 0; l < lanes; l++)
+					if (i == blocks[l] - 1)
+						memcpy(msgs[n + l].mac, x[l], 16);
+			}
+		}
+		return;
+	}
+#endif
+
+	for (m = 0; m < count; m++)
+		bt_aes_cmac(aes, msgs[m].msg, msgs[m].len, msgs[m].mac);
+}
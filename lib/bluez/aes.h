@@ -0,0 +1,59 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2020  Michael Jeronimo
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum bt_aes_impl {
+	BT_AES_IMPL_PORTABLE,
+	BT_AES_IMPL_AESNI,
+};
+
+/* An expanded AES-128 key, with the AES-CMAC subkeys derived from it */
+struct bt_aes128 {
+	uint8_t round_keys[11 * 16];
+	uint8_t k1[16];
+	uint8_t k2[16];
+	enum bt_aes_impl impl;
+};
+
+bool bt_aes_impl_supported(enum bt_aes_impl impl);
+enum bt_aes_impl bt_aes_best_impl(void);
+
+void bt_aes128_init(struct bt_aes128 *aes, enum bt_aes_impl impl,
+						const uint8_t key[16]);
+void bt_aes128_encrypt(const struct bt_aes128 *aes, const uint8_t in[16],
+						uint8_t out[16]);
+void bt_aes_cmac(const struct bt_aes128 *aes, const uint8_t *msg,
+						size_t msg_len, uint8_t mac[16]);
+
+/* One message of a bt_aes_cmac_batch call */
+struct bt_aes_cmac_msg {
+	const uint8_t *msg;
+	size_t len;
+	uint8_t *mac;
+};
+
+void bt_aes_cmac_batch(const struct bt_aes128 *aes,
+			const struct bt_aes_cmac_msg *msgs, unsigned int count);
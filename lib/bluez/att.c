@@ -38,11 +38,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include "io.h"
 #include "queue.h"
 #include "util.h"
-#include "timeout.h"
+#include "mainloop.h"
 #include "bluetooth.h"
 #include "uuid.h"
 #include "att.h"
@@ -64,6 +65,8 @@ struct att_send_op;
 struct bt_att {
 	/// reference counter incremented by bt_att_ref, decremented by bt_att_unref
 	int ref_count;
+	/// loop the io and the timeouts run on
+	struct mainloop *loop;
 	/// socket
 	int fd;
 	/// io structure for low level i/o (read and write)
@@ -86,6 +89,8 @@ struct bt_att {
 	bool writer_active;
 	/// List of registered callbacks
 	struct queue *notify_list;
+	/// The same callbacks by the opcodes they handle, created on demand
+	struct queue *notify_index[UINT8_MAX + 1];
 	/// List of disconnect handlers
 	struct queue *disconn_list;
 	/// There's a pending incoming request
@@ -118,10 +123,18 @@ struct bt_att {
 	struct sign_info *local_sign;
 	/// remote key structure pointer
 	struct sign_info *remote_sign;
+	/// queue and notification latency histograms
+	struct bt_att_histogram latency[BT_ATT_LATENCY_COUNT];
+	/// request round trip histograms by request opcode, allocated on use
+	struct bt_att_histogram *rtt[256];
+	/// when the last notification or indication arrived, in ns
+	uint64_t last_notify_time;
 };
 
 struct sign_info {
 	uint8_t key[16];
+	/// the key, set up for signing; NULL without a crypto context
+	struct bt_crypto_signer *signer;
 	bt_att_counter_func_t counter;
 	void *user_data;
 };
@@ -215,7 +228,10 @@ static uint8_t get_req_opcode(uint8_t rsp_opcode)
 
 struct att_send_op {
 	unsigned int id;
-	unsigned int timeout_id;
+	/// channel it was sent on, once it's pending
+	struct bt_att *att;
+	/// its ATT timeout on the channel's loop, -1 if none
+	int timeout_id;
 	enum att_op_type type;
 	uint16_t opcode;
 	void *pdu;
@@ -223,8 +239,70 @@ struct att_send_op {
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	/// signed command whose signature is filled in when it's dequeued
+	bool sign_pending;
+	/// sign counter taken for it; kept if the PDU is replaced
+	bool has_sign_cnt;
+	uint32_t sign_cnt;
+	/// CLOCK_MONOTONIC time when queued and when written, in ns
+	uint64_t queue_time;
+	uint64_t send_time;
 };
 
+static uint64_t time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int histogram_index(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < (1 << BT_ATT_HIST_SUB_BITS))
+		return value;
+
+	if (value >> BT_ATT_HIST_MAX_BITS)
+		value = (1ULL << BT_ATT_HIST_MAX_BITS) - 1;
+
+	msb = 63 - __builtin_clzll(value);
+
+	return ((msb - BT_ATT_HIST_SUB_BITS + 1) << BT_ATT_HIST_SUB_BITS) +
+		(value >> (msb - BT_ATT_HIST_SUB_BITS)) -
+		(1 << BT_ATT_HIST_SUB_BITS);
+}
+
+/* Largest value that lands in the bucket */
+static uint64_t histogram_bucket_max(unsigned int index)
+{
+	unsigned int shift;
+	uint64_t sub;
+
+	if (index < (1 << BT_ATT_HIST_SUB_BITS))
+		return index;
+
+	shift = (index >> BT_ATT_HIST_SUB_BITS) - 1;
+	sub = index & ((1 << BT_ATT_HIST_SUB_BITS) - 1);
+
+	return (((1ULL << BT_ATT_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static void histogram_record(struct bt_att_histogram *hist, uint64_t value)
+{
+	if (!hist->count || value < hist->min)
+		hist->min = value;
+
+	if (value > hist->max)
+		hist->max = value;
+
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[histogram_index(value)]++;
+}
+
 /**
  * @brief destroy att send operation
  * calls the destroy callback with user_data as an argument
@@ -236,8 +314,8 @@ static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
 
-	if (op->timeout_id)
-		timeout_remove(op->timeout_id);
+	if (op->timeout_id >= 0)
+		mainloop_remove_timeout(op->att->loop, op->timeout_id);
 
 	if (op->destroy)
 		op->destroy(op->user_data);
@@ -308,15 +386,26 @@ static bool match_disconn_id(const void *a, const void *b)
 	return disconn->id == id;
 }
 
+/* Signed commands waiting in the write queue are signed this many at a time */
+#define ATT_SIGN_BATCH	8
+
+/*
+ * The signature is left for sign_queued_ops, so that a run of signed
+ * commands is signed in one pass as the writer gets to them
+ */
 static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 					const void *pdu, uint16_t length)
 {
 	uint16_t pdu_len = 1;
 	struct sign_info *sign = att->local_sign;
-	uint32_t sign_cnt;
 
-	if (sign && (op->opcode & ATT_OP_SIGNED_MASK))
+	if (sign && (op->opcode & ATT_OP_SIGNED_MASK)) {
+		/* Without a signer the signature could never be filled in */
+		if (!sign->signer)
+			return false;
+
 		pdu_len += BT_ATT_SIGNATURE_LEN;
+	}
 
 	if (length && pdu)
 		pdu_len += length;
@@ -333,22 +422,62 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 	if (pdu_len > 1)
 		memcpy(op->pdu + 1, pdu, length);
 
-	if (!sign || !(op->opcode & ATT_OP_SIGNED_MASK))
-		return true;
+	if (sign && (op->opcode & ATT_OP_SIGNED_MASK)) {
+		memset(op->pdu + 1 + length, 0, BT_ATT_SIGNATURE_LEN);
+		op->sign_pending = true;
+	}
 
-	if (!sign->counter(&sign_cnt, sign->user_data))
-		goto fail;
+	return true;
+}
 
-	if ((bt_crypto_sign_att(att->crypto, sign->key, op->pdu, 1 + length,
-				sign_cnt, &((uint8_t *) op->pdu)[1 + length])))
-		return true;
+/*
+ * Sign op, which is about to be written, along with the signed commands
+ * queued behind it. Counters are taken in queue order, which is the order
+ * the commands go out in; a command that already has one (its PDU was
+ * replaced) keeps it
+ */
+static bool sign_queued_ops(struct bt_att *att, struct att_send_op *op)
+{
+	struct bt_crypto_sign_req reqs[ATT_SIGN_BATCH];
+	struct att_send_op *ops[ATT_SIGN_BATCH];
+	struct sign_info *sign = att->local_sign;
+	const struct queue_entry *entry;
+	unsigned int count = 0, i;
 
-	util_debug(att->debug_callback, att->debug_data,
-					"ATT unable to generate signature");
+	if (!sign || !sign->signer)
+		return false;
 
-fail:
-	free(op->pdu);
-	return false;
+	ops[count++] = op;
+
+	for (entry = queue_get_entries(att->write_queue);
+			entry && count < ATT_SIGN_BATCH; entry = entry->next) {
+		struct att_send_op *next = entry->data;
+
+		if (next->sign_pending)
+			ops[count++] = next;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!ops[i]->has_sign_cnt) {
+			if (!sign->counter(&ops[i]->sign_cnt, sign->user_data))
+				break;
+			ops[i]->has_sign_cnt = true;
+		}
+
+		reqs[i].m = ops[i]->pdu;
+		reqs[i].m_len = ops[i]->len - BT_ATT_SIGNATURE_LEN;
+		reqs[i].sign_cnt = ops[i]->sign_cnt;
+		reqs[i].signature = (uint8_t *) ops[i]->pdu + reqs[i].m_len;
+	}
+
+	count = i;
+	if (!count || !bt_crypto_signer_sign_batch(sign->signer, reqs, count))
+		return false;
+
+	for (i = 0; i < count; i++)
+		ops[i]->sign_pending = false;
+
+	return true;
 }
 
 static struct att_send_op *create_att_send_op(struct bt_att *att,
@@ -388,6 +517,7 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 
 	op->type = op_type;
 	op->opcode = opcode;
+	op->timeout_id = -1;
 	op->callback = callback;
 	op->destroy = destroy;
 	op->user_data = user_data;
@@ -430,27 +560,21 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	return NULL;
 }
 
-struct timeout_data {
-	struct bt_att *att;
-	unsigned int id;
-};
-
-static bool timeout_cb(void *user_data)
+/*
+ * The timeout is removed along with the op, so the op is still the
+ * pending request or indication when it fires
+ */
+static void timeout_cb(int id, void *user_data)
 {
-	struct timeout_data *timeout = user_data;
-	struct bt_att *att = timeout->att;
-	struct att_send_op *op = NULL;
+	struct att_send_op *op = user_data;
+	struct bt_att *att = op->att;
 
-	if (att->pending_req && att->pending_req->id == timeout->id) {
-		op = att->pending_req;
+	if (att->pending_req == op)
 		att->pending_req = NULL;
-	} else if (att->pending_ind && att->pending_ind->id == timeout->id) {
-		op = att->pending_ind;
+	else if (att->pending_ind == op)
 		att->pending_ind = NULL;
-	}
-
-	if (!op)
-		return false;
+	else
+		return;
 
 	util_debug(att->debug_callback, att->debug_data,
 				"Operation timed out: 0x%02x", op->opcode);
@@ -458,7 +582,6 @@ static bool timeout_cb(void *user_data)
 	if (att->timeout_callback)
 		att->timeout_callback(op->id, op->opcode, att->timeout_data);
 
-	op->timeout_id = 0;
 	destroy_att_send_op(op);
 
 	/*
@@ -467,8 +590,6 @@ static bool timeout_cb(void *user_data)
 	 * io and notify the upper layer.
 	 */
 	io_shutdown(att->io);
-
-	return false;
 }
 
 static void write_watch_destroy(void *user_data)
@@ -482,7 +603,6 @@ static bool can_write_data(struct io *io, void *user_data)
 {
 	struct bt_att *att = user_data;
 	struct att_send_op *op;
-	struct timeout_data *timeout;
 	ssize_t ret;
 	struct iovec iov;
 
@@ -490,6 +610,13 @@ static bool can_write_data(struct io *io, void *user_data)
 	if (!op)
 		return false;
 
+	if (op->sign_pending && !sign_queued_ops(att, op)) {
+		util_debug(att->debug_callback, att->debug_data,
+					"ATT unable to generate signature");
+		destroy_att_send_op(op);
+		return true;
+	}
+
 	iov.iov_base = op->pdu;
 	iov.iov_len = op->len;
 
@@ -510,6 +637,14 @@ static bool can_write_data(struct io *io, void *user_data)
 
 	util_hexdump('<', op->pdu, ret, att->debug_callback, att->debug_data);
 
+	op->send_time = time_now();
+	if (op->type == ATT_OP_TYPE_REQ)
+		histogram_record(&att->latency[BT_ATT_LATENCY_REQ_QUEUE],
+					op->send_time - op->queue_time);
+	else if (op->type == ATT_OP_TYPE_CMD)
+		histogram_record(&att->latency[BT_ATT_LATENCY_CMD_QUEUE],
+					op->send_time - op->queue_time);
+
 	/* Based on the operation type, set either the pending request or the
 	 * pending indication. If it came from the write queue, then there is
 	 * no need to keep it around.
@@ -534,14 +669,10 @@ static bool can_write_data(struct io *io, void *user_data)
 		return true;
 	}
 
-	timeout = new0(struct timeout_data, 1);
-	if (!timeout)
-		return true;
-
-	timeout->att = att;
-	timeout->id = op->id;
-	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
-								timeout, free);
+	/* A pooled timer on the loop's wheel, keyed by the op itself */
+	op->att = att;
+	op->timeout_id = mainloop_add_timeout(att->loop, ATT_TIMEOUT_INTERVAL,
+							timeout_cb, op, NULL);
 
 	/* Return true as there may be more operations ready to write. */
 	return true;
@@ -714,6 +845,13 @@ fail:
 	rsp_opcode = BT_ATT_OP_ERROR_RSP;
 
 done:
+	if (!att->rtt[op->opcode & 0xff])
+		att->rtt[op->opcode & 0xff] = new0(struct bt_att_histogram, 1);
+
+	if (att->rtt[op->opcode & 0xff])
+		histogram_record(att->rtt[op->opcode & 0xff],
+					time_now() - op->send_time);
+
 	if (op->callback)
 		op->callback(rsp_opcode, rsp_pdu, rsp_pdu_len, op->user_data);
 
@@ -765,6 +903,50 @@ static bool opcode_match(uint8_t opcode, uint8_t test_opcode)
 	return opcode == test_opcode;
 }
 
+/**
+ * @brief add a registered callback to the dispatch list of every opcode it
+ * handles, so that handle_notify() doesn't have to walk all of them
+ *
+ * @param att			ATT transport
+ * @param notify		callback registered with bt_att_register()
+ *
+ * @return true on success, false if out of memory
+ */
+static bool index_notify(struct bt_att *att, struct att_notify *notify)
+{
+	unsigned int i;
+
+	for (i = 0; i <= UINT8_MAX; i++) {
+		if (!opcode_match(notify->opcode, i))
+			continue;
+
+		if (!att->notify_index[i]) {
+			att->notify_index[i] = queue_new();
+			if (!att->notify_index[i])
+				return false;
+		}
+
+		if (!queue_push_tail(att->notify_index[i], notify))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief remove a callback from the dispatch lists index_notify() put it on
+ *
+ * @param att			ATT transport
+ * @param notify		callback registered with bt_att_register()
+ */
+static void unindex_notify(struct bt_att *att, struct att_notify *notify)
+{
+	unsigned int i;
+
+	for (i = 0; i <= UINT8_MAX; i++)
+		queue_remove(att->notify_index[i], notify);
+}
+
 static void respond_not_supported(struct bt_att *att, uint8_t opcode)
 {
 	struct bt_att_pdu_error_rsp pdu;
@@ -800,7 +982,7 @@ static bool handle_signed(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 		goto fail;
 
 	/* Generate signature and verify it */
-	if (!bt_crypto_sign_att(att->crypto, sign->key, pdu,
+	if (!bt_crypto_signer_sign(sign->signer, pdu,
 				pdu_len - BT_ATT_SIGNATURE_LEN, sign_cnt,
 				signature))
 		goto fail;
@@ -818,6 +1000,7 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
 	const struct queue_entry *entry;
+	struct queue *handlers;
 	bool found;
 
 	if ((opcode & ATT_OP_SIGNED_MASK) && !att->ext_signed) {
@@ -828,17 +1011,15 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 
 	bt_att_ref(att);
 
+	/* Only the callbacks registered for this opcode */
 	found = false;
-	entry = queue_get_entries(att->notify_list);
+	handlers = att->notify_index[opcode];
+	entry = queue_get_entries(handlers);
 
 	while (entry) {
 		struct att_notify *notify = entry->data;
 
 		entry = entry->next;
-
-		if (!opcode_match(notify->opcode, opcode))
-			continue;
-
 		found = true;
 
 		if (notify->callback)
@@ -846,7 +1027,7 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 							notify->user_data);
 
 		/* callback could remove all entries from notify list */
-		if (queue_isempty(att->notify_list))
+		if (queue_isempty(handlers))
 			break;
 	}
 
@@ -912,11 +1093,24 @@ static bool can_read_data(struct io *io, void *user_data)
 
 		att->in_req = true;
 
-		/* Fall through to the next case */
-	case ATT_OP_TYPE_CMD:
+		/* fall through */
 	case ATT_OP_TYPE_NOT:
-	case ATT_OP_TYPE_UNKNOWN:
 	case ATT_OP_TYPE_IND:
+		if (opcode == BT_ATT_OP_HANDLE_VAL_NOT ||
+					opcode == BT_ATT_OP_HANDLE_VAL_IND) {
+			uint64_t now = time_now();
+
+			if (att->last_notify_time)
+				histogram_record(&att->latency[
+					BT_ATT_LATENCY_NOTIFY_INTERVAL],
+					now - att->last_notify_time);
+
+			att->last_notify_time = now;
+		}
+
+		/* fall through */
+	case ATT_OP_TYPE_CMD:
+	case ATT_OP_TYPE_UNKNOWN:
 	default:
 		/* For all other opcodes notify the upper layer of the PDU and
 		 * let them act on it.
@@ -957,8 +1151,19 @@ static bool is_io_l2cap_based(int fd)
 	return proto == BTPROTO_L2CAP;
 }
 
+static void sign_free(struct sign_info *sign)
+{
+	if (!sign)
+		return;
+
+	bt_crypto_signer_free(sign->signer);
+	free(sign);
+}
+
 static void bt_att_free(struct bt_att *att)
 {
+	int i;
+
 	if (att->pending_req)
 		destroy_att_send_op(att->pending_req);
 
@@ -972,6 +1177,8 @@ static void bt_att_free(struct bt_att *att)
 	queue_destroy(att->ind_queue, NULL);
 	queue_destroy(att->write_queue, NULL);
 	queue_destroy(att->notify_list, NULL);
+	for (i = 0; i <= UINT8_MAX; i++)
+		queue_destroy(att->notify_index[i], NULL);
 	queue_destroy(att->disconn_list, NULL);
 
 	if (att->timeout_destroy)
@@ -980,15 +1187,18 @@ static void bt_att_free(struct bt_att *att)
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
-	free(att->local_sign);
-	free(att->remote_sign);
+	sign_free(att->local_sign);
+	sign_free(att->remote_sign);
+
+	for (i = 0; i < 256; i++)
+		free(att->rtt[i]);
 
 	free(att->buf);
 
 	free(att);
 }
 
-struct bt_att *bt_att_new(int fd, bool ext_signed)
+struct bt_att *bt_att_new(struct mainloop *loop, int fd, bool ext_signed)
 {
 	struct bt_att *att;
 
@@ -1006,7 +1216,8 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	if (!att->buf)
 		goto fail;
 
-	att->io = io_new(fd);
+	att->loop = loop;
+	att->io = io_new(loop, fd);
 	if (!att->io)
 		goto fail;
 
@@ -1237,6 +1448,7 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 		att->next_send_id = 1;
 
 	op->id = att->next_send_id++;
+	op->queue_time = time_now();
 
 	/* Add the op to the correct queue based on its type */
 	switch (op->type) {
@@ -1317,6 +1529,48 @@ done:
 	return true;
 }
 
+/**
+ * @brief replace the PDU of an operation that is still waiting in the
+ * write queue; it keeps its place in the queue and its callbacks
+ *
+ * @param att		ATT structure pointer
+ * @param id		id returned by bt_att_send
+ * @param pdu		new PDU, without the opcode
+ * @param length	length of the new PDU
+ *
+ * @return			true if the operation was still queued and was updated
+ */
+bool bt_att_replace(struct bt_att *att, unsigned int id,
+					const void *pdu, uint16_t length)
+{
+	struct att_send_op *op;
+	void *old_pdu;
+	uint16_t old_len;
+	bool old_sign_pending;
+
+	if (!att || !id)
+		return false;
+
+	op = queue_find(att->write_queue, match_op_id, UINT_TO_PTR(id));
+	if (!op)
+		return false;
+
+	old_pdu = op->pdu;
+	old_len = op->len;
+	old_sign_pending = op->sign_pending;
+
+	if (!encode_pdu(att, op, pdu, length)) {
+		op->pdu = old_pdu;
+		op->len = old_len;
+		op->sign_pending = old_sign_pending;
+		return false;
+	}
+
+	free(old_pdu);
+
+	return true;
+}
+
 bool bt_att_cancel_all(struct bt_att *att)
 {
 	if (!att)
@@ -1410,7 +1664,14 @@ unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 
 	notify->id = att->next_reg_id++;
 
+	if (!index_notify(att, notify)) {
+		unindex_notify(att, notify);
+		free(notify);
+		return 0;
+	}
+
 	if (!queue_push_tail(att->notify_list, notify)) {
+		unindex_notify(att, notify);
 		free(notify);
 		return 0;
 	}
@@ -1430,15 +1691,20 @@ bool bt_att_unregister(struct bt_att *att, unsigned int id)
 	if (!notify)
 		return false;
 
+	unindex_notify(att, notify);
 	destroy_att_notify(notify);
 	return true;
 }
 
 bool bt_att_unregister_all(struct bt_att *att)
 {
+	unsigned int i;
+
 	if (!att)
 		return false;
 
+	for (i = 0; i <= UINT8_MAX; i++)
+		queue_remove_all(att->notify_index[i], NULL, NULL, NULL);
 	queue_remove_all(att->notify_list, NULL, NULL, destroy_att_notify);
 	queue_remove_all(att->disconn_list, NULL, NULL, destroy_att_disconn);
 
@@ -1487,8 +1753,9 @@ bool bt_att_set_security(struct bt_att *att, int level)
 	return true;
 }
 
-static bool sign_set_key(struct sign_info **sign, uint8_t key[16],
-				bt_att_counter_func_t func, void *user_data)
+static bool sign_set_key(struct bt_att *att, struct sign_info **sign,
+				uint8_t key[16], bt_att_counter_func_t func,
+				void *user_data)
 {
 	if (!(*sign)) {
 		*sign = new0(struct sign_info, 1);
@@ -1496,10 +1763,37 @@ static bool sign_set_key(struct sign_info **sign, uint8_t key[16],
 			return false;
 	}
 
+	/*
+	 * The subkeys are worked out once here rather than for every PDU.
+	 * Without a signer, signed sends fail rather than go out under the
+	 * old key
+	 */
+	bt_crypto_signer_free((*sign)->signer);
+	(*sign)->signer = bt_crypto_signer_new(att->crypto, key);
+
 	(*sign)->counter = func;
 	(*sign)->user_data = user_data;
 	memcpy((*sign)->key, key, 16);
 
+	if (!(*sign)->signer)
+		return false;
+
+	/*
+	 * Commands signed in a batch ahead of being written carry the old
+	 * key's signature; sign them again, keeping their counters
+	 */
+	if (*sign == att->local_sign) {
+		const struct queue_entry *entry;
+
+		for (entry = queue_get_entries(att->write_queue); entry;
+							entry = entry->next) {
+			struct att_send_op *op = entry->data;
+
+			if (op->has_sign_cnt)
+				op->sign_pending = true;
+		}
+	}
+
 	return true;
 }
 
@@ -1509,7 +1803,7 @@ bool bt_att_set_local_key(struct bt_att *att, uint8_t sign_key[16],
 	if (!att)
 		return false;
 
-	return sign_set_key(&att->local_sign, sign_key, func, user_data);
+	return sign_set_key(att, &att->local_sign, sign_key, func, user_data);
 }
 
 bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
@@ -1518,7 +1812,19 @@ bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
 	if (!att)
 		return false;
 
-	return sign_set_key(&att->remote_sign, sign_key, func, user_data);
+	return sign_set_key(att, &att->remote_sign, sign_key, func, user_data);
+}
+
+/**
+ * @brief the loop the transport runs on
+ *
+ * @param att		ATT structure pointer
+ *
+ * @return			the loop passed to bt_att_new, or NULL
+ */
+struct mainloop *bt_att_get_mainloop(struct bt_att *att)
+{
+	return att ? att->loop : NULL;
 }
 
 bool bt_att_has_crypto(struct bt_att *att)
@@ -1528,3 +1834,99 @@ bool bt_att_has_crypto(struct bt_att *att)
 
 	return att->crypto ? true : false;
 }
+
+/**
+ * @brief copy one of the latency histograms
+ *
+ * @param att		ATT structure pointer
+ * @param type		which histogram
+ * @param hist		receives the histogram
+ *
+ * @return			true on success
+ */
+bool bt_att_get_latency(struct bt_att *att, enum bt_att_latency type,
+					struct bt_att_histogram *hist)
+{
+	if (!att || !hist || type >= BT_ATT_LATENCY_COUNT)
+		return false;
+
+	memcpy(hist, &att->latency[type], sizeof(*hist));
+
+	return true;
+}
+
+/**
+ * @brief copy the round trip histogram, from writing a request to handling
+ * its response, of one request opcode
+ *
+ * @param att		ATT structure pointer
+ * @param req_opcode	request opcode
+ * @param hist		receives the histogram
+ *
+ * @return			false if no response to req_opcode was received
+ */
+bool bt_att_get_rtt(struct bt_att *att, uint8_t req_opcode,
+					struct bt_att_histogram *hist)
+{
+	if (!att || !hist || !att->rtt[req_opcode])
+		return false;
+
+	memcpy(hist, att->rtt[req_opcode], sizeof(*hist));
+
+	return true;
+}
+
+void bt_att_reset_latency(struct bt_att *att)
+{
+	int i;
+
+	if (!att)
+		return;
+
+	memset(att->latency, 0, sizeof(att->latency));
+
+	for (i = 0; i < 256; i++) {
+		free(att->rtt[i]);
+		att->rtt[i] = NULL;
+	}
+
+	att->last_notify_time = 0;
+}
+
+/**
+ * @brief value below which the given percentage of the recorded values fall,
+ * to the resolution of the histogram
+ *
+ * @param hist		histogram
+ * @param percentile	0 to 100
+ *
+ * @return			the value, or 0 if the histogram is empty
+ */
+uint64_t bt_att_histogram_percentile(const struct bt_att_histogram *hist,
+							double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (!hist || !hist->count)
+		return 0;
+
+	if (percentile <= 0)
+		return hist->min;
+
+	target = (uint64_t) (percentile / 100.0 * hist->count + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < BT_ATT_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i == BT_ATT_HIST_BUCKETS || histogram_bucket_max(i) > hist->max)
+		return hist->max;
+
+	return histogram_bucket_max(i);
+}
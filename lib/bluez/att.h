@@ -30,8 +30,10 @@
 #include "att-types.h"
 
 struct bt_att;
+struct mainloop;
 
-struct bt_att *bt_att_new(int fd, bool ext_signed);
+struct bt_att *bt_att_new(struct mainloop *loop, int fd, bool ext_signed);
+struct mainloop *bt_att_get_mainloop(struct bt_att *att);
 
 struct bt_att *bt_att_ref(struct bt_att *att);
 void bt_att_unref(struct bt_att *att);
@@ -68,6 +70,8 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 					bt_att_destroy_func_t destroy);
 bool bt_att_cancel(struct bt_att *att, unsigned int id);
 bool bt_att_cancel_all(struct bt_att *att);
+bool bt_att_replace(struct bt_att *att, unsigned int id,
+					const void *pdu, uint16_t length);
 
 unsigned int bt_att_send_error_rsp(struct bt_att *att, uint8_t opcode,
 						uint16_t handle, int error);
@@ -95,4 +99,39 @@ bool bt_att_set_remote_key(struct bt_att *att, uint8_t sign_key[16],
 			bt_att_counter_func_t func, void *user_data);
 bool bt_att_has_crypto(struct bt_att *att);
 
+/*
+ * Latency histograms, in nanoseconds. Buckets are log-linear: values below
+ * 2^BT_ATT_HIST_SUB_BITS are exact, above that every power of two is split
+ * into 2^BT_ATT_HIST_SUB_BITS buckets (about 6% resolution), and values are
+ * clamped to 2^BT_ATT_HIST_MAX_BITS ns (about 18 minutes).
+ */
+#define BT_ATT_HIST_SUB_BITS	4
+#define BT_ATT_HIST_MAX_BITS	40
+#define BT_ATT_HIST_BUCKETS	((BT_ATT_HIST_MAX_BITS - BT_ATT_HIST_SUB_BITS + 1) \
+						<< BT_ATT_HIST_SUB_BITS)
+
+struct bt_att_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[BT_ATT_HIST_BUCKETS];
+};
+
+enum bt_att_latency {
+	BT_ATT_LATENCY_REQ_QUEUE,	/* request queued until written */
+	BT_ATT_LATENCY_CMD_QUEUE,	/* command queued until written */
+	BT_ATT_LATENCY_NOTIFY_INTERVAL,	/* between received notifications */
+	BT_ATT_LATENCY_COUNT
+};
+
+bool bt_att_get_latency(struct bt_att *att, enum bt_att_latency type,
+					struct bt_att_histogram *hist);
+bool bt_att_get_rtt(struct bt_att *att, uint8_t req_opcode,
+					struct bt_att_histogram *hist);
+void bt_att_reset_latency(struct bt_att *att);
+
+uint64_t bt_att_histogram_percentile(const struct bt_att_histogram *hist,
+							double percentile);
+
 #endif // __ATT_H
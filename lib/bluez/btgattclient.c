@@ -75,6 +75,9 @@
 
 static bool verbose = false;
 
+/* The one loop this tool runs, on its main thread */
+static struct mainloop *loop;
+
 /**
  * client structure holds gatt client context
  */
@@ -164,7 +167,7 @@ static void att_disconnect_cb(int err, void *user_data)
 {
 	printf("Device disconnected: %s\n", strerror(err));
 
-	mainloop_quit();
+	mainloop_quit(loop);
 }
 
 /**
@@ -258,7 +261,7 @@ static struct client *client_create(int fd, uint16_t mtu)
 		return NULL;
 	}
 
-	cli->att = bt_att_new(fd, false);
+	cli->att = bt_att_new(loop, fd, false);
 	if (!cli->att) {
 		fprintf(stderr, "Failed to initialze ATT transport layer\n");
 		bt_att_unref(cli->att);
@@ -1649,7 +1652,7 @@ static void cmd_set_sign_key(struct client *cli, char *cmd_str)
 static void cmd_help(struct client *cli, char *cmd_str);
 
 static void cmd_quit(struct client *cli, char *cmd_str){
-	mainloop_quit();
+	mainloop_quit(loop);
 }
 
 
@@ -1721,7 +1724,7 @@ static void prompt_read_cb(int fd, uint32_t events, void *user_data)
 	int i;
 
 	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-		mainloop_quit();
+		mainloop_quit(loop);
 		return;
 	}
 
@@ -1771,7 +1774,7 @@ static void signal_cb(int signum, void *user_data)
 	switch (signum) {
 	case SIGINT:
 	case SIGTERM:
-		mainloop_quit();
+		mainloop_quit(loop);
 		break;
 	default:
 		break;
@@ -2009,7 +2012,9 @@ int main(int argc, char *argv[])
 	}
 
 	/* create the mainloop resources */
-	mainloop_init();
+	loop = mainloop_new();
+	if (!loop)
+		return EXIT_FAILURE;
 
 	fd = l2cap_le_att_connect(&src_addr, &dst_addr, dst_type, sec);
 	if (fd < 0)
@@ -2022,7 +2027,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* add input event from console */
-	if (mainloop_add_fd(fileno(stdin),
+	if (mainloop_add_fd(loop, fileno(stdin),
 				EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR,
 				prompt_read_cb, cli, NULL) < 0) {
 		fprintf(stderr, "Failed to initialize console\n");
@@ -2034,7 +2039,7 @@ int main(int argc, char *argv[])
 	sigaddset(&mask, SIGTERM);
 
 	/* add handler for process interrupted (SIGINT) or terminated (SIGTERM)*/
-	mainloop_set_signal(&mask, signal_cb, NULL, NULL);
+	mainloop_set_signal(loop, &mask, signal_cb, NULL, NULL);
 
 	print_prompt();
 
@@ -2043,11 +2048,12 @@ int main(int argc, char *argv[])
 	 * any further process is an epoll event processed in mainloop_run
 	 *
 	 */
-	mainloop_run();
+	mainloop_run(loop);
 
 	printf("\n\nShutting down...\n");
 
 	client_destroy(cli);
+	mainloop_free(loop);
 
 	return EXIT_SUCCESS;
 }
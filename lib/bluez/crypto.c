@@ -40,6 +40,7 @@
 #include <sys/socket.h>
 
 #include "util.h"
+#include "aes.h"
 #include "crypto.h"
 
 #ifndef HAVE_LINUX_IF_ALG_H
@@ -86,6 +87,8 @@ struct af_alg_iv {
 
 struct bt_crypto {
 	int ref_count;
+	enum bt_crypto_backend backend;
+	/* AF_ALG sockets, only opened for the kernel backend */
 	int ecb_aes;
 	int urandom;
 	int cmac_aes;
@@ -163,30 +166,74 @@ struct bt_crypto *bt_crypto_new(void)
 	if (!crypto)
 		return NULL;
 
-	crypto->ecb_aes = ecb_aes_setup();
-	if (crypto->ecb_aes < 0) {
-		free(crypto);
-		return NULL;
-	}
+	crypto->ecb_aes = -1;
+	crypto->cmac_aes = -1;
 
 	crypto->urandom = urandom_setup();
 	if (crypto->urandom < 0) {
-		close(crypto->ecb_aes);
 		free(crypto);
 		return NULL;
 	}
 
-	crypto->cmac_aes = cmac_aes_setup();
-	if (crypto->cmac_aes < 0) {
-		close(crypto->urandom);
-		close(crypto->ecb_aes);
-		free(crypto);
-		return NULL;
-	}
+	bt_crypto_set_backend(crypto, BT_CRYPTO_BACKEND_AUTO);
 
 	return bt_crypto_ref(crypto);
 }
 
+/**
+ * Select where the AES work is done
+ *
+ * @param crypto	crypto context
+ * @param backend	backend to use; AUTO picks the fastest userspace one
+ * @return		false if the backend isn't available, in which case
+ *			the previous one stays in use
+ */
+bool bt_crypto_set_backend(struct bt_crypto *crypto,
+					enum bt_crypto_backend backend)
+{
+	if (!crypto)
+		return false;
+
+	switch (backend) {
+	case BT_CRYPTO_BACKEND_AUTO:
+		backend = bt_aes_best_impl() == BT_AES_IMPL_AESNI ?
+					BT_CRYPTO_BACKEND_AESNI :
+					BT_CRYPTO_BACKEND_PORTABLE;
+		break;
+	case BT_CRYPTO_BACKEND_AESNI:
+		if (!bt_aes_impl_supported(BT_AES_IMPL_AESNI))
+			return false;
+		break;
+	case BT_CRYPTO_BACKEND_PORTABLE:
+		break;
+	case BT_CRYPTO_BACKEND_KERNEL:
+		if (crypto->ecb_aes < 0)
+			crypto->ecb_aes = ecb_aes_setup();
+		if (crypto->cmac_aes < 0)
+			crypto->cmac_aes = cmac_aes_setup();
+		if (crypto->ecb_aes < 0 || crypto->cmac_aes < 0)
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	crypto->backend = backend;
+
+	return true;
+}
+
+/**
+ * The backend in use, never AUTO
+ *
+ * @param crypto	crypto context
+ * @return		backend doing the AES work
+ */
+enum bt_crypto_backend bt_crypto_get_backend(struct bt_crypto *crypto)
+{
+	return crypto ? crypto->backend : BT_CRYPTO_BACKEND_AUTO;
+}
+
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto)
 {
 	if (!crypto)
@@ -206,8 +253,12 @@ void bt_crypto_unref(struct bt_crypto *crypto)
 		return;
 
 	close(crypto->urandom);
-	close(crypto->ecb_aes);
-	close(crypto->cmac_aes);
+
+	if (crypto->ecb_aes >= 0)
+		close(crypto->ecb_aes);
+
+	if (crypto->cmac_aes >= 0)
+		close(crypto->cmac_aes);
 
 	free(crypto);
 }
@@ -283,50 +334,84 @@ static inline void swap_buf(const uint8_t *src, uint8_t *dst, uint16_t len)
 		dst[len - 1 - i] = src[i];
 }
 
-bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
-				const uint8_t *m, uint16_t m_len,
-				uint32_t sign_cnt, uint8_t signature[12])
+/**
+ * AES-128 encryption of a single block, on the selected backend. key, in
+ * and out are most significant octet first
+ */
+static bool crypto_encrypt(struct bt_crypto *crypto, const uint8_t key[16],
+					const uint8_t in[16], uint8_t out[16])
 {
+	struct bt_aes128 aes;
+	bool result;
 	int fd;
-	int len;
-	uint8_t tmp[16], out[16];
-	uint16_t msg_len = m_len + sizeof(uint32_t);
-	uint8_t msg[msg_len];
-	uint8_t msg_s[msg_len];
 
-	if (!crypto)
-		return false;
+	if (crypto->backend != BT_CRYPTO_BACKEND_KERNEL) {
+		bt_aes128_init(&aes, crypto->backend == BT_CRYPTO_BACKEND_AESNI ?
+				BT_AES_IMPL_AESNI : BT_AES_IMPL_PORTABLE, key);
+		bt_aes128_encrypt(&aes, in, out);
+		return true;
+	}
 
-	memset(msg, 0, msg_len);
-	memcpy(msg, m, m_len);
+	fd = alg_new(crypto->ecb_aes, key, 16);
+	if (fd < 0)
+		return false;
 
-	/* Add sign_counter to the message */
-	put_le32(sign_cnt, msg + m_len);
+	result = alg_encrypt(fd, in, 16, out, 16);
 
-	/* The most significant octet of key corresponds to key[0] */
-	swap_buf(key, tmp, 16);
+	close(fd);
 
-	fd = alg_new(crypto->cmac_aes, tmp, 16);
-	if (fd < 0)
-		return false;
+	return result;
+}
 
-	/* Swap msg before signing */
-	swap_buf(msg, msg_s, msg_len);
+/**
+ * AES-CMAC of msg, on the selected backend. key, msg and mac are most
+ * significant octet first
+ */
+static bool crypto_cmac(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t *msg, size_t msg_len, uint8_t mac[16])
+{
+	struct bt_aes128 aes;
+	ssize_t len;
+	int fd;
 
-	len = send(fd, msg_s, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
+	if (crypto->backend != BT_CRYPTO_BACKEND_KERNEL) {
+		bt_aes128_init(&aes, crypto->backend == BT_CRYPTO_BACKEND_AESNI ?
+				BT_AES_IMPL_AESNI : BT_AES_IMPL_PORTABLE, key);
+		bt_aes_cmac(&aes, msg, msg_len, mac);
+		return true;
 	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	fd = alg_new(crypto->cmac_aes, key, 16);
+	if (fd < 0)
 		return false;
-	}
+
+	len = send(fd, msg, msg_len, 0);
+	if (len >= 0)
+		len = read(fd, mac, 16);
 
 	close(fd);
 
+	return len >= 0;
+}
+
+/*
+ * The message CMAC'd for a signed PDU: m followed by the sign counter,
+ * reversed so that the most significant octet comes first. msg_s has
+ * m_len + 4 octets
+ */
+static void sign_att_message(const uint8_t *m, uint16_t m_len,
+					uint32_t sign_cnt, uint8_t *msg_s)
+{
+	put_be32(sign_cnt, msg_s);
+	swap_buf(m, msg_s + sizeof(uint32_t), m_len);
+}
+
+/* Turn the CMAC of a signed PDU into the signature that goes after it */
+static void sign_att_signature(uint8_t out[16], uint32_t sign_cnt,
+						uint8_t signature[12])
+{
+	uint8_t tmp[16];
+
 	/*
 	 * As to BT spec. 4.1 Vol[3], Part C, chapter 10.4.1 sign counter should
 	 * be placed in the signature
@@ -340,9 +425,205 @@ bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 	 */
 	swap_buf(out, tmp, 16);
 	memcpy(signature, tmp + 4, 12);
+}
+
+bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12])
+{
+	uint8_t tmp[16], out[16];
+	uint16_t msg_len = m_len + sizeof(uint32_t);
+	uint8_t msg_s[msg_len];
+
+	if (!crypto)
+		return false;
+
+	/* The most significant octet of key corresponds to key[0] */
+	swap_buf(key, tmp, 16);
+
+	sign_att_message(m, m_len, sign_cnt, msg_s);
+
+	if (!crypto_cmac(crypto, tmp, msg_s, msg_len, out))
+		return false;
+
+	sign_att_signature(out, sign_cnt, signature);
+
+	return true;
+}
+
+struct bt_crypto_signer {
+	struct bt_crypto *crypto;
+	enum bt_crypto_backend backend;
+	struct bt_aes128 aes;
+	/* keyed AF_ALG cmac(aes) socket, for the kernel backend */
+	int cmac_fd;
+};
+
+/**
+ * Set up a signing key for bt_crypto_signer_sign and
+ * bt_crypto_signer_sign_batch
+ *
+ * @param crypto	crypto context
+ * @param key		CSRK, least significant octet first
+ * @return		the signer, or NULL on failure
+ */
+struct bt_crypto_signer *bt_crypto_signer_new(struct bt_crypto *crypto,
+						const uint8_t key[16])
+{
+	struct bt_crypto_signer *signer;
+	uint8_t tmp[16];
+
+	if (!crypto)
+		return NULL;
+
+	signer = new0(struct bt_crypto_signer, 1);
+	if (!signer)
+		return NULL;
+
+	signer->backend = crypto->backend;
+	signer->cmac_fd = -1;
+
+	/* The most significant octet of key corresponds to key[0] */
+	swap_buf(key, tmp, 16);
+
+	if (signer->backend == BT_CRYPTO_BACKEND_KERNEL) {
+		signer->cmac_fd = alg_new(crypto->cmac_aes, tmp, 16);
+		if (signer->cmac_fd < 0) {
+			free(signer);
+			return NULL;
+		}
+	} else {
+		bt_aes128_init(&signer->aes,
+				signer->backend == BT_CRYPTO_BACKEND_AESNI ?
+				BT_AES_IMPL_AESNI : BT_AES_IMPL_PORTABLE, tmp);
+	}
+
+	explicit_bzero(tmp, sizeof(tmp));
+
+	signer->crypto = bt_crypto_ref(crypto);
+
+	return signer;
+}
+
+void bt_crypto_signer_free(struct bt_crypto_signer *signer)
+{
+	if (!signer)
+		return;
+
+	if (signer->cmac_fd >= 0)
+		close(signer->cmac_fd);
+
+	bt_crypto_unref(signer->crypto);
+
+	explicit_bzero(signer, sizeof(*signer));
+	free(signer);
+}
+
+/**
+ * Sign a PDU, as bt_crypto_sign_att does
+ *
+ * @param signer	signing key
+ * @param m		PDU to sign
+ * @param m_len		length of m
+ * @param sign_cnt	sign counter
+ * @param signature	receives the 12-octet signature
+ * @return		true on success
+ */
+bool bt_crypto_signer_sign(struct bt_crypto_signer *signer,
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12])
+{
+	uint16_t msg_len = m_len + sizeof(uint32_t);
+	uint8_t msg_s[msg_len];
+	uint8_t out[16];
+	ssize_t len;
+
+	if (!signer)
+		return false;
+
+	sign_att_message(m, m_len, sign_cnt, msg_s);
+
+	if (signer->backend == BT_CRYPTO_BACKEND_KERNEL) {
+		len = send(signer->cmac_fd, msg_s, msg_len, 0);
+		if (len >= 0)
+			len = read(signer->cmac_fd, out, 16);
+		if (len < 0)
+			return false;
+	} else {
+		bt_aes_cmac(&signer->aes, msg_s, msg_len, out);
+	}
+
+	sign_att_signature(out, sign_cnt, signature);
 
 	return true;
 }
+
+/* Number of PDUs bt_crypto_signer_sign_batch hands to the CMAC at once */
+#define SIGN_BATCH_MAX	8
+
+/**
+ * Sign several PDUs with the same key in one pass. On the userspace
+ * backends the CMACs are computed side by side (see bt_aes_cmac_batch)
+ *
+ * @param signer	signing key
+ * @param reqs		PDUs to sign, and where their signatures go
+ * @param count		number of PDUs
+ * @return		true on success
+ */
+bool bt_crypto_signer_sign_batch(struct bt_crypto_signer *signer,
+				const struct bt_crypto_sign_req *reqs,
+				unsigned int count)
+{
+	struct bt_aes_cmac_msg msgs[SIGN_BATCH_MAX];
+	uint8_t out[SIGN_BATCH_MAX][16];
+	unsigned int n, i, chunk;
+	size_t total;
+
+	if (!signer || (count && !reqs))
+		return false;
+
+	if (signer->backend == BT_CRYPTO_BACKEND_KERNEL) {
+		for (i = 0; i < count; i++)
+			if (!bt_crypto_signer_sign(signer, reqs[i].m,
+						reqs[i].m_len, reqs[i].sign_cnt,
+						reqs[i].signature))
+				return false;
+		return true;
+	}
+
+	for (n = 0; n < count; n += chunk) {
+		chunk = count - n < SIGN_BATCH_MAX ? count - n : SIGN_BATCH_MAX;
+
+		total = 0;
+		for (i = 0; i < chunk; i++)
+			total += reqs[n + i].m_len + sizeof(uint32_t);
+
+		{
+			uint8_t msg_s[total];
+			uint8_t *p = msg_s;
+
+			for (i = 0; i < chunk; i++) {
+				const struct bt_crypto_sign_req *req = &reqs[n + i];
+
+				sign_att_message(req->m, req->m_len,
+							req->sign_cnt, p);
+				msgs[i].msg = p;
+				msgs[i].len = req->m_len + sizeof(uint32_t);
+				msgs[i].mac = out[i];
+				p += msgs[i].len;
+			}
+
+			bt_aes_cmac_batch(&signer->aes, msgs, chunk);
+		}
+
+		for (i = 0; i < chunk; i++)
+			sign_att_signature(out[i], reqs[n + i].sign_cnt,
+							reqs[n + i].signature);
+	}
+
+	return true;
+}
+
 /**
  * Security function e
  *
@@ -360,7 +641,6 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 			const uint8_t plaintext[16], uint8_t encrypted[16])
 {
 	uint8_t tmp[16], in[16], out[16];
-	int fd;
 
 	if (!crypto)
 		return false;
@@ -368,24 +648,15 @@ bool bt_crypto_e(struct bt_crypto *crypto, const uint8_t key[16],
 	/* The most significant octet of key corresponds to key[0] */
 	swap_buf(key, tmp, 16);
 
-	fd = alg_new(crypto->ecb_aes, tmp, 16);
-	if (fd < 0)
-		return false;
-
-
 	/* Most significant octet of plaintextData corresponds to in[0] */
 	swap_buf(plaintext, in, 16);
 
-	if (!alg_encrypt(fd, in, 16, out, 16)) {
-		close(fd);
+	if (!crypto_encrypt(crypto, tmp, in, out))
 		return false;
-	}
 
 	/* Most significant octet of encryptedData corresponds to out[0] */
 	swap_buf(out, encrypted, 16);
 
-	close(fd);
-
 	return true;
 }
 
@@ -592,34 +863,18 @@ static bool aes_cmac(struct bt_crypto *crypto, uint8_t key[16], uint8_t *msg,
 					size_t msg_len, uint8_t res[16])
 {
 	uint8_t key_msb[16], out[16], msg_msb[CMAC_MSG_MAX];
-	ssize_t len;
-	int fd;
 
 	if (msg_len > CMAC_MSG_MAX)
 		return false;
 
 	swap_buf(key, key_msb, 16);
-	fd = alg_new(crypto->cmac_aes, key_msb, 16);
-	if (fd < 0)
-		return false;
-
 	swap_buf(msg, msg_msb, msg_len);
-	len = send(fd, msg_msb, msg_len, 0);
-	if (len < 0) {
-		close(fd);
-		return false;
-	}
 
-	len = read(fd, out, 16);
-	if (len < 0) {
-		close(fd);
+	if (!crypto_cmac(crypto, key_msb, msg_msb, msg_len, out))
 		return false;
-	}
 
 	swap_buf(out, res, 16);
 
-	close(fd);
-
 	return true;
 }
 
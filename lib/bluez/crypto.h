@@ -26,8 +26,23 @@
 
 struct bt_crypto;
 
+/*
+ * Where the AES work is done. Userspace (AES-NI or portable) is the
+ * default; the kernel's AF_ALG sockets cost several syscalls per operation
+ */
+enum bt_crypto_backend {
+	BT_CRYPTO_BACKEND_AUTO,		/* AES-NI if the CPU has it, else portable */
+	BT_CRYPTO_BACKEND_AESNI,
+	BT_CRYPTO_BACKEND_PORTABLE,
+	BT_CRYPTO_BACKEND_KERNEL,
+};
+
 struct bt_crypto *bt_crypto_new(void);
 
+bool bt_crypto_set_backend(struct bt_crypto *crypto,
+					enum bt_crypto_backend backend);
+enum bt_crypto_backend bt_crypto_get_backend(struct bt_crypto *crypto);
+
 struct bt_crypto *bt_crypto_ref(struct bt_crypto *crypto);
 void bt_crypto_unref(struct bt_crypto *crypto);
 
@@ -59,3 +74,28 @@ bool bt_crypto_g2(struct bt_crypto *crypto, uint8_t u[32], uint8_t v[32],
 bool bt_crypto_sign_att(struct bt_crypto *crypto, const uint8_t key[16],
 				const uint8_t *m, uint16_t m_len,
 				uint32_t sign_cnt, uint8_t signature[12]);
+
+/*
+ * A signing key with its AES-CMAC subkeys (or, for the kernel backend, a
+ * keyed socket) set up once, for signing many PDUs with the same CSRK. It
+ * keeps the backend the crypto context had when it was created
+ */
+struct bt_crypto_signer;
+
+/* One PDU of a bt_crypto_signer_sign_batch call */
+struct bt_crypto_sign_req {
+	const uint8_t *m;
+	uint16_t m_len;
+	uint32_t sign_cnt;
+	uint8_t *signature;	/* 12 octets */
+};
+
+struct bt_crypto_signer *bt_crypto_signer_new(struct bt_crypto *crypto,
+						const uint8_t key[16]);
+void bt_crypto_signer_free(struct bt_crypto_signer *signer);
+bool bt_crypto_signer_sign(struct bt_crypto_signer *signer,
+				const uint8_t *m, uint16_t m_len,
+				uint32_t sign_cnt, uint8_t signature[12]);
+bool bt_crypto_signer_sign_batch(struct bt_crypto_signer *signer,
+				const struct bt_crypto_sign_req *reqs,
+				unsigned int count);
@@ -41,6 +41,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/uio.h>
 
 #ifndef MAX
@@ -94,6 +95,12 @@ struct bt_gatt_client {
 	struct queue *notify_list;
 	/**< List of registered disconnect/notification/indication callbacks */
 	struct queue *notify_chrcs;
+	/**< notify_chrcs indexed by value handle, for dispatch */
+	struct notify_index {
+		struct notify_chrc **slots;
+		unsigned int mask;
+		unsigned int count;
+	} notify_index;
 	int next_reg_id;
 	unsigned int disc_id;
 	/**< Handle of the GATT Service
@@ -122,6 +129,14 @@ struct bt_gatt_client {
 	unsigned int next_request_id;
 	struct bt_gatt_request *discovery_req;
 	unsigned int mtu_req_id;
+
+	struct bt_gatt_client_range *ranges;
+	unsigned int num_ranges;
+	/**< Services to discover during initialization, all if num_ranges is 0 */
+	bt_gatt_client_callback_t discover_callback;
+	bt_gatt_client_destroy_func_t discover_destroy;
+	void *discover_data;
+	/**< Completion of bt_gatt_client_discover_range() */
 };
 
 /**
@@ -192,11 +207,17 @@ static void request_unref(void *data)
 }
 
 struct notify_chrc {
+	struct bt_gatt_client *client;
 	uint16_t value_handle;
 	uint16_t ccc_handle;
 	uint16_t properties;
 	int notify_count;  /* Reference count of registered notify callbacks */
 
+	/* The entries of the client's notify_list for this characteristic, in
+	 * registration order; a notification only visits these.
+	 */
+	struct queue *handlers;
+
 	/* Pending calls to register_notify are queued here so that they can be
 	 * processed after a write that modifies the CCC descriptor.
 	 */
@@ -236,6 +257,101 @@ static void notify_data_unref(void *data)
 	free(notify_data);
 }
 
+/*
+ * Open addressing with linear probing over the value handle. Handles are
+ * small and mostly consecutive, so the low bits spread them well enough.
+ * The table is kept at most half full.
+ */
+static struct notify_chrc *notify_index_find(struct notify_index *index,
+							uint16_t value_handle)
+{
+	unsigned int i;
+
+	if (!index->slots)
+		return NULL;
+
+	for (i = value_handle & index->mask; index->slots[i];
+						i = (i + 1) & index->mask) {
+		if (index->slots[i]->value_handle == value_handle)
+			return index->slots[i];
+	}
+
+	return NULL;
+}
+
+static void notify_index_insert(struct notify_index *index,
+						struct notify_chrc *chrc)
+{
+	unsigned int i = chrc->value_handle & index->mask;
+
+	while (index->slots[i])
+		i = (i + 1) & index->mask;
+
+	index->slots[i] = chrc;
+	index->count++;
+}
+
+static bool notify_index_add(struct notify_index *index,
+						struct notify_chrc *chrc)
+{
+	struct notify_chrc **old_slots = index->slots;
+	unsigned int old_size = old_slots ? index->mask + 1 : 0;
+	unsigned int size, i;
+
+	if ((index->count + 1) * 2 > old_size) {
+		size = old_size ? old_size * 2 : 16;
+
+		index->slots = new0(struct notify_chrc *, size);
+		if (!index->slots) {
+			index->slots = old_slots;
+			return false;
+		}
+
+		index->mask = size - 1;
+		index->count = 0;
+
+		for (i = 0; i < old_size; i++) {
+			if (old_slots[i])
+				notify_index_insert(index, old_slots[i]);
+		}
+
+		free(old_slots);
+	}
+
+	notify_index_insert(index, chrc);
+
+	return true;
+}
+
+static void notify_index_remove(struct notify_index *index,
+						struct notify_chrc *chrc)
+{
+	unsigned int i, j, home;
+
+	if (!index->slots)
+		return;
+
+	for (i = chrc->value_handle & index->mask; index->slots[i] != chrc;
+						i = (i + 1) & index->mask) {
+		if (!index->slots[i])
+			return;
+	}
+
+	/* Shift back the entries that probed past the freed slot */
+	for (j = (i + 1) & index->mask; index->slots[j];
+						j = (j + 1) & index->mask) {
+		home = index->slots[j]->value_handle & index->mask;
+
+		if (((j - home) & index->mask) >= ((j - i) & index->mask)) {
+			index->slots[i] = index->slots[j];
+			i = j;
+		}
+	}
+
+	index->slots[i] = NULL;
+	index->count--;
+}
+
 static void find_ccc(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_db_attribute **ccc_ptr = user_data;
@@ -283,6 +399,13 @@ static struct notify_chrc *notify_chrc_create(struct bt_gatt_client *client,
 		return NULL;
 	}
 
+	chrc->handlers = queue_new();
+	if (!chrc->handlers) {
+		queue_destroy(chrc->reg_notify_queue, NULL);
+		free(chrc);
+		return NULL;
+	}
+
 	/*
 	 * Find the CCC characteristic. Some characteristics that allow
 	 * notifications may not have a CCC descriptor. We treat these as
@@ -293,9 +416,17 @@ static struct notify_chrc *notify_chrc_create(struct bt_gatt_client *client,
 	if (ccc)
 		chrc->ccc_handle = gatt_db_attribute_get_handle(ccc);
 
+	chrc->client = client;
 	chrc->value_handle = value_handle;
 	chrc->properties = properties;
 
+	if (!notify_index_add(&client->notify_index, chrc)) {
+		queue_destroy(chrc->handlers, NULL);
+		queue_destroy(chrc->reg_notify_queue, NULL);
+		free(chrc);
+		return NULL;
+	}
+
 	queue_push_tail(client->notify_chrcs, chrc);
 
 	return chrc;
@@ -305,10 +436,24 @@ static void notify_chrc_free(void *data)
 {
 	struct notify_chrc *chrc = data;
 
+	notify_index_remove(&chrc->client->notify_index, chrc);
+
+	queue_destroy(chrc->handlers, NULL);
 	queue_destroy(chrc->reg_notify_queue, notify_data_unref);
 	free(chrc);
 }
 
+/* Takes a notify_data off its characteristic's dispatch list and drops the
+ * client's notify_list reference
+ */
+static void notify_data_remove(void *data)
+{
+	struct notify_data *notify_data = data;
+
+	queue_remove(notify_data->chrc->handlers, notify_data);
+	notify_data_unref(notify_data);
+}
+
 static bool match_notify_data_id(const void *a, const void *b)
 {
 	const struct notify_data *notify_data = a;
@@ -351,7 +496,7 @@ static void gatt_client_remove_all_notify_in_range(
 	range.end = end_handle;
 
 	queue_remove_all(client->notify_list, match_notify_data_handle_range,
-						&range, notify_data_unref);
+						&range, notify_data_remove);
 }
 
 static void gatt_client_remove_notify_chrcs_in_range(
@@ -383,6 +528,8 @@ struct discovery_op {
 	bool success;
 	uint16_t start;
 	uint16_t end;
+	unsigned int next_range;
+	bool targeted;
 	int ref_count;
 	discovery_op_complete_func_t complete_func;
 	discovery_op_fail_func_t failure_func;
@@ -983,6 +1130,36 @@ done:
 	op->complete_func(op, success, att_ecode);
 }
 
+static void discover_primary_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data);
+
+/* Start primary service discovery for the next of the client's ranges */
+static bool discover_next_range(struct discovery_op *op)
+{
+	struct bt_gatt_client *client = op->client;
+	struct bt_gatt_client_range *range;
+
+	range = &client->ranges[op->next_range++];
+
+	client->discovery_req = bt_gatt_discover_primary_services(client->att,
+				range->uuid.type != BT_UUID_UNSPEC ?
+							&range->uuid : NULL,
+				range->start, range->end,
+				discover_primary_cb,
+				discovery_op_ref(op),
+				discovery_op_unref);
+	if (client->discovery_req)
+		return true;
+
+	util_debug(client->debug_callback, client->debug_data,
+			"Failed to start primary service discovery in range"
+			" 0x%04x-0x%04x", range->start, range->end);
+	discovery_op_unref(op);
+
+	return false;
+}
+
 static void discover_primary_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data)
@@ -1044,6 +1221,47 @@ static void discover_primary_cb(bool success, uint8_t att_ecode,
 	}
 
 secondary:
+	/* A targeted discovery collects the services of all ranges first */
+	if (op->targeted && op->next_range < client->num_ranges) {
+		if (discover_next_range(op))
+			return;
+
+		success = false;
+		goto done;
+	}
+
+	/*
+	 * Secondary and included services are left to on-demand discovery;
+	 * go straight to the characteristics of the selected services.
+	 */
+	if (op->targeted) {
+		attr = queue_pop_head(op->pending_svcs);
+		if (!attr)
+			goto done;
+
+		if (!gatt_db_attribute_get_service_handles(attr, &start, &end)) {
+			success = false;
+			goto done;
+		}
+
+		op->cur_svc = attr;
+
+		client->discovery_req = bt_gatt_discover_characteristics(
+							client->att,
+							start, end,
+							discover_chrcs_cb,
+							discovery_op_ref(op),
+							discovery_op_unref);
+		if (client->discovery_req)
+			return;
+
+		util_debug(client->debug_callback, client->debug_data,
+				"Failed to start characteristic discovery");
+		discovery_op_unref(op);
+		success = false;
+		goto done;
+	}
+
 	/*
 	 * Version 4.2 [Vol 1, Part A] page 101:
 	 * A secondary service is a service that provides auxiliary
@@ -1084,6 +1302,9 @@ static void notify_client_ready(struct bt_gatt_client *client, bool success,
 	bt_gatt_client_unref(client);
 }
 
+static void init_complete(struct discovery_op *op, bool success,
+							uint8_t att_ecode);
+
 static void exchange_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
 {
 	struct discovery_op *op = user_data;
@@ -1117,6 +1338,29 @@ static void exchange_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
 					bt_att_get_mtu(client->att));
 
 discover:
+	/*
+	 * A database that is already populated was loaded from a cache. It is
+	 * trusted until the server sends a Service Changed indication, so skip
+	 * discovery and go straight to registering for those.
+	 */
+	if (!gatt_db_isempty(client->db)) {
+		util_debug(client->debug_callback, client->debug_data,
+					"Using cached attribute database");
+		op->success = true;
+		init_complete(op, true, 0);
+		return;
+	}
+
+	if (client->num_ranges) {
+		op->targeted = true;
+		if (discover_next_range(op))
+			return;
+
+		client->in_init = false;
+		notify_client_ready(client, false, att_ecode);
+		return;
+	}
+
 	client->discovery_req = bt_gatt_discover_all_primary_services(
 							client->att, NULL,
 							discover_primary_cb,
@@ -1221,6 +1465,7 @@ static void enable_ccc_callback(uint8_t opcode, const void *pdu,
 		 * write request, then just move on to the next queued entry.
 		 */
 		queue_remove(notify_data->client->notify_list, notify_data);
+		queue_remove(notify_data->chrc->handlers, notify_data);
 		notify_data->callback(att_ecode, notify_data->user_data);
 
 		while ((notify_data = queue_pop_head(
@@ -1244,14 +1489,6 @@ static void enable_ccc_callback(uint8_t opcode, const void *pdu,
 	bt_gatt_client_unref(notify_data->client);
 }
 
-static bool match_notify_chrc_value_handle(const void *a, const void *b)
-{
-	const struct notify_chrc *chrc = a;
-	uint16_t value_handle = PTR_TO_UINT(b);
-
-	return chrc->value_handle == value_handle;
-}
-
 static unsigned int register_notify(struct bt_gatt_client *client,
 				uint16_t handle,
 				bt_gatt_client_register_callback_t callback,
@@ -1263,8 +1500,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 	struct notify_chrc *chrc = NULL;
 
 	/* Check if a characteristic ref count has been started already */
-	chrc = queue_find(client->notify_chrcs, match_notify_chrc_value_handle,
-						UINT_TO_PTR(handle));
+	chrc = notify_index_find(&client->notify_index, handle);
 
 	if (!chrc) {
 		/*
@@ -1292,8 +1528,11 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 	notify_data->user_data = user_data;
 	notify_data->destroy = destroy;
 
-	/* Add the handler to the bt_gatt_client's general list */
+	/* Add the handler to the bt_gatt_client's general list, and to the
+	 * characteristic's for dispatch
+	 */
 	queue_push_tail(client->notify_list, notify_data);
+	queue_push_tail(chrc->handlers, notify_data);
 
 	/* Assign an ID to the handler. */
 	if (client->next_reg_id < 1)
@@ -1321,6 +1560,7 @@ static unsigned int register_notify(struct bt_gatt_client *client,
 	/* Write to the CCC descriptor */
 	if (!notify_data_write_ccc(notify_data, true, enable_ccc_callback)) {
 		queue_remove(client->notify_list, notify_data);
+		queue_remove(chrc->handlers, notify_data);
 		free(notify_data);
 		return 0;
 	}
@@ -1638,9 +1878,6 @@ static void notify_handler(void *data, void *user_data)
 
 	value_handle = get_le16(pdu_data->pdu);
 
-	if (notify_data->chrc->value_handle != value_handle)
-		return;
-
 	if (pdu_data->length > 2)
 		value = pdu_data->pdu + 2;
 
@@ -1657,6 +1894,7 @@ static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 								void *user_data)
 {
 	struct bt_gatt_client *client = user_data;
+	struct notify_chrc *chrc;
 	struct pdu_data pdu_data;
 
 	bt_gatt_client_ref(client);
@@ -1665,13 +1903,18 @@ static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
 	pdu_data.pdu = pdu;
 	pdu_data.length = length;
 
-	queue_foreach(client->notify_list, notify_handler, &pdu_data);
+	/* Only the handlers registered for this value handle */
+	chrc = length >= 2 ? notify_index_find(&client->notify_index,
+							get_le16(pdu)) : NULL;
+	if (chrc)
+		queue_foreach(chrc->handlers, notify_handler, &pdu_data);
 
 	if (opcode == BT_ATT_OP_HANDLE_VAL_NOT) {
-		printf("notify_cb: Received Value Notification (BT_ATT_OP_HANDLE_VAL_NOT)\n");
-		util_hexdump('<', pdu, length, (util_debug_func_t) printf, NULL);
-		printf("\n");
-		fflush(stdout);
+		util_debug(client->debug_callback, client->debug_data,
+					"Received Value Notification (%u bytes)",
+					length);
+		util_hexdump('<', pdu, length, client->debug_callback,
+							client->debug_data);
 	}
 
 	if (opcode == BT_ATT_OP_HANDLE_VAL_IND)
@@ -1688,7 +1931,7 @@ static void notify_data_cleanup(void *data)
 	if (notify_data->att_id)
 		bt_att_cancel(notify_data->client->att, notify_data->att_id);
 
-	notify_data_unref(notify_data);
+	notify_data_remove(notify_data);
 }
 
 static void bt_gatt_client_free(struct bt_gatt_client *client)
@@ -1712,9 +1955,15 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 
 	gatt_db_unref(client->db);
 
+	if (client->discover_destroy)
+		client->discover_destroy(client->discover_data);
+
+	free(client->ranges);
+
 	queue_destroy(client->svc_chngd_queue, free);
 	queue_destroy(client->long_write_queue, request_unref);
 	queue_destroy(client->notify_chrcs, notify_chrc_free);
+	free(client->notify_index.slots);
 	queue_destroy(client->pending_requests, request_unref);
 
 	free(client);
@@ -1740,16 +1989,34 @@ static void att_disconnect_cb(int err, void *user_data)
 struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 							struct bt_att *att,
 							uint16_t mtu)
+{
+	return bt_gatt_client_new_targeted(db, att, mtu, NULL, 0);
+}
+
+struct bt_gatt_client *bt_gatt_client_new_targeted(struct gatt_db *db,
+					struct bt_att *att,
+					uint16_t mtu,
+					const struct bt_gatt_client_range *ranges,
+					unsigned int num_ranges)
 {
 	struct bt_gatt_client *client;
 
-	if (!att || !db)
+	if (!att || !db || (num_ranges && !ranges))
 		return NULL;
 
 	client = new0(struct bt_gatt_client, 1);
 	if (!client)
 		return NULL;
 
+	if (num_ranges) {
+		client->ranges = new0(struct bt_gatt_client_range, num_ranges);
+		if (!client->ranges)
+			goto fail;
+
+		memcpy(client->ranges, ranges, num_ranges * sizeof(*ranges));
+		client->num_ranges = num_ranges;
+	}
+
 	client->disc_id = bt_att_register_disconnect(att, att_disconnect_cb,
 								client, NULL);
 	if (!client->disc_id)
@@ -1877,6 +2144,86 @@ bool bt_gatt_client_set_debug(struct bt_gatt_client *client,
 	return true;
 }
 
+static void discover_range_complete(struct discovery_op *op, bool success,
+							uint8_t att_ecode)
+{
+	struct bt_gatt_client *client = op->client;
+	bt_gatt_client_callback_t callback = client->discover_callback;
+	bt_gatt_client_destroy_func_t destroy = client->discover_destroy;
+	void *user_data = client->discover_data;
+	struct service_changed_op *next_sc_op;
+
+	client->discover_callback = NULL;
+	client->discover_destroy = NULL;
+	client->discover_data = NULL;
+	client->in_svc_chngd = false;
+
+	/* Finding nothing new in the range is not an error */
+	if (!success && att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
+		success = true;
+
+	if (callback)
+		callback(success, att_ecode, user_data);
+
+	if (destroy)
+		destroy(user_data);
+
+	/* Service Changed events that arrived meanwhile were queued */
+	next_sc_op = queue_pop_head(client->svc_chngd_queue);
+	if (next_sc_op) {
+		process_service_changed(client, next_sc_op->start_handle,
+							next_sc_op->end_handle);
+		free(next_sc_op);
+	}
+}
+
+static void discover_range_failure(struct discovery_op *op)
+{
+	/* Make sure the caller hears back if the procedure was cancelled */
+	if (op->client->discover_callback)
+		discover_range_complete(op, false, 0);
+}
+
+bool bt_gatt_client_discover_range(struct bt_gatt_client *client,
+					uint16_t start, uint16_t end,
+					bt_gatt_client_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy)
+{
+	struct discovery_op *op;
+
+	if (!client || !client->ready || start > end)
+		return false;
+
+	if (client->in_svc_chngd || client->discovery_req ||
+						client->discover_callback)
+		return false;
+
+	op = discovery_op_create(client, start, end, discover_range_complete,
+						discover_range_failure);
+	if (!op)
+		return false;
+
+	client->discovery_req = bt_gatt_discover_primary_services(client->att,
+						NULL, start, end,
+						discover_primary_cb,
+						discovery_op_ref(op),
+						discovery_op_unref);
+	if (!client->discovery_req) {
+		discovery_op_free(op);
+		return false;
+	}
+
+	client->discover_callback = callback;
+	client->discover_destroy = destroy;
+	client->discover_data = user_data;
+
+	/* Service Changed indications are queued until this completes */
+	client->in_svc_chngd = true;
+
+	return true;
+}
+
 uint16_t bt_gatt_client_get_mtu(struct bt_gatt_client *client)
 {
 	if (!client || !client->att)
@@ -3052,6 +3399,8 @@ bool bt_gatt_client_unregister_notify(struct bt_gatt_client *client,
 	if (!notify_data)
 		return false;
 
+	queue_remove(notify_data->chrc->handlers, notify_data);
+
 	assert(notify_data->chrc->notify_count > 0);
 	assert(!notify_data->chrc->ccc_write_id);
 
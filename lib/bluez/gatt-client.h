@@ -21,6 +21,9 @@
  *
  */
 
+#ifndef __GATT_CLIENT_H
+#define __GATT_CLIENT_H
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
@@ -33,6 +36,29 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 							struct bt_att *att,
 							uint16_t mtu);
 
+/*
+ * A discovery range selects the primary services that lie within
+ * [start, end] and, unless uuid is BT_UUID_UNSPEC, have the given UUID.
+ */
+struct bt_gatt_client_range {
+	uint16_t start;
+	uint16_t end;
+	bt_uuid_t uuid;
+};
+
+/*
+ * Like bt_gatt_client_new(), but only discovers the services selected by
+ * ranges, and their characteristics and descriptors, during initialization.
+ * Secondary and included services and everything else can be discovered
+ * later with bt_gatt_client_discover_range(). Include the GATT service in
+ * ranges to keep receiving Service Changed indications.
+ */
+struct bt_gatt_client *bt_gatt_client_new_targeted(struct gatt_db *db,
+					struct bt_att *att,
+					uint16_t mtu,
+					const struct bt_gatt_client_range *ranges,
+					unsigned int num_ranges);
+
 struct bt_gatt_client *bt_gatt_client_ref(struct bt_gatt_client *client);
 void bt_gatt_client_unref(struct bt_gatt_client *client);
 
@@ -69,6 +95,16 @@ bool bt_gatt_client_set_debug(struct bt_gatt_client *client,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy);
 
+/*
+ * Discover the services in [start, end] that are not yet in the database.
+ * Only one discovery can run at a time, and not before the client is ready.
+ */
+bool bt_gatt_client_discover_range(struct bt_gatt_client *client,
+					uint16_t start, uint16_t end,
+					bt_gatt_client_callback_t callback,
+					void *user_data,
+					bt_gatt_client_destroy_func_t destroy);
+
 uint16_t bt_gatt_client_get_mtu(struct bt_gatt_client *client);
 struct gatt_db *bt_gatt_client_get_db(struct bt_gatt_client *client);
 
@@ -133,3 +169,5 @@ bool bt_gatt_client_unregister_notify(struct bt_gatt_client *client,
 
 bool bt_gatt_client_set_security(struct bt_gatt_client *client, int level);
 int bt_gatt_client_get_security(struct bt_gatt_client *client);
+
+#endif // __GATT_CLIENT_H
@@ -78,6 +78,7 @@ struct notify {
 struct pending_read {
 	struct gatt_db_attribute *attrib;
 	unsigned int id;
+	struct mainloop *loop;
 	unsigned int timeout_id;
 	gatt_db_attribute_read_t func;
 	void *user_data;
@@ -86,6 +87,7 @@ struct pending_read {
 struct pending_write {
 	struct gatt_db_attribute *attrib;
 	unsigned int id;
+	struct mainloop *loop;
 	unsigned int timeout_id;
 	gatt_db_attribute_write_t func;
 	void *user_data;
@@ -122,7 +124,7 @@ static void pending_read_result(struct pending_read *p, int err,
 					const uint8_t *data, size_t length)
 {
 	if (p->timeout_id > 0)
-		timeout_remove(p->timeout_id);
+		timeout_remove(p->loop, p->timeout_id);
 
 	p->func(p->attrib, err, data, length, p->user_data);
 
@@ -139,7 +141,7 @@ static void pending_read_free(void *data)
 static void pending_write_result(struct pending_write *p, int err)
 {
 	if (p->timeout_id > 0)
-		timeout_remove(p->timeout_id);
+		timeout_remove(p->loop, p->timeout_id);
 
 	p->func(p->attrib, err, p->user_data);
 
@@ -1605,8 +1607,10 @@ bool gatt_db_attribute_read(struct gatt_db_attribute *attrib, uint16_t offset,
 
 		p->attrib = attrib;
 		p->id = ++attrib->read_id;
-		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, read_timeout,
-								p, NULL);
+		/* The timeout runs on the loop of the transport asking */
+		p->loop = bt_att_get_mainloop(att);
+		p->timeout_id = timeout_add(p->loop, ATTRIBUTE_TIMEOUT,
+						read_timeout, p, NULL);
 		p->func = func;
 		p->user_data = user_data;
 
@@ -1689,8 +1693,9 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 
 		p->attrib = attrib;
 		p->id = ++attrib->write_id;
-		p->timeout_id = timeout_add(ATTRIBUTE_TIMEOUT, write_timeout,
-								p, NULL);
+		p->loop = bt_att_get_mainloop(att);
+		p->timeout_id = timeout_add(p->loop, ATTRIBUTE_TIMEOUT,
+						write_timeout, p, NULL);
 		p->func = func;
 		p->user_data = user_data;
 
@@ -3942,11 +3942,11 @@ int hci_le_conn_update(int dd, uint16_t handle, uint16_t min_interval,
 	struct hci_request rq;
 
 	memset(&cp, 0, sizeof(cp));
-	cp.handle = handle;
-	cp.min_interval = min_interval;
-	cp.max_interval = max_interval;
-	cp.latency = latency;
-	cp.supervision_timeout = supervision_timeout;
+	cp.handle = htobs(handle);
+	cp.min_interval = htobs(min_interval);
+	cp.max_interval = htobs(max_interval);
+	cp.latency = htobs(latency);
+	cp.supervision_timeout = htobs(supervision_timeout);
 	cp.min_ce_length = htobs(0x0001);
 	cp.max_ce_length = htobs(0x0001);
 
@@ -48,6 +48,7 @@
  */
 struct io {
 	int ref_count; 							/**< number of references to the data structure */
+	struct mainloop *loop;					/**< loop the fd is watched on */
 	int fd; 								/**< file descriptor */
 	uint32_t events;						/**< epoll events (might be ored) */
 	bool close_on_destroy;					/**< do you need to close the underlying socket on destroy? */
@@ -136,7 +137,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 		io->write_callback = NULL;
 
 		if (!io->disconnect_callback) {
-			mainloop_remove_fd(io->fd);
+			mainloop_remove_fd(io->loop, io->fd);
 			io_unref(io);
 			return;
 		}
@@ -151,7 +152,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLRDHUP;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
@@ -166,7 +167,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLIN;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
@@ -181,7 +182,7 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 
 			io->events &= ~EPOLLOUT;
 
-			mainloop_modify_fd(io->fd, io->events);
+			mainloop_modify_fd(io->loop, io->fd, io->events);
 		}
 	}
 
@@ -191,25 +192,27 @@ static void io_callback(int fd, uint32_t events, void *user_data)
 /**
  * create a new io data structure
  *
+ * @param loop	loop to watch the fd on
  * @param fd	file descriptor (includes socket)
  * @return		NULL if error or io data structure
  */
-struct io *io_new(int fd)
+struct io *io_new(struct mainloop *loop, int fd)
 {
 	struct io *io;
 
-	if (fd < 0)
+	if (!loop || fd < 0)
 		return NULL;
 
 	io = new0(struct io, 1);
 	if (!io)
 		return NULL;
 
+	io->loop = loop;
 	io->fd = fd;
 	io->events = 0;
 	io->close_on_destroy = false;
 
-	if (mainloop_add_fd(io->fd, io->events, io_callback,
+	if (mainloop_add_fd(loop, io->fd, io->events, io_callback,
 						io, io_cleanup) < 0) {
 		free(io);
 		return NULL;
@@ -232,7 +235,7 @@ void io_destroy(struct io *io)
 	io->write_callback = NULL;
 	io->disconnect_callback = NULL;
 
-	mainloop_remove_fd(io->fd);
+	mainloop_remove_fd(io->loop, io->fd);
 
 	io_unref(io);
 }
@@ -298,7 +301,7 @@ bool io_set_read_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -337,7 +340,7 @@ bool io_set_write_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -376,7 +379,7 @@ bool io_set_disconnect_handler(struct io *io, io_callback_func_t callback,
 	if (events == io->events)
 		return true;
 
-	if (mainloop_modify_fd(io->fd, events) < 0)
+	if (mainloop_modify_fd(io->loop, io->fd, events) < 0)
 		return false;
 
 	io->events = events;
@@ -27,8 +27,9 @@
 typedef void (*io_destroy_func_t)(void *data);
 
 struct io;
+struct mainloop;
 
-struct io *io_new(int fd);
+struct io *io_new(struct mainloop *loop, int fd);
 void io_destroy(struct io *io);
 
 int io_get_fd(struct io *io);
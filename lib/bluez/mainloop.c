@@ -36,11 +36,14 @@
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/eventfd.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
@@ -49,10 +52,6 @@
 
 #define MAX_EPOLL_EVENTS 10
 
-static int epoll_fd;
-static int epoll_terminate;
-static int exit_status;
-
 /**
  * @brief mainloop file descriptor event data structure
  */
@@ -69,21 +68,68 @@ struct mainloop_data {
 	void *user_data;
 };
 
-#define MAX_MAINLOOP_ENTRIES 128
+/*
+ * Timeouts live on a hierarchical timing wheel driven by a single timerfd
+ * per loop. Time is counted in millisecond ticks since the loop was
+ * created; level n of the wheel holds the timeouts due within 64^(n+1)
+ * ticks, in slots 64^n ticks wide, and a slot of level n is spread over
+ * the levels below when the wheel reaches it. Arming, re-arming and
+ * removing a timeout are O(1), and the timerfd is only reprogrammed when
+ * the earliest deadline moves up
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+#define WHEEL_NEVER UINT64_MAX
+
+/* Values of timeout_data.slot besides a wheel slot */
+#define TIMEOUT_IDLE -1
+#define TIMEOUT_FREE -2
 
 /**
- * @brief array of file descriptor event stub
+ * @brief a timeout: a node of the loop's pool, identified by its index
  */
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
-
 struct timeout_data {
-	int fd;
+	/// tick it's due at, when on the wheel
+	uint64_t expires;
+	/// wheel slot (level * WHEEL_SIZE + index), TIMEOUT_IDLE or TIMEOUT_FREE
+	int slot;
+	/// neighbours in the slot's list; next also links the free list
+	int prev;
+	int next;
 	mainloop_timeout_func callback;
 	mainloop_destroy_func destroy;
 	void *user_data;
 };
 
+struct timer_wheel {
+	/// timerfd, always on the epoll instance
+	int fd;
+	/// its epoll entry, which isn't in the table
+	struct mainloop_data entry;
+	/// CLOCK_MONOTONIC time of tick 0, in ns
+	uint64_t base;
+	/// last tick processed
+	uint64_t now;
+	/// tick the timerfd is set for, WHEEL_NEVER if it isn't
+	uint64_t armed;
+	/// set while timeouts are being run; the timerfd is set afterwards
+	int running;
+	/// first timeout of each slot, -1 if empty
+	int slots[WHEEL_LEVELS * WHEEL_SIZE];
+	/// non-empty slots of each level
+	uint64_t occupied[WHEEL_LEVELS];
+	/// timeout pool, indexed by id, grown as needed
+	struct timeout_data *timeouts;
+	unsigned int num_timeouts;
+	/// first unused timeout, -1 if none
+	int free_list;
+};
+
 struct signal_data {
+	struct mainloop *loop;
 	int fd;
 	sigset_t mask;
 	mainloop_signal_func callback;
@@ -91,51 +137,222 @@ struct signal_data {
 	void *user_data;
 };
 
-static struct signal_data *signal_data;
+/**
+ * @brief an event loop: its epoll instance and the file descriptors on it.
+ * Each loop is run by one thread, and only that thread touches it, except
+ * for mainloop_wakeup and quitting, which any thread may do
+ */
+struct mainloop {
+	/// epoll instance
+	int epoll_fd;
+	/// set to a <>0 value to make mainloop_run return
+	int terminate;
+	/// eventfd that mainloop_wakeup signals, always on the epoll instance
+	int wakeup_fd;
+	/// its epoll entry, which isn't in the table
+	struct mainloop_data wakeup;
+	/// called on the loop's thread after mainloop_wakeup
+	mainloop_wakeup_func wakeup_callback;
+	void *wakeup_data;
+	/// what mainloop_run returns
+	int exit_status;
+	/// event entries indexed by file descriptor, grown as needed
+	struct mainloop_data **entries;
+	/// number of slots in entries
+	unsigned int num_entries;
+	/// signal handler set by mainloop_set_signal
+	struct signal_data *signal_data;
+	/// timeouts
+	struct timer_wheel wheel;
+};
+
+static int wheel_init(struct mainloop *loop);
+static void remove_all_timeouts(struct mainloop *loop);
+
+static void wakeup_event(int fd, uint32_t events, void *user_data)
+{
+	struct mainloop *loop = user_data;
+	uint64_t count;
+
+	/*
+	 * Reset the eventfd before calling the handler, so that a wakeup
+	 * landing while the handler runs isn't lost
+	 */
+	if (read(fd, &count, sizeof(count)) < 0)
+		return;
+
+	if (loop->wakeup_callback)
+		loop->wakeup_callback(loop->wakeup_data);
+}
 
 /**
- * create the epoll resource (epoll_fd global variable)
- * initialize mainloop_list (global variable) event table
- * set epoll_terminate to 0 (mainloop_run looping)
+ * create a loop: the epoll resource, an empty event table and an empty
+ * timer wheel
+ *
+ * @return the loop, or NULL on failure
  */
-void mainloop_init(void)
+struct mainloop *mainloop_new(void)
+{
+	struct mainloop *loop;
+	struct epoll_event ev;
+
+	loop = calloc(1, sizeof(*loop));
+	if (!loop)
+		return NULL;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		free(loop);
+		return NULL;
+	}
+
+	loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakeup_fd < 0)
+		goto fail;
+
+	loop->wakeup.fd = loop->wakeup_fd;
+	loop->wakeup.events = EPOLLIN;
+	loop->wakeup.callback = wakeup_event;
+	loop->wakeup.user_data = loop;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &loop->wakeup;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &ev) < 0) {
+		close(loop->wakeup_fd);
+		goto fail;
+	}
+
+	if (wheel_init(loop) < 0) {
+		close(loop->wakeup_fd);
+		goto fail;
+	}
+
+	return loop;
+
+fail:
+	close(loop->epoll_fd);
+	free(loop);
+	return NULL;
+}
+
+/* Remove every entry, calling its destroy function */
+static void remove_all_fds(struct mainloop *loop)
 {
 	unsigned int i;
 
-	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	for (i = 0; i < loop->num_entries; i++) {
+		struct mainloop_data *data = loop->entries[i];
+
+		loop->entries[i] = NULL;
+
+		if (data) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++)
-		mainloop_list[i] = NULL;
+			if (data->destroy)
+				data->destroy(data->user_data);
 
-	epoll_terminate = 0;
+			free(data);
+		}
+	}
 }
 
 /**
- * set epoll_terminate to 1 (mainloop_run exit looping)
+ * free a loop, removing whatever is still on it; it must not be running
+ *
+ * @param loop		loop created by mainloop_new
  */
-void mainloop_quit(void)
+void mainloop_free(struct mainloop *loop)
 {
-	epoll_terminate = 1;
+	if (!loop)
+		return;
+
+	remove_all_fds(loop);
+	remove_all_timeouts(loop);
+
+	if (loop->signal_data && loop->signal_data->destroy)
+		loop->signal_data->destroy(loop->signal_data->user_data);
+
+	free(loop->signal_data);
+	free(loop->entries);
+	free(loop->wheel.timeouts);
+	close(loop->wheel.fd);
+	close(loop->wakeup_fd);
+	close(loop->epoll_fd);
+	free(loop);
+}
+
+/**
+ * wake the loop up from epoll_wait; the wakeup handler, if any, then runs
+ * on the loop's thread. Safe to call from any thread
+ *
+ * @param loop		loop to wake up
+ * @return 0 success else <0 error
+ */
+int mainloop_wakeup(struct mainloop *loop)
+{
+	uint64_t one = 1;
+
+	if (!loop)
+		return -EINVAL;
+
+	/* EAGAIN: the counter is saturated, so a wakeup is pending anyway */
+	if (write(loop->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * set the function called on the loop's thread after mainloop_wakeup,
+ * e.g. to drain work handed over by other threads
+ *
+ * @param loop		loop to set the handler on
+ * @param callback	handler, or NULL for none
+ * @param user_data	passed to callback
+ */
+void mainloop_set_wakeup_handler(struct mainloop *loop,
+			mainloop_wakeup_func callback, void *user_data)
+{
+	loop->wakeup_callback = callback;
+	loop->wakeup_data = user_data;
+}
+
+/* Stop the loop, from its own thread or any other */
+static void set_terminate(struct mainloop *loop, int exit_status)
+{
+	if (exit_status >= 0)
+		loop->exit_status = exit_status;
+
+	__atomic_store_n(&loop->terminate, 1, __ATOMIC_RELEASE);
+	mainloop_wakeup(loop);
+}
+
+/**
+ * set terminate to 1 (mainloop_run exit looping)
+ */
+void mainloop_quit(struct mainloop *loop)
+{
+	set_terminate(loop, -1);
 }
 
 /**
  * set exit_status to EXIT_SUCCESS
- * set epoll_terminate to 1 (mainloop_run exit looping)
+ * set terminate to 1 (mainloop_run exit looping)
  */
-void mainloop_exit_success(void)
+void mainloop_exit_success(struct mainloop *loop)
 {
-	exit_status = EXIT_SUCCESS;
-	epoll_terminate = 1;
+	set_terminate(loop, EXIT_SUCCESS);
 }
 
 /**
  * set exit_status to EXIT_FAILURE
- * set epoll_terminate to 1 (mainloop_run exit looping)
+ * set terminate to 1 (mainloop_run exit looping)
  */
-void mainloop_exit_failure(void)
+void mainloop_exit_failure(struct mainloop *loop)
 {
-	exit_status = EXIT_FAILURE;
-	epoll_terminate = 1;
+	set_terminate(loop, EXIT_FAILURE);
 }
 
 /**
@@ -151,7 +368,7 @@ static void signal_callback(int fd, uint32_t events, void *user_data)
 	ssize_t result;
 
 	if (events & (EPOLLERR | EPOLLHUP)) {
-		mainloop_quit();
+		mainloop_quit(data->loop);
 		return;
 	}
 
@@ -165,15 +382,17 @@ static void signal_callback(int fd, uint32_t events, void *user_data)
 
 /**
  * main loop wait for epoll events
- * to exit the loop, set epoll_terminate to a <>0 value
+ * to exit the loop, set terminate to a <>0 value. The fds are removed on
+ * exit, the timeouts are kept, unfired, until mainloop_free
  * @see mainloop_exit_failure
  * @see mainloop_exit_success
  *
+ * @param loop		loop to run, on the calling thread
  * @return exit_status EXIT_SUCCESS or EXIT_FAILURE
  */
-int mainloop_run(void)
+int mainloop_run(struct mainloop *loop)
 {
-	unsigned int i;
+	struct signal_data *signal_data = loop->signal_data;
 
 	if (signal_data) {
 		if (sigprocmask(SIG_BLOCK, &signal_data->mask, NULL) < 0)
@@ -184,21 +403,24 @@ int mainloop_run(void)
 		if (signal_data->fd < 0)
 			return EXIT_FAILURE;
 
-		if (mainloop_add_fd(signal_data->fd, EPOLLIN,
+		if (mainloop_add_fd(loop, signal_data->fd, EPOLLIN,
 				signal_callback, signal_data, NULL) < 0) {
 			close(signal_data->fd);
 			return EXIT_FAILURE;
 		}
 	}
 
-	exit_status = EXIT_SUCCESS;
+	loop->exit_status = EXIT_SUCCESS;
 
-	while (!epoll_terminate) {
+	/*
+	 * Sleeps until there's something to do: quitting goes through the
+	 * wakeup eventfd, so there's no need to poll for it
+	 */
+	while (!__atomic_load_n(&loop->terminate, __ATOMIC_ACQUIRE)) {
 		struct epoll_event events[MAX_EPOLL_EVENTS];
 		int n, nfds;
 
-		//nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
-		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 100);
+		nfds = epoll_wait(loop->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
 
 		if (nfds < 0)
 			continue;
@@ -212,38 +434,65 @@ int mainloop_run(void)
 	}
 
 	if (signal_data) {
-		mainloop_remove_fd(signal_data->fd);
+		mainloop_remove_fd(loop, signal_data->fd);
 		close(signal_data->fd);
 
 		if (signal_data->destroy)
 			signal_data->destroy(signal_data->user_data);
+
+		free(signal_data);
+		loop->signal_data = NULL;
 	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++) {
-		struct mainloop_data *data = mainloop_list[i];
+	/*
+	 * Timeouts stay until mainloop_free: their owners still hold the ids,
+	 * which the pool would otherwise hand out again
+	 */
+	remove_all_fds(loop);
 
-		mainloop_list[i] = NULL;
+	return loop->exit_status;
+}
 
-		if (data) {
-			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+/* Make room in the event table for fd */
+static int grow_entries(struct mainloop *loop, int fd)
+{
+	struct mainloop_data **entries;
+	unsigned int num_entries;
 
-			if (data->destroy)
-				data->destroy(data->user_data);
+	if ((unsigned int) fd < loop->num_entries)
+		return 0;
 
-			free(data);
-		}
-	}
+	num_entries = loop->num_entries ? loop->num_entries : 64;
+	while (num_entries <= (unsigned int) fd)
+		num_entries *= 2;
+
+	entries = realloc(loop->entries, num_entries * sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+
+	memset(entries + loop->num_entries, 0,
+		(num_entries - loop->num_entries) * sizeof(*entries));
+
+	loop->entries = entries;
+	loop->num_entries = num_entries;
+
+	return 0;
+}
 
-	close(epoll_fd);
-	epoll_fd = 0;
+/* The entry for fd, or NULL */
+static struct mainloop_data *find_entry(struct mainloop *loop, int fd)
+{
+	if (fd < 0 || (unsigned int) fd >= loop->num_entries)
+		return NULL;
 
-	return exit_status;
+	return loop->entries[fd];
 }
 
 /**
  * trigger an event to be processed by the mainloop_run function
- * and create a mainloop_list entry @see EPOLL_EVENTS_DOC for events description
+ * and create an event table entry @see EPOLL_EVENTS_DOC for events description
  *
+ * @param loop			loop to add the fd to
  * @param fd			"file descriptor" source of the event (socket)
  * @param events		event flags EPOOL type like EPOLLIN, EPOLLOUT...
  * @param callback		function to call back by the event processor
@@ -251,16 +500,21 @@ int mainloop_run(void)
  * @param destroy		management function to unallocate user_data
  * @return 0 success else <0 error
  */
-int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+int mainloop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback, void *user_data,
+				mainloop_destroy_func destroy)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1 || !callback)
+	if (!loop || fd < 0 || !callback)
 		return -EINVAL;
 
+	err = grow_entries(loop, fd);
+	if (err < 0)
+		return err;
+
 	data = malloc(sizeof(*data));
 	if (!data)
 		return -ENOMEM;
@@ -276,35 +530,36 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 	ev.events = events;
 	ev.data.ptr = data;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, data->fd, &ev);
 	if (err < 0) {
 		free(data);
 		return err;
 	}
 
-	mainloop_list[fd] = data;
+	loop->entries[fd] = data;
 
 	return 0;
 }
 
 /**
- * trigger an epoll event for an existing mainloop socket (exisiting mainloop_list[fd])
- * epool event "events" = events, "data.ptr" = mainloop_list[fd]
+ * trigger an epoll event for an existing mainloop socket (exisiting table entry)
+ * epool event "events" = events, "data.ptr" = the entry for fd
  *
+ * @param loop		loop the fd is on
  * @param fd		socket
  * @param events	EPOLL event like EPOLLIN, EPOLLOUT...
  * @return 0==Success <0 error
  */
-int mainloop_modify_fd(int fd, uint32_t events)
+int mainloop_modify_fd(struct mainloop *loop, int fd, uint32_t events)
 {
 	struct mainloop_data *data;
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (!loop || fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = find_entry(loop, fd);
 	if (!data)
 		return -ENXIO;
 
@@ -312,7 +567,7 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	ev.events = events;
 	ev.data.ptr = data;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, data->fd, &ev);
 	if (err < 0)
 		return err;
 
@@ -321,21 +576,21 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	return 0;
 }
 
-int mainloop_remove_fd(int fd)
+int mainloop_remove_fd(struct mainloop *loop, int fd)
 {
 	struct mainloop_data *data;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (!loop || fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = find_entry(loop, fd);
 	if (!data)
 		return -ENXIO;
 
-	mainloop_list[fd] = NULL;
+	loop->entries[fd] = NULL;
 
-	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
+	err = epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
 
 	if (data->destroy)
 		data->destroy(data->user_data);
@@ -345,123 +600,434 @@ int mainloop_remove_fd(int fd)
 	return err;
 }
 
-static void timeout_destroy(void *user_data)
+static uint64_t clock_ns(void)
 {
-	struct timeout_data *data = user_data;
+	struct timespec ts;
 
-	close(data->fd);
-	data->fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if (data->destroy)
-		data->destroy(data->user_data);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static void timeout_callback(int fd, uint32_t events, void *user_data)
+/* The current tick: the ticks that have fully elapsed */
+static uint64_t wheel_clock(struct timer_wheel *wheel)
 {
-	struct timeout_data *data = user_data;
-	uint64_t expired;
-	ssize_t result;
+	return (clock_ns() - wheel->base) / 1000000;
+}
 
-	if (events & (EPOLLERR | EPOLLHUP))
-		return;
+/* Rotate a slot bitmap right, so that bit 0 is the slot after index */
+static inline uint64_t slots_after(uint64_t occupied, unsigned int index)
+{
+	unsigned int shift = (index + 1) & WHEEL_MASK;
 
-	result = read(data->fd, &expired, sizeof(expired));
-	if (result != sizeof(expired))
-		return;
+	if (!shift)
+		return occupied;
 
-	if (data->callback)
-		data->callback(data->fd, data->user_data);
+	return (occupied >> shift) | (occupied << (WHEEL_SIZE - shift));
 }
 
-static inline int timeout_set(int fd, unsigned int msec)
+static void wheel_link(struct timer_wheel *wheel, int id)
+{
+	struct timeout_data *data = &wheel->timeouts[id];
+	uint64_t expires = data->expires;
+	unsigned int level, index;
+	int slot;
+
+	/*
+	 * The lowest level whose current slot is less than a turn of the
+	 * level away from the deadline; past the top level it's put in the
+	 * top level's last slot and placed again when that comes around
+	 */
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int shift = level * WHEEL_BITS;
+
+		if ((expires >> shift) - (wheel->now >> shift) < WHEEL_SIZE)
+			break;
+	}
+
+	if (level == WHEEL_LEVELS) {
+		level = WHEEL_LEVELS - 1;
+		index = ((wheel->now >> (level * WHEEL_BITS)) + WHEEL_MASK) &
+								WHEEL_MASK;
+	} else {
+		index = (expires >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	}
+
+	slot = level * WHEEL_SIZE + index;
+
+	data->slot = slot;
+	data->prev = -1;
+	data->next = wheel->slots[slot];
+
+	if (data->next >= 0)
+		wheel->timeouts[data->next].prev = id;
+
+	wheel->slots[slot] = id;
+	wheel->occupied[level] |= 1ULL << index;
+}
+
+static void wheel_unlink(struct timer_wheel *wheel, int id)
+{
+	struct timeout_data *data = &wheel->timeouts[id];
+	int slot = data->slot;
+
+	if (data->prev >= 0)
+		wheel->timeouts[data->prev].next = data->next;
+	else
+		wheel->slots[slot] = data->next;
+
+	if (data->next >= 0)
+		wheel->timeouts[data->next].prev = data->prev;
+
+	if (wheel->slots[slot] < 0)
+		wheel->occupied[slot / WHEEL_SIZE] &= ~(1ULL << (slot & WHEEL_MASK));
+
+	data->slot = TIMEOUT_IDLE;
+}
+
+/*
+ * The next tick the wheel has something to do at: a deadline on the
+ * lowest level, or a slot of a higher one to spread out. It's never later
+ * than the earliest deadline
+ */
+static uint64_t wheel_next(struct timer_wheel *wheel)
+{
+	uint64_t next = WHEEL_NEVER;
+	unsigned int level;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int shift = level * WHEEL_BITS;
+		uint64_t turn = wheel->now >> shift;
+		uint64_t occupied, tick;
+
+		occupied = slots_after(wheel->occupied[level], turn & WHEEL_MASK);
+		if (!occupied)
+			continue;
+
+		tick = (turn + __builtin_ctzll(occupied) + 1) << shift;
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+/* Set the timerfd for tick, unless it's already set for an earlier one */
+static void wheel_arm(struct timer_wheel *wheel, uint64_t tick)
 {
 	struct itimerspec itimer;
-	unsigned int sec = msec / 1000;
+	uint64_t ns;
+
+	if (wheel->running || tick >= wheel->armed)
+		return;
+
+	ns = wheel->base + tick * 1000000;
 
 	memset(&itimer, 0, sizeof(itimer));
-	itimer.it_interval.tv_sec = 0;
-	itimer.it_interval.tv_nsec = 0;
-	itimer.it_value.tv_sec = sec;
-	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000;
+	itimer.it_value.tv_sec = ns / 1000000000ULL;
+	itimer.it_value.tv_nsec = ns % 1000000000ULL;
+
+	if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &itimer, NULL) < 0)
+		return;
 
-	return timerfd_settime(fd, 0, &itimer, NULL);
+	wheel->armed = tick;
 }
 
-int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+/* Spread a slot of a higher level over the levels below */
+static void wheel_cascade(struct timer_wheel *wheel, int slot)
 {
-	struct timeout_data *data;
+	int id;
 
-	if (!callback)
-		return -EINVAL;
+	while ((id = wheel->slots[slot]) >= 0) {
+		wheel_unlink(wheel, id);
+		wheel_link(wheel, id);
+	}
+}
 
-	data = malloc(sizeof(*data));
-	if (!data)
-		return -ENOMEM;
+/* Advance the wheel to tick, running the timeouts that come due */
+static void wheel_run(struct timer_wheel *wheel, uint64_t tick)
+{
+	while (wheel->now < tick) {
+		uint64_t next = wheel_next(wheel);
+		int level, slot, id;
 
-	memset(data, 0, sizeof(*data));
-	data->callback = callback;
-	data->destroy = destroy;
-	data->user_data = user_data;
+		if (next > tick) {
+			wheel->now = tick;
+			break;
+		}
 
-	data->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (data->fd < 0) {
-		free(data);
-		return -EIO;
-	}
+		wheel->now = next;
 
-	if (msec > 0) {
-		if (timeout_set(data->fd, msec) < 0) {
-			close(data->fd);
-			free(data);
-			return -EIO;
+		for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+			unsigned int shift = level * WHEEL_BITS;
+
+			if (next & ((1ULL << shift) - 1))
+				continue;
+
+			wheel_cascade(wheel, level * WHEEL_SIZE +
+					((next >> shift) & WHEEL_MASK));
+		}
+
+		/*
+		 * Everything in the current slot of the lowest level is due
+		 * now. A callback may add, re-arm or remove timeouts (and grow
+		 * the pool), but nothing it arms lands in this slot
+		 */
+		slot = next & WHEEL_MASK;
+
+		while ((id = wheel->slots[slot]) >= 0) {
+			struct timeout_data *data = &wheel->timeouts[id];
+
+			wheel_unlink(wheel, id);
+			data->callback(id, data->user_data);
 		}
 	}
+}
 
-	if (mainloop_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
-				timeout_callback, data, timeout_destroy) < 0) {
-		close(data->fd);
-		free(data);
+static void timer_event(int fd, uint32_t events, void *user_data)
+{
+	struct mainloop *loop = user_data;
+	struct timer_wheel *wheel = &loop->wheel;
+	uint64_t expired, next;
+
+	if (read(fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+		return;
+
+	wheel->armed = WHEEL_NEVER;
+
+	wheel->running = 1;
+	wheel_run(wheel, wheel_clock(wheel));
+	wheel->running = 0;
+
+	next = wheel_next(wheel);
+	if (next != WHEEL_NEVER)
+		wheel_arm(wheel, next);
+}
+
+/* Create the loop's timerfd and put it on the epoll instance */
+static int wheel_init(struct mainloop *loop)
+{
+	struct timer_wheel *wheel = &loop->wheel;
+	struct epoll_event ev;
+	unsigned int i;
+
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->fd < 0)
+		return -EIO;
+
+	wheel->entry.fd = wheel->fd;
+	wheel->entry.events = EPOLLIN;
+	wheel->entry.callback = timer_event;
+	wheel->entry.user_data = loop;
+
+	wheel->base = clock_ns();
+	wheel->armed = WHEEL_NEVER;
+	wheel->free_list = -1;
+
+	for (i = 0; i < WHEEL_LEVELS * WHEEL_SIZE; i++)
+		wheel->slots[i] = -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wheel->entry;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, wheel->fd, &ev) < 0) {
+		close(wheel->fd);
 		return -EIO;
 	}
 
-	return data->fd;
+	return 0;
 }
 
-int mainloop_modify_timeout(int id, unsigned int msec)
+/* Take a timeout from the pool, growing it if it's used up */
+static int timeout_alloc(struct timer_wheel *wheel)
 {
-	if (msec > 0) {
-		if (timeout_set(id, msec) < 0)
-			return -EIO;
+	struct timeout_data *timeouts;
+	unsigned int i, num_timeouts;
+	int id;
+
+	if (wheel->free_list < 0) {
+		num_timeouts = wheel->num_timeouts ? wheel->num_timeouts * 2 : 16;
+
+		timeouts = realloc(wheel->timeouts,
+					num_timeouts * sizeof(*timeouts));
+		if (!timeouts)
+			return -ENOMEM;
+
+		for (i = num_timeouts; i-- > wheel->num_timeouts;) {
+			timeouts[i].slot = TIMEOUT_FREE;
+			timeouts[i].next = wheel->free_list;
+			wheel->free_list = i;
+		}
+
+		wheel->timeouts = timeouts;
+		wheel->num_timeouts = num_timeouts;
 	}
 
-	if (mainloop_modify_fd(id, EPOLLIN | EPOLLONESHOT) < 0)
-		return -EIO;
+	id = wheel->free_list;
+	wheel->free_list = wheel->timeouts[id].next;
+
+	return id;
+}
+
+/* The timeout with the given id, or NULL if there's none */
+static struct timeout_data *find_timeout(struct mainloop *loop, int id)
+{
+	struct timer_wheel *wheel = &loop->wheel;
+
+	if (id < 0 || (unsigned int) id >= wheel->num_timeouts)
+		return NULL;
+
+	if (wheel->timeouts[id].slot == TIMEOUT_FREE)
+		return NULL;
+
+	return &wheel->timeouts[id];
+}
+
+/* Put a timeout on the wheel, due msec from now */
+static void timeout_set(struct mainloop *loop, int id, unsigned int msec)
+{
+	struct timer_wheel *wheel = &loop->wheel;
+	struct timeout_data *data = &wheel->timeouts[id];
+	uint64_t elapsed;
+
+	if (data->slot >= 0)
+		wheel_unlink(wheel, id);
+
+	/* Rounded up, so that it never fires early */
+	elapsed = clock_ns() - wheel->base;
+	data->expires = (elapsed + 999999) / 1000000 + msec;
+
+	wheel_link(wheel, id);
+	wheel_arm(wheel, data->expires);
+}
+
+/**
+ * add a one-shot timeout to the loop. Once it has fired it stays on the
+ * loop, unarmed, until it's re-armed with mainloop_modify_timeout or
+ * removed
+ *
+ * @param loop		loop to add the timeout to
+ * @param msec		time until it fires; 0 adds it unarmed
+ * @param callback	function called when it fires
+ * @param user_data	passed to callback
+ * @param destroy	called with user_data when the timeout is removed
+ * @return the timeout's id (>= 0), else <0 error
+ */
+int mainloop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback, void *user_data,
+				mainloop_destroy_func destroy)
+{
+	struct timeout_data *data;
+	int id;
+
+	if (!loop || !callback)
+		return -EINVAL;
+
+	id = timeout_alloc(&loop->wheel);
+	if (id < 0)
+		return id;
+
+	data = &loop->wheel.timeouts[id];
+	data->slot = TIMEOUT_IDLE;
+	data->callback = callback;
+	data->destroy = destroy;
+	data->user_data = user_data;
+
+	if (msec > 0)
+		timeout_set(loop, id, msec);
+
+	return id;
+}
+
+/**
+ * re-arm a timeout, whether or not it has fired
+ *
+ * @param loop		loop the timeout is on
+ * @param id		id returned by mainloop_add_timeout
+ * @param msec		time until it fires; 0 leaves it as it is
+ * @return 0 success else <0 error
+ */
+int mainloop_modify_timeout(struct mainloop *loop, int id, unsigned int msec)
+{
+	if (!loop || !find_timeout(loop, id))
+		return -ENXIO;
+
+	if (msec > 0)
+		timeout_set(loop, id, msec);
 
 	return 0;
 }
 
-int mainloop_remove_timeout(int id)
+/**
+ * remove a timeout, calling its destroy function. The timerfd is left as
+ * it is, which at worst costs a wakeup with nothing to do
+ *
+ * @param loop		loop the timeout is on
+ * @param id		id returned by mainloop_add_timeout
+ * @return 0 success else <0 error
+ */
+int mainloop_remove_timeout(struct mainloop *loop, int id)
 {
-	return mainloop_remove_fd(id);
+	struct timer_wheel *wheel;
+	struct timeout_data *data;
+	mainloop_destroy_func destroy;
+	void *user_data;
+
+	if (!loop)
+		return -EINVAL;
+
+	data = find_timeout(loop, id);
+	if (!data)
+		return -ENXIO;
+
+	wheel = &loop->wheel;
+
+	if (data->slot >= 0)
+		wheel_unlink(wheel, id);
+
+	destroy = data->destroy;
+	user_data = data->user_data;
+
+	data->slot = TIMEOUT_FREE;
+	data->next = wheel->free_list;
+	wheel->free_list = id;
+
+	if (destroy)
+		destroy(user_data);
+
+	return 0;
+}
+
+/* Remove every timeout, calling its destroy function */
+static void remove_all_timeouts(struct mainloop *loop)
+{
+	unsigned int id;
+
+	for (id = 0; id < loop->wheel.num_timeouts; id++)
+		mainloop_remove_timeout(loop, id);
 }
 
 /**
  * set mainloop signal handler (signal_data) usally SIGINT and SIGTERM handler
- * signal_data is a global variable
+ * it is installed when the loop runs; signal masks are per thread, so the
+ * loop's thread is the one that stops receiving them as signals
  *
+ * @param loop		loop to handle the signals on
  * @param mask		events to filter
  * @param callback	function call triggered by filtered events prototype callback(int signum, void *user_data)
  * @param user_data	user data to pass to callback
  * @param destroy	user data storage management
  * @return 0 success else <0 error
  */
-int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
-				void *user_data, mainloop_destroy_func destroy)
+int mainloop_set_signal(struct mainloop *loop, sigset_t *mask,
+				mainloop_signal_func callback, void *user_data,
+				mainloop_destroy_func destroy)
 {
 	struct signal_data *data;
 
-	if (!mask || !callback)
+	if (!loop || !mask || !callback)
 		return -EINVAL;
 
 	data = malloc(sizeof(*data));
@@ -473,11 +1039,12 @@ int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
 	data->destroy = destroy;
 	data->user_data = user_data;
 
+	data->loop = loop;
 	data->fd = -1;
 	memcpy(&data->mask, mask, sizeof(sigset_t));
 
-	free(signal_data);
-	signal_data = data;
+	free(loop->signal_data);
+	loop->signal_data = data;
 
 	return 0;
 }
@@ -30,22 +30,35 @@ typedef void (*mainloop_destroy_func) (void *user_data);
 typedef void (*mainloop_event_func) (int fd, uint32_t events, void *user_data);
 typedef void (*mainloop_timeout_func) (int id, void *user_data);
 typedef void (*mainloop_signal_func) (int signum, void *user_data);
+typedef void (*mainloop_wakeup_func) (void *user_data);
 
-void mainloop_init(void);
-void mainloop_quit(void);
-void mainloop_exit_success(void);
-void mainloop_exit_failure(void);
-int mainloop_run(void);
+/* An event loop; see mainloop_new */
+struct mainloop;
 
-int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
-				void *user_data, mainloop_destroy_func destroy);
-int mainloop_modify_fd(int fd, uint32_t events);
-int mainloop_remove_fd(int fd);
+struct mainloop *mainloop_new(void);
+void mainloop_free(struct mainloop *loop);
 
-int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
-				void *user_data, mainloop_destroy_func destroy);
-int mainloop_modify_timeout(int fd, unsigned int msec);
-int mainloop_remove_timeout(int id);
+void mainloop_quit(struct mainloop *loop);
+void mainloop_exit_success(struct mainloop *loop);
+void mainloop_exit_failure(struct mainloop *loop);
+int mainloop_run(struct mainloop *loop);
 
-int mainloop_set_signal(sigset_t *mask, mainloop_signal_func callback,
-				void *user_data, mainloop_destroy_func destroy);
+int mainloop_wakeup(struct mainloop *loop);
+void mainloop_set_wakeup_handler(struct mainloop *loop,
+			mainloop_wakeup_func callback, void *user_data);
+
+int mainloop_add_fd(struct mainloop *loop, int fd, uint32_t events,
+				mainloop_event_func callback, void *user_data,
+				mainloop_destroy_func destroy);
+int mainloop_modify_fd(struct mainloop *loop, int fd, uint32_t events);
+int mainloop_remove_fd(struct mainloop *loop, int fd);
+
+int mainloop_add_timeout(struct mainloop *loop, unsigned int msec,
+				mainloop_timeout_func callback, void *user_data,
+				mainloop_destroy_func destroy);
+int mainloop_modify_timeout(struct mainloop *loop, int id, unsigned int msec);
+int mainloop_remove_timeout(struct mainloop *loop, int id);
+
+int mainloop_set_signal(struct mainloop *loop, sigset_t *mask,
+				mainloop_signal_func callback, void *user_data,
+				mainloop_destroy_func destroy);
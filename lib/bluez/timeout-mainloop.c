@@ -0,0 +1,136 @@
+/**
+ * @file timeout-mainloop.c
+ * @brief timeout.h on top of the epoll mainloop's timer wheel
+ * the original work comes from bluez v5.39
+ *
+ */
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2014  Intel Corporation. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mainloop.h"
+#include "timeout.h"
+
+struct timeout_data {
+	struct mainloop *loop;
+	int id;
+	timeout_func_t func;
+	timeout_destroy_func_t destroy;
+	unsigned int timeout;
+	void *user_data;
+	int running;
+	int removed;
+};
+
+/**
+ * run the timeout function; it repeats for as long as func returns true.
+ * func may remove its own timeout, in which case the id may already belong
+ * to another one, so nothing is done with it afterwards
+ *
+ * @param id		mainloop timeout id
+ * @param user_data	timeout_data
+ */
+static void timeout_callback(int id, void *user_data)
+{
+	struct timeout_data *data = user_data;
+	struct mainloop *loop = data->loop;
+	int repeat;
+
+	data->running = 1;
+	repeat = data->func(data->user_data);
+	data->running = 0;
+
+	if (data->removed) {
+		free(data);
+		return;
+	}
+
+	if (repeat && !mainloop_modify_timeout(loop, id, data->timeout))
+		return;
+
+	mainloop_remove_timeout(loop, id);
+}
+
+static void timeout_destroy(void *user_data)
+{
+	struct timeout_data *data = user_data;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	/* Removed from its own func: timeout_callback frees it on return */
+	if (data->running) {
+		data->removed = 1;
+		return;
+	}
+
+	free(data);
+}
+
+/**
+ * add a timeout to loop, with millisecond resolution. There's no default
+ * loop here, so a NULL loop adds nothing
+ *
+ * @param loop		loop to run the timeout on
+ * @param timeout	time until func is called, in ms
+ * @param func		called when it fires; returning true re-arms it
+ * @param user_data	passed to func
+ * @param destroy	called with user_data when the timeout goes away
+ * @return the timeout id, 0 on failure
+ */
+unsigned int timeout_add(struct mainloop *loop, unsigned int timeout,
+			timeout_func_t func, void *user_data,
+			timeout_destroy_func_t destroy)
+{
+	struct timeout_data *data;
+
+	if (!loop || !func)
+		return 0;
+
+	data = malloc(sizeof(*data));
+	if (!data)
+		return 0;
+
+	memset(data, 0, sizeof(*data));
+	data->loop = loop;
+	data->func = func;
+	data->destroy = destroy;
+	data->user_data = user_data;
+	/* 0 would add the mainloop timeout unarmed; the next tick will do */
+	data->timeout = timeout ? timeout : 1;
+
+	data->id = mainloop_add_timeout(loop, data->timeout, timeout_callback,
+							data, timeout_destroy);
+	if (data->id < 0) {
+		free(data);
+		return 0;
+	}
+
+	/* Mainloop ids start at 0, which timeout.h keeps for failure */
+	return (unsigned int) data->id + 1;
+}
+
+void timeout_remove(struct mainloop *loop, unsigned int id)
+{
+	if (loop && id)
+		mainloop_remove_timeout(loop, (int) (id - 1));
+}
@@ -22,6 +22,14 @@
 typedef bool (*timeout_func_t)(void *user_data);
 typedef void (*timeout_destroy_func_t)(void *user_data);
 
-unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
-			void *user_data, timeout_destroy_func_t destroy);
-void timeout_remove(unsigned int id);
+/*
+ * Timeouts run on the given loop, next to its io; ids are only meaningful
+ * to the loop that handed them out. A NULL loop means the backend's
+ * default one, where it has one
+ */
+struct mainloop;
+
+unsigned int timeout_add(struct mainloop *loop, unsigned int timeout,
+			timeout_func_t func, void *user_data,
+			timeout_destroy_func_t destroy);
+void timeout_remove(struct mainloop *loop, unsigned int id);
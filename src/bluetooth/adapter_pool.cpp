@@ -0,0 +1,179 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bluetooth/adapter_pool.hpp"
+
+#include <utility>
+
+#include "bluez.h"
+#include "util/logger.hpp"
+
+namespace bluetooth
+{
+
+AdapterPool &
+AdapterPool::instance()
+{
+  static AdapterPool pool;
+  return pool;
+}
+
+double
+AdapterPool::get_airtime(uint16_t interval)
+{
+  // Intervals are in units of 1.25 ms
+  return event_airtime.count() / (interval * 1250.0);
+}
+
+int
+AdapterPool::add_adapter_cb(int /*dd*/, int dev_id, long arg)
+{
+  AdapterPool * This = (AdapterPool *) arg;
+
+  bdaddr_t address;
+  bdaddr_t bdaddr_any = {{0, 0, 0, 0, 0, 0}};
+  if (hci_devba(dev_id, &address) < 0 || !bacmp(&address, &bdaddr_any)) {
+    return 0;
+  }
+
+  State & state = This->adapters_[dev_id];
+  bacpy(&state.address, &address);
+  state.up = true;
+
+  // Keep going through the rest of them
+  return 0;
+}
+
+void
+AdapterPool::enumerate()
+{
+  for (auto & [dev_id, state] : adapters_) {
+    state.up = false;
+  }
+
+  hci_for_each_dev(HCI_UP, add_adapter_cb, (long) this);
+
+  // Adapters that are gone only stay around while they have connections
+  for (auto it = adapters_.begin(); it != adapters_.end(); ) {
+    it = !it->second.up && !it->second.connections ? adapters_.erase(it) : std::next(it);
+  }
+}
+
+AdapterPool::Lease
+AdapterPool::acquire()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  enumerate();
+
+  auto best = adapters_.end();
+  for (auto it = adapters_.begin(); it != adapters_.end(); it++) {
+    if (!it->second.up) {
+      continue;
+    }
+
+    if (best == adapters_.end() || it->second.airtime < best->second.airtime ||
+      (it->second.airtime == best->second.airtime && it->second.connections < best->second.connections))
+    {
+      best = it;
+    }
+  }
+
+  Lease lease;
+  if (best == adapters_.end()) {
+    return lease;
+  }
+
+  State & state = best->second;
+  state.connections++;
+  state.airtime += get_airtime(default_interval);
+
+  lease.pool_ = this;
+  lease.dev_id_ = best->first;
+  bacpy(&lease.address_, &state.address);
+  lease.interval_ = default_interval;
+
+  char address[18];
+  ba2str(&state.address, address);
+  JERONIBOT_LOG_DEBUG("AdapterPool: Connecting through hci%d (%s), %zu connections, %.0f%% airtime\n",
+    best->first, address, state.connections, state.airtime * 100.0);
+
+  return lease;
+}
+
+std::vector<AdapterPool::Adapter>
+AdapterPool::get_adapters()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  enumerate();
+
+  std::vector<Adapter> adapters;
+  for (const auto & [dev_id, state] : adapters_) {
+    adapters.push_back({dev_id, state.address, state.connections, state.airtime});
+  }
+
+  return adapters;
+}
+
+AdapterPool::Lease::Lease(Lease && other) noexcept
+{
+  *this = std::move(other);
+}
+
+AdapterPool::Lease &
+AdapterPool::Lease::operator=(Lease && other) noexcept
+{
+  if (this != &other) {
+    release();
+    pool_ = std::exchange(other.pool_, nullptr);
+    dev_id_ = std::exchange(other.dev_id_, -1);
+    bacpy(&address_, &other.address_);
+    interval_ = other.interval_;
+  }
+
+  return *this;
+}
+
+AdapterPool::Lease::~Lease()
+{
+  release();
+}
+
+void
+AdapterPool::Lease::set_interval(uint16_t interval)
+{
+  if (!pool_ || !interval) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(pool_->mutex_);
+  State & state = pool_->adapters_[dev_id_];
+  state.airtime += get_airtime(interval) - get_airtime(interval_);
+  interval_ = interval;
+}
+
+void
+AdapterPool::Lease::release()
+{
+  if (!pool_) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(pool_->mutex_);
+  State & state = pool_->adapters_[dev_id_];
+  state.connections--;
+  state.airtime = state.connections ? state.airtime - get_airtime(interval_) : 0.0;
+  pool_ = nullptr;
+}
+
+}  // namespace bluetooth
@@ -0,0 +1,411 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bluetooth/gatt_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "bluetooth.h"
+#include "uuid.h"
+#include "gatt-db.h"
+}
+
+// File layout, all integers little-endian:
+//
+//   "GATT" | version | record...
+//
+//   'S' start end primary uuid             service
+//   'I' service handle included_start      include declaration
+//   'C' service value_handle properties uuid  characteristic
+//   'D' service handle uuid                descriptor
+//
+// where service is the start handle of the owning service and uuid is its
+// size in bits (16, 32 or 128) followed by the value
+
+namespace bluetooth
+{
+
+namespace
+{
+
+constexpr char magic[] = {'G', 'A', 'T', 'T'};
+constexpr uint8_t version{1};
+
+enum record_type : uint8_t
+{
+  Service = 'S', Include = 'I', Characteristic = 'C', Descriptor = 'D'
+};
+
+class Writer
+{
+public:
+  void u8(uint8_t value) { bytes.push_back(value); }
+
+  void u16(uint16_t value)
+  {
+    bytes.push_back(value & 0xff);
+    bytes.push_back(value >> 8);
+  }
+
+  void uuid(const bt_uuid_t & uuid)
+  {
+    u8(uuid.type);
+    switch (uuid.type) {
+      case bt_uuid_t::BT_UUID16:
+        u16(uuid.value.u16);
+        break;
+      case bt_uuid_t::BT_UUID32:
+        u16(uuid.value.u32 & 0xffff);
+        u16(uuid.value.u32 >> 16);
+        break;
+      default:
+        bytes.insert(bytes.end(), uuid.value.u128.data, uuid.value.u128.data + sizeof(uuid.value.u128.data));
+        break;
+    }
+  }
+
+  std::vector<uint8_t> bytes;
+};
+
+class Reader
+{
+public:
+  explicit Reader(const std::vector<uint8_t> & bytes)
+  : bytes_(bytes)
+  {
+  }
+
+  bool at_end() const { return pos_ == bytes_.size(); }
+  bool ok() const { return ok_; }
+
+  uint8_t u8()
+  {
+    if (pos_ >= bytes_.size()) {
+      ok_ = false;
+      return 0;
+    }
+    return bytes_[pos_++];
+  }
+
+  uint16_t u16()
+  {
+    uint8_t lo = u8();
+    return lo | (u8() << 8);
+  }
+
+  bt_uuid_t uuid()
+  {
+    bt_uuid_t uuid;
+    memset(&uuid, 0, sizeof(uuid));
+
+    switch (u8()) {
+      case 16:
+        bt_uuid16_create(&uuid, u16());
+        break;
+      case 32:
+        {
+          uint32_t lo = u16();
+          bt_uuid32_create(&uuid, lo | (static_cast<uint32_t>(u16()) << 16));
+        }
+        break;
+      case 128:
+        {
+          uint128_t value;
+          for (auto & byte : value.data) {
+            byte = u8();
+          }
+          bt_uuid128_create(&uuid, value);
+        }
+        break;
+      default:
+        ok_ = false;
+        break;
+    }
+
+    return uuid;
+  }
+
+private:
+  const std::vector<uint8_t> & bytes_;
+  std::size_t pos_{0};
+  bool ok_{true};
+};
+
+struct SaveContext
+{
+  Writer writer;
+  uint16_t service{0};
+};
+
+void
+save_descriptor(struct gatt_db_attribute * attr, void * user_data)
+{
+  SaveContext * context = (SaveContext *) user_data;
+
+  context->writer.u8(Descriptor);
+  context->writer.u16(context->service);
+  context->writer.u16(gatt_db_attribute_get_handle(attr));
+  context->writer.uuid(*gatt_db_attribute_get_type(attr));
+}
+
+void
+save_characteristic(struct gatt_db_attribute * attr, void * user_data)
+{
+  SaveContext * context = (SaveContext *) user_data;
+
+  uint16_t handle;
+  uint16_t value_handle;
+  uint8_t properties;
+  bt_uuid_t uuid;
+
+  if (!gatt_db_attribute_get_char_data(attr, &handle, &value_handle, &properties, &uuid)) {
+    return;
+  }
+
+  context->writer.u8(Characteristic);
+  context->writer.u16(context->service);
+  context->writer.u16(value_handle);
+  context->writer.u8(properties);
+  context->writer.uuid(uuid);
+
+  gatt_db_service_foreach_desc(attr, save_descriptor, context);
+}
+
+void
+save_include(struct gatt_db_attribute * attr, void * user_data)
+{
+  SaveContext * context = (SaveContext *) user_data;
+
+  uint16_t handle;
+  uint16_t start;
+  uint16_t end;
+
+  if (!gatt_db_attribute_get_incl_data(attr, &handle, &start, &end)) {
+    return;
+  }
+
+  context->writer.u8(Include);
+  context->writer.u16(context->service);
+  context->writer.u16(handle);
+  context->writer.u16(start);
+}
+
+void
+save_service(struct gatt_db_attribute * attr, void * user_data)
+{
+  SaveContext * context = (SaveContext *) user_data;
+
+  uint16_t start;
+  uint16_t end;
+  bool primary;
+  bt_uuid_t uuid;
+
+  if (!gatt_db_attribute_get_service_data(attr, &start, &end, &primary, &uuid)) {
+    return;
+  }
+
+  context->writer.u8(Service);
+  context->writer.u16(start);
+  context->writer.u16(end);
+  context->writer.u8(primary);
+  context->writer.uuid(uuid);
+
+  context->service = start;
+  gatt_db_service_foreach_incl(attr, save_include, context);
+  gatt_db_service_foreach_char(attr, save_characteristic, context);
+}
+
+void
+activate_service(struct gatt_db_attribute * attr, void * /*user_data*/)
+{
+  gatt_db_service_set_active(attr, true);
+}
+
+// Includes refer to other services, so all services are inserted before any
+// of their contents
+bool
+load_records(struct gatt_db * db, const std::vector<uint8_t> & bytes, bool services)
+{
+  Reader reader(bytes);
+
+  for (std::size_t i = 0; i < sizeof(magic); i++) {
+    reader.u8();
+  }
+  reader.u8();
+
+  while (reader.ok() && !reader.at_end()) {
+    switch (reader.u8()) {
+      case Service:
+        {
+          uint16_t start = reader.u16();
+          uint16_t end = reader.u16();
+          bool primary = reader.u8();
+          bt_uuid_t uuid = reader.uuid();
+
+          if (services) {
+            if (!reader.ok() || end < start) {
+              return false;
+            }
+            if (!gatt_db_insert_service(db, start, &uuid, primary, end - start + 1)) {
+              return false;
+            }
+          }
+        }
+        break;
+
+      case Include:
+        {
+          uint16_t service = reader.u16();
+          uint16_t handle = reader.u16();
+          uint16_t included = reader.u16();
+
+          if (!services) {
+            struct gatt_db_attribute * svc = gatt_db_get_attribute(db, service);
+            struct gatt_db_attribute * incl = gatt_db_get_attribute(db, included);
+            if (!reader.ok() || !svc || !incl) {
+              return false;
+            }
+
+            struct gatt_db_attribute * attr = gatt_db_service_add_included(svc, incl);
+            if (!attr || gatt_db_attribute_get_handle(attr) != handle) {
+              return false;
+            }
+          }
+        }
+        break;
+
+      case Characteristic:
+        {
+          uint16_t service = reader.u16();
+          uint16_t value_handle = reader.u16();
+          uint8_t properties = reader.u8();
+          bt_uuid_t uuid = reader.uuid();
+
+          if (!services) {
+            struct gatt_db_attribute * svc = gatt_db_get_attribute(db, service);
+            if (!reader.ok() || !svc) {
+              return false;
+            }
+            if (!gatt_db_service_insert_characteristic(
+                svc, value_handle, &uuid, 0, properties, nullptr, nullptr, nullptr))
+            {
+              return false;
+            }
+          }
+        }
+        break;
+
+      case Descriptor:
+        {
+          uint16_t service = reader.u16();
+          uint16_t handle = reader.u16();
+          bt_uuid_t uuid = reader.uuid();
+
+          if (!services) {
+            struct gatt_db_attribute * svc = gatt_db_get_attribute(db, service);
+            if (!reader.ok() || !svc) {
+              return false;
+            }
+            if (!gatt_db_service_insert_descriptor(svc, handle, &uuid, 0, nullptr, nullptr, nullptr)) {
+              return false;
+            }
+          }
+        }
+        break;
+
+      default:
+        return false;
+    }
+  }
+
+  return reader.ok();
+}
+
+}  // namespace
+
+bool
+GattCache::save(struct gatt_db * db, const std::string & path)
+{
+  SaveContext context;
+  context.writer.bytes.assign(magic, magic + sizeof(magic));
+  context.writer.u8(version);
+
+  gatt_db_foreach_service(db, nullptr, save_service, &context);
+
+  // Write to the side and rename, so that a reader never sees a partial file
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(context.writer.bytes.data()), context.writer.bytes.size());
+    if (!file) {
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+  }
+
+  if (std::rename(tmp_path.c_str(), path.c_str()) < 0) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool
+GattCache::load(struct gatt_db * db, const std::string & path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (bytes.size() < sizeof(magic) + 1 || memcmp(bytes.data(), magic, sizeof(magic)) ||
+    bytes[sizeof(magic)] != version)
+  {
+    return false;
+  }
+
+  if (!gatt_db_isempty(db)) {
+    return false;
+  }
+
+  if (!load_records(db, bytes, true) || !load_records(db, bytes, false)) {
+    gatt_db_clear(db);
+    return false;
+  }
+
+  gatt_db_foreach_service(db, nullptr, activate_service, nullptr);
+  return true;
+}
+
+void
+GattCache::remove(const std::string & path)
+{
+  std::remove(path.c_str());
+}
+
+std::string
+GattCache::get_path(const std::string & dir, const std::string & device_address)
+{
+  return dir + "/" + device_address + ".gatt";
+}
+
+}  // namespace bluetooth
@@ -14,6 +14,8 @@
 
 #include <unistd.h>
 
+#include <cerrno>
+
 #include <stdexcept>
 
 #include "bluez.h"
@@ -22,9 +24,9 @@
 namespace bluetooth
 {
 
-L2CapSocket::L2CapSocket(bdaddr_t * src, bdaddr_t * dst, uint8_t dst_type, int sec)
+L2CapSocket::L2CapSocket(bdaddr_t * src, bdaddr_t * dst, uint8_t dst_type, int sec, bool nonblocking)
 {
-  int sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
+  int sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET | (nonblocking ? SOCK_NONBLOCK : 0), BTPROTO_L2CAP);
   if (sock < 0) {
     throw std::runtime_error("L2CapSocket: Failed to create socket");
   }
@@ -57,7 +59,7 @@ L2CapSocket::L2CapSocket(bdaddr_t * src, bdaddr_t * dst, uint8_t dst_type, int s
   dstaddr.l2_bdaddr_type = dst_type;
   bacpy(&dstaddr.l2_bdaddr, dst);
 
-  if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0) {
+  if (connect(sock, (struct sockaddr *) &dstaddr, sizeof(dstaddr)) < 0 && !(nonblocking && errno == EINPROGRESS)) {
     close(sock);
     throw std::runtime_error("L2CapSocket: Failed to connect socket");
   }
@@ -69,4 +71,34 @@ L2CapSocket::~L2CapSocket()
 {
 }
 
+int
+L2CapSocket::get_connection_handle()
+{
+  struct l2cap_conninfo info;
+  memset(&info, 0, sizeof(info));
+  socklen_t len = sizeof(info);
+
+  if (getsockopt(fd_, SOL_L2CAP, L2CAP_CONNINFO, &info, &len) < 0) {
+    return -1;
+  }
+
+  return info.hci_handle;
+}
+
+int
+L2CapSocket::get_device_id()
+{
+  struct sockaddr_l2 addr;
+  memset(&addr, 0, sizeof(addr));
+  socklen_t len = sizeof(addr);
+
+  if (getsockname(fd_, (struct sockaddr *) &addr, &len) < 0) {
+    return -1;
+  }
+
+  char address[18];
+  ba2str(&addr.l2_bdaddr, address);
+  return hci_devid(address);
+}
+
 }  // namespace bluetooth
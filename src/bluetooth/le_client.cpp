@@ -14,8 +14,14 @@
 
 #include "bluetooth/le_client.hpp"
 
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+
 #include <chrono>
 #include <cstdio>
 #include <future>
@@ -25,10 +31,12 @@
 #include <thread>
 
 #include "bluez.h"
+#include "bluetooth/gatt_cache.hpp"
 #include "bluetooth/l2_cap_socket.hpp"
 #include "bluetooth/utils.hpp"
 #include "minipro/minipro.hpp"
 #include "util/joystick.hpp"
+#include "util/logger.hpp"
 
 using namespace std::chrono_literals;
 using namespace jeronibot::util;
@@ -36,91 +44,441 @@ using namespace jeronibot::util;
 namespace bluetooth
 {
 
-LEClient::LEClient(const std::string & device_address, uint8_t dst_type, int sec, uint16_t mtu)
+LEClient::LEClient(
+  const std::string & device_address, uint8_t dst_type, int sec, uint16_t mtu, const std::string & cache_dir,
+  const std::vector<DiscoveryRange> & discovery_ranges)
+: discovery_ranges_(discovery_ranges)
 {
-  bdaddr_t dst_addr;
-  str2ba(device_address.c_str(), &dst_addr);
+  if (!cache_dir.empty()) {
+    cache_path_ = GattCache::get_path(cache_dir, device_address);
+  }
+
+  // Kept for reconnecting
+  str2ba(device_address.c_str(), &dst_addr_);
+
+  // Bound to the adapter picked from the pool, which reconnections keep
+  // going through; with no adapter up, the kernel gets to choose
+  adapter_lease_ = AdapterPool::instance().acquire();
+  if (adapter_lease_.valid()) {
+    bacpy(&src_addr_, &adapter_lease_.get_address());
+  } else {
+    bdaddr_t bdaddr_any = {{0, 0, 0, 0, 0, 0}};
+    bacpy(&src_addr_, &bdaddr_any);
+  }
 
-  bdaddr_t src_addr;
-  bdaddr_t bdaddr_any = {{0, 0, 0, 0, 0, 0}};
-  bacpy(&src_addr, &bdaddr_any);
+  dst_type_ = dst_type;
+  sec_ = sec;
+  has_address_ = true;
 
-  mainloop_init();
+  loop_.reset(mainloop_new());
+  if (!loop_) {
+    throw std::runtime_error("LEClient: Failed to create the event loop");
+  }
 
-  l2_cap_socket_ = std::make_unique<L2CapSocket>(&src_addr, &dst_addr, dst_type, sec);
+  l2_cap_socket_ = std::make_unique<L2CapSocket>(&src_addr_, &dst_addr_, dst_type_, sec_);
 
   fd_ = l2_cap_socket_->get_handle();
   if (fd_ < 0) {
     throw std::runtime_error("LEClient: Failed to connect to Bluetooth device");
   }
 
-  att_ = bt_att_new(fd_, false);
-  if (!att_) {
-    bt_att_unref(att_);
-    fprintf(stderr, "Failed to initialize ATT transport layer\n");
-    return;
-  }
+  init(mtu);
+}
 
-  if (!bt_att_set_close_on_unref(att_, true)) {
-    bt_att_unref(att_);
-    fprintf(stderr, "Failed to set up ATT transport layer\n");
-    return;
+LEClient::LEClient(int fd, uint16_t mtu, const std::string & cache_path, const std::vector<DiscoveryRange> & discovery_ranges)
+: cache_path_(cache_path),
+  discovery_ranges_(discovery_ranges)
+{
+  fd_ = fd;
+  if (fd_ < 0) {
+    throw std::runtime_error("LEClient: Invalid socket");
   }
 
-  if (!bt_att_register_disconnect(att_, LEClient::att_disconnect_cb, nullptr, nullptr)) {
-    bt_att_unref(att_);
-    fprintf(stderr, "Failed to set ATT disconnect handler\n");
-    return;
+  loop_.reset(mainloop_new());
+  if (!loop_) {
+    throw std::runtime_error("LEClient: Failed to create the event loop");
   }
 
-  // class bluetooth GattClient
+  init(mtu);
+}
+
+void
+LEClient::init(uint16_t mtu)
+{
+  mtu_ = mtu;
+
+  // class bluetooth GattClient. The database outlives the GATT clients of
+  // each connection, so a reconnect finds the handles already discovered
   db_ = gatt_db_new();
   if (!db_) {
-    bt_att_unref(att_);
-    fprintf(stderr, "Failed to create GATT database\n");
+    JERONIBOT_LOG_ERROR("Failed to create GATT database\n");
     return;
   }
 
-  gatt_ = bt_gatt_client_new(db_, att_, mtu);
-  if (!gatt_) {
-    gatt_db_unref(db_);
-    bt_att_unref(att_);
-    fprintf(stderr, "Failed to create GATT client\n");
-    return;
+  // A populated database makes bt_gatt_client skip discovery
+  if (!cache_path_.empty()) {
+    cache_loaded_ = GattCache::load(db_, cache_path_);
   }
 
   gatt_db_register(db_, service_added_cb, service_removed_cb, nullptr, nullptr);
 
-  bt_gatt_client_set_ready_handler(gatt_, ready_cb, this, nullptr);
-  bt_gatt_client_set_service_changed(gatt_, service_changed_cb, this, nullptr);
+  if (!attach(fd_)) {
+    return;
+  }
 
-  // bt_gatt_client already holds a reference
-  gatt_db_unref(db_);
+  // Other threads hand their commands to the mainloop by waking it up
+  mainloop_set_wakeup_handler(loop_.get(), wakeup_cb, this);
 
+  loop_running_.store(true, std::memory_order_release);
   input_thread_ = std::make_unique<std::thread>(std::bind(&LEClient::process_input, this));
 
   // Wait for client to be ready
   std::unique_lock<std::mutex> lk(mutex_);
   if (cv_.wait_for(lk, 5s, [this] {return ready_;})) {
-    printf("LEClient: Ready\n");
+    JERONIBOT_LOG_INFO("LEClient: Ready\n");
   } else {
+    lk.unlock();
+    stop();
+
+    // The destructor won't run; release what's on the loop before the loop
+    // itself goes with the members
+    detach();
+    gatt_db_unref(db_);
+    db_ = nullptr;
     throw std::runtime_error("LEClient: Did NOT initialize OK");
   }
 }
 
-LEClient::~LEClient()
+bool
+LEClient::attach(int fd)
+{
+  att_ = bt_att_new(loop_.get(), fd, false);
+  if (!att_) {
+    JERONIBOT_LOG_ERROR("Failed to initialize ATT transport layer\n");
+    return false;
+  }
+
+  if (!bt_att_set_close_on_unref(att_, true)) {
+    detach();
+    JERONIBOT_LOG_ERROR("Failed to set up ATT transport layer\n");
+    return false;
+  }
+
+  if (!bt_att_register_disconnect(att_, LEClient::att_disconnect_cb, this, nullptr)) {
+    detach();
+    JERONIBOT_LOG_ERROR("Failed to set ATT disconnect handler\n");
+    return false;
+  }
+
+  // A reconnect gets a new transport, which has to be given the key again
+  if (sign_key_ && !bt_att_set_local_key(att_, sign_key_->data(), local_counter, this)) {
+    JERONIBOT_LOG_WARN("Failed to restore the signing key\n");
+  }
+
+  if (discovery_ranges_.empty()) {
+    gatt_ = bt_gatt_client_new(db_, att_, mtu_);
+  } else {
+    std::vector<struct bt_gatt_client_range> ranges;
+    for (const auto & discovery_range : discovery_ranges_) {
+      struct bt_gatt_client_range range;
+      range.start = discovery_range.start;
+      range.end = discovery_range.end;
+      range.uuid.type = bt_uuid_t::BT_UUID_UNSPEC;
+
+      if (!discovery_range.uuid.empty() && bt_string_to_uuid(&range.uuid, discovery_range.uuid.c_str()) < 0) {
+        detach();
+        throw std::runtime_error("LEClient: Invalid service UUID: " + discovery_range.uuid);
+      }
+
+      ranges.push_back(range);
+    }
+
+    // Always pick up the GATT service, so that Service Changed keeps working
+    struct bt_gatt_client_range gatt_service{0x0001, 0xffff, {}};
+    bt_string_to_uuid(&gatt_service.uuid, GATT_UUID);
+    ranges.push_back(gatt_service);
+
+    gatt_ = bt_gatt_client_new_targeted(db_, att_, mtu_, ranges.data(), ranges.size());
+  }
+
+  if (!gatt_) {
+    detach();
+    JERONIBOT_LOG_ERROR("Failed to create GATT client\n");
+    return false;
+  }
+
+  bt_gatt_client_set_ready_handler(gatt_, ready_cb, this, nullptr);
+  bt_gatt_client_set_service_changed(gatt_, service_changed_cb, this, nullptr);
+
+  // bt_gatt_client formats its debug output whether or not it is wanted, so
+  // only hook it up when tracing
+  if (Logger::enabled(LogLevel::Trace)) {
+    bt_gatt_client_set_debug(gatt_, gatt_debug_cb, this, nullptr);
+  }
+
+  fd_ = fd;
+  return true;
+}
+
+void
+LEClient::detach()
 {
-  mainloop_quit();
+  // Closes the socket, too
   bt_gatt_client_unref(gatt_);
+  gatt_ = nullptr;
   bt_att_unref(att_);
-  input_thread_->join();
+  att_ = nullptr;
+}
+
+LEClient::~LEClient()
+{
+  stop();
+  detach();
+  gatt_db_unref(db_);
+
+  if (connecting_fd_ >= 0) {
+    close(connecting_fd_);
+  }
+
+  if (link_dd_ >= 0) {
+    hci_close_dev(link_dd_);
+  }
+
+  loop_.reset();
+}
+
+void
+LEClient::stop()
+{
+  if (input_thread_ && input_thread_->joinable()) {
+    // Queued behind anything already posted, and wakes the loop right away
+    post([this] {mainloop_quit(loop_.get());});
+    input_thread_->join();
+
+    // Commands that raced with the loop shutting down
+    std::lock_guard<std::recursive_mutex> lock(stopped_mutex_);
+    run_commands();
+  }
+}
+
+bool
+LEClient::in_mainloop() const
+{
+  return loop_running_.load(std::memory_order_acquire) &&
+         std::this_thread::get_id() == loop_thread_id_.load(std::memory_order_acquire);
+}
+
+bool
+LEClient::can_request() const
+{
+  return loop_running_.load(std::memory_order_acquire) && connected_.load(std::memory_order_acquire) && gatt_;
+}
+
+void
+LEClient::post(std::function<void()> work)
+{
+  if (in_mainloop()) {
+    work();
+    return;
+  }
+
+  // With no loop to run it, work runs on the posting thread, one thread at a
+  // time as bluez isn't thread-safe
+  if (!loop_running_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::recursive_mutex> lock(stopped_mutex_);
+    work();
+    return;
+  }
+
+  Command * command = new Command;
+  command->work = std::move(work);
+
+  bool first = commands_.push(command);
+
+  // The loop may have stopped, and had its last drain, between the check
+  // above and the push. The fence pairs with the one in process_input():
+  // either that drain saw the command or this sees the loop stopped, in
+  // which case the command is run here
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!loop_running_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::recursive_mutex> lock(stopped_mutex_);
+    run_commands();
+    return;
+  }
+
+  // Only the producer that finds the queue empty has to wake the loop; the
+  // others are picked up by the same drain
+  if (first) {
+    int err = mainloop_wakeup(loop_.get());
+    if (err < 0) {
+      JERONIBOT_LOG_ERROR("LEClient: Failed to wake up the mainloop: %s\n", strerror(-err));
+    }
+  }
+}
+
+void
+LEClient::run_commands()
+{
+  Command * command = commands_.take_all();
+  while (command) {
+    Command * next = jeronibot::util::MpscQueue<Command>::next(command);
+    command->work();
+    delete command;
+    command = next;
+  }
 }
 
 void
-LEClient::att_disconnect_cb(int err, void * /*user_data*/)
+LEClient::wakeup_cb(void * user_data)
 {
-  printf("Device disconnected: %s\n", strerror(err));
-  mainloop_quit();
+  LEClient * This = (LEClient *) user_data;
+
+  // The loop has already reset its eventfd, so a push landing after the
+  // drain wakes it again
+  This->run_commands();
+}
+
+void
+LEClient::att_disconnect_cb(int err, void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+
+  JERONIBOT_LOG_WARN("Device disconnected: %s\n", strerror(err));
+  This->connected_.store(false, std::memory_order_release);
+
+  if (!This->reconnect_policy_.enabled || (!This->connector_ && !This->has_address_)) {
+    mainloop_quit(This->loop_.get());
+    return;
+  }
+
+  // Dropped while still reconnecting; the outage goes on
+  if (!This->reconnecting_) {
+    This->reconnect_stats_.disconnects++;
+    This->disconnect_time_ = std::chrono::steady_clock::now();
+    This->reconnect_delay_ = 0ms;
+  }
+
+  // The old ATT transport and GATT client are dropped once their disconnect
+  // handlers have returned
+  This->schedule_reconnect();
+}
+
+void
+LEClient::schedule_reconnect()
+{
+  if (reconnect_pending_) {
+    return;
+  }
+
+  reconnecting_ = true;
+  reconnect_pending_ = true;
+
+  // The first attempt goes right away, then they back off
+  unsigned int delay_ms = std::max<unsigned int>(1, reconnect_delay_.count());
+  reconnect_delay_ = std::clamp(reconnect_delay_ * 2, reconnect_policy_.initial_delay, reconnect_policy_.max_delay);
+
+  if (reconnect_timeout_id_ < 0) {
+    reconnect_timeout_id_ = mainloop_add_timeout(loop_.get(), delay_ms, reconnect_timeout_cb, this, nullptr);
+    if (reconnect_timeout_id_ < 0) {
+      JERONIBOT_LOG_ERROR("LEClient: Failed to schedule reconnection\n");
+      mainloop_quit(loop_.get());
+    }
+  } else if (mainloop_modify_timeout(loop_.get(), reconnect_timeout_id_, delay_ms) < 0) {
+    JERONIBOT_LOG_ERROR("LEClient: Failed to schedule reconnection\n");
+    mainloop_quit(loop_.get());
+  }
+}
+
+int
+LEClient::open_connection()
+{
+  if (connector_) {
+    return connector_();
+  }
+
+  try {
+    l2_cap_socket_ = std::make_unique<L2CapSocket>(&src_addr_, &dst_addr_, dst_type_, sec_, true);
+  } catch (const std::runtime_error & e) {
+    JERONIBOT_LOG_WARN("%s\n", e.what());
+    return -1;
+  }
+
+  return l2_cap_socket_->get_handle();
+}
+
+void
+LEClient::reconnect_timeout_cb(int /*id*/, void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+
+  This->reconnect_pending_ = false;
+  This->detach();
+
+  This->reconnect_stats_.attempts++;
+  int fd = This->open_connection();
+  if (fd < 0) {
+    This->schedule_reconnect();
+    return;
+  }
+
+  // Connected sockets are writable right away; others once connect finishes
+  if (mainloop_add_fd(This->loop_.get(), fd, EPOLLOUT, connect_cb, This, nullptr) < 0) {
+    close(fd);
+    This->schedule_reconnect();
+    return;
+  }
+
+  This->connecting_fd_ = fd;
+}
+
+void
+LEClient::connect_cb(int fd, uint32_t events, void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+
+  mainloop_remove_fd(This->loop_.get(), fd);
+  This->connecting_fd_ = -1;
+
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+    err = errno;
+  }
+
+  if (err || (events & (EPOLLERR | EPOLLHUP))) {
+    JERONIBOT_LOG_WARN("LEClient: Reconnection failed: %s\n", strerror(err ? err : ECONNRESET));
+    close(fd);
+    This->schedule_reconnect();
+    return;
+  }
+
+  // bt_att expects a blocking socket, like the one the client started with
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0) {
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+  }
+
+  // ready_cb takes it from here
+  if (!This->attach(fd)) {
+    This->schedule_reconnect();
+  }
+}
+
+void
+LEClient::set_reconnect_policy(const ReconnectPolicy & policy, Connector connector)
+{
+  invoke([&] {
+      reconnect_policy_ = policy;
+      if (connector) {
+        connector_ = std::move(connector);
+      }
+    });
+}
+
+LEClient::ReconnectStats
+LEClient::get_reconnect_stats()
+{
+  return invoke([this] {return reconnect_stats_;});
 }
 
 void
@@ -133,16 +491,28 @@ LEClient::service_removed_cb(struct gatt_db_attribute * attr, void * user_data)
 {
 }
 
+void
+LEClient::gatt_debug_cb(const char * str, void * /*user_data*/)
+{
+  JERONIBOT_LOG_TRACE("%s\n", str);
+}
+
 void
 LEClient::print_uuid(const bt_uuid_t * uuid)
 {
   char uuid_str[MAX_LEN_UUID_STR];
+  JERONIBOT_LOG_INFO("%s\n", uuid_to_string(uuid, uuid_str));
+}
+
+const char *
+LEClient::uuid_to_string(const bt_uuid_t * uuid, char (&uuid_str)[MAX_LEN_UUID_STR])
+{
   bt_uuid_t uuid128;
 
   bt_uuid_to_uuid128(uuid, &uuid128);
   bt_uuid_to_string(&uuid128, uuid_str, sizeof(uuid_str));
 
-  printf("%s\n", uuid_str);
+  return uuid_str;
 }
 
 void
@@ -166,15 +536,17 @@ LEClient::print_included_data(struct gatt_db_attribute * attr, void * user_data)
   bt_uuid_t uuid;
   gatt_db_attribute_get_service_uuid(service, &uuid);
 
-  printf("\t  include - handle: 0x%04x, - start: 0x%04x, end: 0x%04x, uuid: ", handle, start, end);
-  LEClient::print_uuid(&uuid);
+  char uuid_str[MAX_LEN_UUID_STR];
+  JERONIBOT_LOG_INFO("\t  include - handle: 0x%04x, - start: 0x%04x, end: 0x%04x, uuid: %s\n", handle, start, end,
+    uuid_to_string(&uuid, uuid_str));
 }
 
 void
 LEClient::print_descriptor(struct gatt_db_attribute * attr, void * user_data)
 {
-  printf("\t\t  descr - handle: 0x%04x, uuid: ", gatt_db_attribute_get_handle(attr));
-  LEClient::print_uuid(gatt_db_attribute_get_type(attr));
+  char uuid_str[MAX_LEN_UUID_STR];
+  JERONIBOT_LOG_INFO("\t\t  descr - handle: 0x%04x, uuid: %s\n", gatt_db_attribute_get_handle(attr),
+    uuid_to_string(gatt_db_attribute_get_type(attr), uuid_str));
 }
 
 void
@@ -190,8 +562,9 @@ LEClient::print_characteristic(struct gatt_db_attribute * attr, void * user_data
     return;
   }
 
-  printf("\t  charac - start: 0x%04x, value: 0x%04x, " "props: 0x%02x, uuid: ", handle, value_handle, properties);
-  LEClient::print_uuid(&uuid);
+  char uuid_str[MAX_LEN_UUID_STR];
+  JERONIBOT_LOG_INFO("\t  charac - start: 0x%04x, value: 0x%04x, " "props: 0x%02x, uuid: %s\n", handle, value_handle,
+    properties, uuid_to_string(&uuid, uuid_str));
 
   gatt_db_service_foreach_desc(attr, print_descriptor, nullptr);
 }
@@ -210,13 +583,14 @@ LEClient::print_service(struct gatt_db_attribute * attr, void * user_data)
     return;
   }
 
-  printf("Service - start: 0x%04x, end: 0x%04x, type: %s, uuid: ", start, end, primary ? "primary" : "secondary");
-  LEClient::print_uuid(&uuid);
+  char uuid_str[MAX_LEN_UUID_STR];
+  JERONIBOT_LOG_INFO("Service - start: 0x%04x, end: 0x%04x, type: %s, uuid: %s\n", start, end,
+    primary ? "primary" : "secondary", uuid_to_string(&uuid, uuid_str));
 
   gatt_db_service_foreach_incl(attr, print_included_data, This);
   gatt_db_service_foreach_char(attr, print_characteristic, nullptr);
 
-  printf("\n");
+  JERONIBOT_LOG_INFO("\n");
 }
 
 void
@@ -224,20 +598,53 @@ LEClient::ready_cb(bool success, uint8_t att_ecode, void * user_data)
 {
   LEClient * This = (LEClient *) user_data;
 
-// TODO: sucess == false on disconnect?
+  if (This->reconnecting_) {
+    if (!success) {
+      // Try again on a fresh connection
+      JERONIBOT_LOG_WARN("GATT client failed to come back - error code: 0x%02x\n", att_ecode);
+      This->schedule_reconnect();
+      return;
+    }
+
+    This->reconnecting_ = false;
+    This->reconnect_delay_ = 0ms;
+    This->connected_.store(true, std::memory_order_release);
+
+    This->on_reconnected();
+
+    auto & stats = This->reconnect_stats_;
+    stats.reconnects++;
+    stats.last_outage = std::chrono::steady_clock::now() - This->disconnect_time_;
+    stats.max_outage = std::max(stats.max_outage, stats.last_outage);
+
+    JERONIBOT_LOG_INFO("LEClient: Reconnected after %.1f ms\n", std::chrono::duration<double, std::milli>(stats.last_outage).count());
+    return;
+  }
 
   if (!success) {
-    printf("GATT discovery procedures failed - error code: 0x%02x\n", att_ecode);
+    JERONIBOT_LOG_ERROR("GATT discovery procedures failed - error code: 0x%02x\n", att_ecode);
+
+    // Don't trust the cache on the next attempt either
+    if (This->cache_loaded_) {
+      GattCache::remove(This->cache_path_);
+    }
     return;
   }
 
+  if (!This->cache_path_.empty() && !This->cache_loaded_) {
+    if (!GattCache::save(This->db_, This->cache_path_)) {
+      JERONIBOT_LOG_WARN("Failed to write GATT cache: %s\n", This->cache_path_.c_str());
+    }
+  }
+
+  This->connected_.store(true, std::memory_order_release);
+
   {
     std::lock_guard<std::mutex> lk(This->mutex_);
     This->ready_ = true;
   }
 
   This->cv_.notify_all();
-  This->ready_ = true;
 }
 
 void
@@ -245,8 +652,13 @@ LEClient::service_changed_cb(uint16_t start_handle, uint16_t end_handle, void *
 {
   LEClient * This = (LEClient *) user_data;
 
-  printf("Service Changed handled - start: 0x%04x end: 0x%04x\n", start_handle, end_handle);
+  JERONIBOT_LOG_INFO("Service Changed handled - start: 0x%04x end: 0x%04x\n", start_handle, end_handle);
   gatt_db_foreach_service_in_range(This->db_, nullptr, print_service, This, start_handle, end_handle);
+
+  // The changed range has been rediscovered; bring the cache up to date
+  if (!This->cache_path_.empty() && !GattCache::save(This->db_, This->cache_path_)) {
+    GattCache::remove(This->cache_path_);
+  }
 }
 
 void
@@ -254,61 +666,109 @@ LEClient::read_multiple_cb(
   bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * /*user_data*/)
 {
   if (!success) {
-    printf("\nRead multiple request failed: 0x%02x\n", att_ecode);
+    JERONIBOT_LOG_ERROR("Read multiple request failed: 0x%02x\n", att_ecode);
     return;
   }
 
-  printf("\nRead multiple value (%u bytes):", length);
-  for (int i = 0; i < length; i++) {
-    printf("%02x ", value[i]);
-  }
-  printf("\n");
+  JERONIBOT_LOG_INFO("Read multiple value (%u bytes): %s\n", length, LogBytes{value, length});
 }
 
 void
 LEClient::read_multiple(uint16_t * handles, uint8_t num_handles)
 {
-  if (!bt_gatt_client_read_multiple(gatt_, handles, num_handles, read_multiple_cb, nullptr, nullptr)) {
-    printf("Failed to initiate read multiple procedure\n");
+  post([this, handles = std::vector<uint16_t>(handles, handles + num_handles)]() mutable {
+      if (!bt_gatt_client_read_multiple(gatt_, handles.data(), handles.size(), read_multiple_cb, nullptr, nullptr)) {
+        JERONIBOT_LOG_ERROR("Failed to initiate read multiple procedure\n");
+      }
+    });
+}
+
+bool
+LEClient::read_multiple(const std::vector<uint16_t> & handles, const ResponseDecoder & decode)
+{
+  if (handles.empty() || handles.size() > UINT8_MAX) {
+    JERONIBOT_LOG_ERROR("Invalid number of handles to read: %zu\n", handles.size());
+    return false;
   }
+
+  BatchRead read{decode, {}};
+  std::future<bool> done = read.done.get_future();
+
+  // Read Multiple takes two handles at least. As with discovery, nothing is
+  // started that couldn't complete
+  bool started = invoke([&] {
+      if (!can_request()) {
+        return false;
+      }
+
+      if (handles.size() == 1) {
+        return bt_gatt_client_read_value(gatt_, handles[0], read_batch_cb, &read, read_batch_destroy_cb) != 0;
+      }
+
+      return bt_gatt_client_read_multiple(gatt_, const_cast<uint16_t *>(handles.data()), handles.size(),
+               read_batch_cb, &read, read_batch_destroy_cb) != 0;
+    });
+
+  if (!started) {
+    JERONIBOT_LOG_ERROR("Failed to initiate read multiple procedure\n");
+    return false;
+  }
+
+  return done.get();
 }
 
 void
-LEClient::read_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * /*user_data*/)
+LEClient::read_batch_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * user_data)
 {
+  BatchRead * read = (BatchRead *) user_data;
+
   if (!success) {
-    printf("Read request failed: %s (0x%02x)\n", bluetooth::utils::to_string(att_ecode), att_ecode);
+    JERONIBOT_LOG_ERROR("Read multiple request failed: %s (0x%02x)\n", bluetooth::utils::to_string(att_ecode), att_ecode);
     return;
   }
 
-  printf("\nRead value");
-  if (length == 0) {
-    printf(": 0 bytes\n");
-    return;
+  read->decoded = read->decode(std::span<const uint8_t>(value, length));
+  if (!read->decoded) {
+    JERONIBOT_LOG_ERROR("Read multiple response too short (%u bytes)\n", length);
   }
+}
 
-  printf(" (%u bytes): ", length);
-  for (int i = 0; i < length; i++) {
-    printf("%02x ", value[i]);
+void
+LEClient::read_batch_destroy_cb(void * user_data)
+{
+  BatchRead * read = (BatchRead *) user_data;
+  read->done.set_value(read->decoded);
+}
+
+void
+LEClient::read_cb(bool success, uint8_t att_ecode, const uint8_t * value, uint16_t length, void * /*user_data*/)
+{
+  if (!success) {
+    JERONIBOT_LOG_ERROR("Read request failed: %s (0x%02x)\n", bluetooth::utils::to_string(att_ecode), att_ecode);
+    return;
   }
 
-  printf("\n");
+  JERONIBOT_LOG_INFO("Read value (%u bytes): %s\n", length, LogBytes{value, length});
 }
 
 void
 LEClient::read_value(uint16_t handle)
 {
-  if (!bt_gatt_client_read_value(gatt_, handle, read_cb, nullptr, nullptr)) {
-    printf("Failed to initiate read value\n");
-  }
+  post([this, handle] {
+      if (!bt_gatt_client_read_value(gatt_, handle, read_cb, nullptr, nullptr)) {
+        JERONIBOT_LOG_ERROR("Failed to initiate read value\n");
+      }
+    });
 }
 
 void
 LEClient::read_long_value(uint16_t handle, uint16_t offset)
 {
-  if (!bt_gatt_client_read_long_value(gatt_, handle, offset, read_cb, nullptr, nullptr)) {
-    printf("Failed to initiate read long value\n");
-  }
+  post([this, handle, offset] {
+      if (!bt_gatt_client_read_long_value(gatt_, handle, offset, read_cb, nullptr, nullptr)) {
+        JERONIBOT_LOG_ERROR("Failed to initiate read long value\n");
+      }
+    });
 }
 
 void
@@ -318,7 +778,7 @@ LEClient::write_long_cb(bool success, bool reliable_error, uint8_t att_ecode, vo
   if (success) {
     promise->set_value(0);
   } else if (reliable_error) {
-    printf("Reliable write not verified\n");
+    JERONIBOT_LOG_ERROR("Reliable write not verified\n");
   } else {
     promise->set_value(att_ecode);
   }
@@ -328,36 +788,43 @@ void
 LEClient::write_long_value(bool reliable_writes, uint16_t handle, uint16_t offset, uint8_t * value, int length)
 {
   std::promise<int> promise;
-  if (!bt_gatt_client_write_long_value(gatt_, reliable_writes, handle,
-      offset, value, length, write_long_cb, (void *) &promise, nullptr))
+
+  // The value is copied by bt_gatt_client before invoke() returns
+  if (!invoke([&] {
+      return bt_gatt_client_write_long_value(gatt_, reliable_writes, handle,
+        offset, value, length, write_long_cb, (void *) &promise, nullptr);
+    }))
   {
-    printf("Failed to initiate bt_gatt_client_write_long_value\n");
+    JERONIBOT_LOG_ERROR("Failed to initiate bt_gatt_client_write_long_value\n");
+    return;
   }
 
   std::future<int> future = promise.get_future();
   int rc = future.get();
   if (rc != 0) {
-    printf("bt_gatt_client_write_long_value failed: %s (0x%02x)\n", bluetooth::utils::to_string(rc), rc);
+    JERONIBOT_LOG_ERROR("bt_gatt_client_write_long_value failed: %s (0x%02x)\n", bluetooth::utils::to_string(rc), rc);
   }
 }
 
 void
 LEClient::write_prepare(unsigned int id, uint16_t handle, uint16_t offset, uint8_t * value, unsigned int length)
 {
-  if (reliable_session_id_ != id) {
-    printf("Session id != Ongoing session id (%u!=%u)\n", id, reliable_session_id_);
-    return;
-  }
-
-  reliable_session_id_ = bt_gatt_client_prepare_write(gatt_, id, handle, offset, value, length,
-      // write_long_cb, nullptr, nullptr);
-      nullptr, nullptr, nullptr);
-
-  if (!reliable_session_id_) {
-    printf("Failed to proceed prepare write\n");
-  }
-
-  printf("Prepare write success.\nSession id: %d to be used on next write\n", reliable_session_id_);
+  invoke([&] {
+      if (reliable_session_id_ != id) {
+        JERONIBOT_LOG_ERROR("Session id != Ongoing session id (%u!=%u)\n", id, reliable_session_id_);
+        return;
+      }
+
+      reliable_session_id_ = bt_gatt_client_prepare_write(gatt_, id, handle, offset, value, length,
+          // write_long_cb, nullptr, nullptr);
+          nullptr, nullptr, nullptr);
+
+      if (!reliable_session_id_) {
+        JERONIBOT_LOG_ERROR("Failed to proceed prepare write\n");
+      }
+
+      JERONIBOT_LOG_INFO("Prepare write success.\nSession id: %d to be used on next write\n", reliable_session_id_);
+    });
 }
 
 void
@@ -372,20 +839,23 @@ LEClient::write_execute(unsigned int session_id, bool execute)
 {
   if (execute) {
     std::promise<int> promise;
-    if (!bt_gatt_client_write_execute(gatt_, session_id, write_cb, (void *) &promise, nullptr)) {
-      printf("Failed to proceed write execute\n");
+    if (!invoke([&] {return bt_gatt_client_write_execute(gatt_, session_id, write_cb, (void *) &promise, nullptr);})) {
+      JERONIBOT_LOG_ERROR("Failed to proceed write execute\n");
+    } else {
+      std::future<int> future = promise.get_future();
+      int rc = future.get();
+      if (rc != 0) {
+        JERONIBOT_LOG_ERROR("Write failed: %s (0x%02x)\n", bluetooth::utils::to_string(rc), rc);
+      }
     }
 
-    std::future<int> future = promise.get_future();
-    int rc = future.get();
-    if (rc != 0) {
-      printf("Write failed: %s (0x%02x)\n", bluetooth::utils::to_string(rc), rc);
-    }
+    post([this] {reliable_session_id_ = 0;});
   } else {
-    bt_gatt_client_cancel(gatt_, session_id);
+    post([this, session_id] {
+        bt_gatt_client_cancel(gatt_, session_id);
+        reliable_session_id_ = 0;
+      });
   }
-
-  reliable_session_id_ = 0;
 }
 
 void
@@ -393,112 +863,714 @@ LEClient::notify_cb(
   uint16_t value_handle, const uint8_t * value,
   uint16_t length, void * user_data)
 {
-  printf("Handle Value Not/Ind: 0x%04x - ", value_handle);
+  LEClient * This = (LEClient *) user_data;
+  This->on_notify(value_handle, value, length);
+}
+
+void
+LEClient::on_notify(uint16_t value_handle, const uint8_t * value, uint16_t length)
+{
+  JERONIBOT_LOG_DEBUG("Handle Value Not/Ind: 0x%04x - (%u bytes): %s\n", value_handle, length, LogBytes{value, length});
+}
 
-  if (length == 0) {
-    printf("(0 bytes)\n");
+void
+LEClient::register_notify_cb(uint16_t att_ecode, void * /*user_data*/)
+{
+  if (att_ecode) {
+    JERONIBOT_LOG_ERROR("Failed to register notify handler - error code: 0x%02x\n", att_ecode);
     return;
   }
 
-  printf("(%u bytes): ", length);
+  JERONIBOT_LOG_DEBUG("Registered notify handler\n");
+}
+
+unsigned int
+LEClient::register_notify(uint16_t value_handle)
+{
+  unsigned int id = invoke([this, value_handle] {
+      return bt_gatt_client_register_notify(gatt_, value_handle, register_notify_cb, notify_cb, this, nullptr);
+    });
 
-  for (int i = 0; i < length; i++) {
-    printf("%02x ", value[i]);
+  if (!id) {
+    JERONIBOT_LOG_ERROR("Failed to register notify handler\n");
   }
 
-  printf("\n");
+  return id;
 }
 
 void
-LEClient::register_notify_cb(uint16_t att_ecode, void * /*user_data*/)
+LEClient::subscriber_notify_cb(uint16_t value_handle, const uint8_t * value, uint16_t length, void * user_data)
 {
-  if (att_ecode) {
-    printf("Failed to register notify handler - error code: 0x%02x\n", att_ecode);
-    return;
-  }
-
-  printf("Registered notify handler!");
+  NotifyCallback * callback = (NotifyCallback *) user_data;
+  (*callback)(value_handle, std::span<const uint8_t>(value, length));
 }
 
-// TODO(mjeronimo): return unsigned int?
 void
-LEClient::register_notify(uint16_t value_handle)
+LEClient::subscriber_destroy_cb(void * user_data)
 {
-  unsigned int id = bt_gatt_client_register_notify(
-    gatt_, value_handle, register_notify_cb, notify_cb, nullptr, nullptr);
+  delete (NotifyCallback *) user_data;
+}
+
+unsigned int
+LEClient::register_notify(uint16_t value_handle, NotifyCallback callback)
+{
+  // bt_gatt_client owns it once registered and deletes it along with the
+  // registration
+  NotifyCallback * subscriber = new NotifyCallback(std::move(callback));
+
+  unsigned int id = invoke([this, value_handle, subscriber] {
+      return bt_gatt_client_register_notify(gatt_, value_handle, register_notify_cb, subscriber_notify_cb, subscriber,
+          subscriber_destroy_cb);
+    });
 
   if (!id) {
-    printf("Failed to register notify handler\n");
-    return;
+    delete subscriber;
+    JERONIBOT_LOG_ERROR("Failed to register notify handler\n");
   }
+
+  return id;
 }
 
 void
 LEClient::unregister_notify(unsigned int id)
 {
-  if (!bt_gatt_client_unregister_notify(gatt_, id)) {
-    printf("Failed to unregister notify handler with id: %u\n", id);
-  }
+  post([this, id] {
+      if (!bt_gatt_client_unregister_notify(gatt_, id)) {
+        JERONIBOT_LOG_ERROR("Failed to unregister notify handler with id: %u\n", id);
+      }
+    });
 }
 
 void
 LEClient::set_security(int level)
 {
   if (level < 1 || level > 3) {
-    printf("Invalid level: %d\n", level);
+    JERONIBOT_LOG_ERROR("Invalid level: %d\n", level);
     return;
   }
 
-  if (!bt_gatt_client_set_security(gatt_, level)) {
-    printf("Could not set security level\n");
-  }
+  post([this, level] {
+      if (!bt_gatt_client_set_security(gatt_, level)) {
+        JERONIBOT_LOG_ERROR("Could not set security level\n");
+      }
+    });
 }
 
 int
 LEClient::get_security()
 {
-  return bt_gatt_client_get_security(gatt_);
+  return invoke([this] {return bt_gatt_client_get_security(gatt_);});
 }
 
 bool
-LEClient::local_counter(uint32_t * sign_cnt, void * /*user_data*/)
+LEClient::local_counter(uint32_t * sign_cnt, void * user_data)
 {
-  static uint32_t cnt = 0;
-  *sign_cnt = cnt++;
+  LEClient * This = (LEClient *) user_data;
+
+  // Called as the write queue gets signed, in the order the commands go out
+  *sign_cnt = This->sign_counter_++;
   return true;
 }
 
 void
 LEClient::set_sign_key(uint8_t key[16])
 {
-  bt_att_set_local_key(att_, key, local_counter, this);
+  std::array<uint8_t, 16> local_key;
+  std::copy(key, key + local_key.size(), local_key.begin());
+
+  // A new key (or the same one again) carries on from the current counter
+  post([this, local_key]() mutable {
+      sign_key_ = local_key;
+      if (att_ && !bt_att_set_local_key(att_, sign_key_->data(), local_counter, this)) {
+        JERONIBOT_LOG_ERROR("Failed to set the signing key\n");
+      }
+    });
 }
 
 void
-LEClient::write_value(uint16_t handle, uint8_t * value, int length, bool without_response, bool signed_write)
+LEClient::set_sign_key(uint8_t key[16], uint32_t sign_counter)
+{
+  std::array<uint8_t, 16> local_key;
+  std::copy(key, key + local_key.size(), local_key.begin());
+
+  post([this, local_key, sign_counter]() mutable {
+      sign_key_ = local_key;
+      sign_counter_ = sign_counter;
+      if (att_ && !bt_att_set_local_key(att_, sign_key_->data(), local_counter, this)) {
+        JERONIBOT_LOG_ERROR("Failed to set the signing key\n");
+      }
+    });
+}
+
+uint32_t
+LEClient::get_sign_counter()
+{
+  return invoke([this] {return sign_counter_;});
+}
+
+void
+LEClient::write_value(uint16_t handle, const uint8_t * value, int length, bool without_response, bool signed_write)
 {
   if (without_response) {
-    if (!bt_gatt_client_write_without_response(gatt_, handle, signed_write, value, length)) {
-      printf("Failed to initiate write-without-response procedure\n");
+    writes_submitted_.fetch_add(1, std::memory_order_relaxed);
+
+    // Fire and forget: on the mainloop thread the PDU is queued directly,
+    // otherwise the value is copied and queued along with the command
+    if (in_mainloop()) {
+      write_depth_.fetch_add(1, std::memory_order_relaxed);
+      send_write_command(handle, signed_write, value, length);
+      return;
     }
+
+    // Take a slot, waiting for one if the policy says so
+    uint32_t max_queued = write_max_queued_.load(std::memory_order_relaxed);
+    bool block = max_queued && write_policy_.load(std::memory_order_relaxed) == WritePolicy::Block;
+    uint32_t depth = write_depth_.load(std::memory_order_relaxed);
+    do {
+      while (block && depth >= max_queued) {
+        write_depth_.wait(depth, std::memory_order_relaxed);
+        depth = write_depth_.load(std::memory_order_relaxed);
+      }
+    } while (!write_depth_.compare_exchange_weak(depth, depth + 1, std::memory_order_relaxed));
+
+    post([this, handle, signed_write, bytes = std::vector<uint8_t>(value, value + length)] {
+        send_write_command(handle, signed_write, bytes.data(), bytes.size());
+      });
   } else {
     std::promise<int> promise;
-    if (!bt_gatt_client_write_value(gatt_, handle, value, length, write_cb, (void *) &promise, nullptr)) {
-      printf("Failed to initiate write procedure\n");
+    if (!invoke([&] {return bt_gatt_client_write_value(gatt_, handle, value, length, write_cb, (void *) &promise, nullptr);})) {
+      JERONIBOT_LOG_ERROR("Failed to initiate write procedure\n");
+      return;
     }
 
     std::future<int> future = promise.get_future();
     int rc = future.get();
     if (rc != 0) {
-      printf("write_value failed\n");
+      JERONIBOT_LOG_ERROR("write_value failed\n");
+    }
+  }
+}
+
+void
+LEClient::write_async_cb(bool success, uint8_t att_ecode, void * /*user_data*/)
+{
+  if (!success) {
+    JERONIBOT_LOG_ERROR("Write request failed: %s (0x%02x)\n", bluetooth::utils::to_string(att_ecode), att_ecode);
+  }
+}
+
+void
+LEClient::write_value_async(uint16_t handle, const uint8_t * value, int length)
+{
+  post([this, handle, bytes = std::vector<uint8_t>(value, value + length)] {
+      if (!bt_gatt_client_write_value(gatt_, handle, bytes.data(), bytes.size(), write_async_cb, nullptr, nullptr)) {
+        JERONIBOT_LOG_ERROR("Failed to initiate write procedure\n");
+      }
+    });
+}
+
+void
+LEClient::set_write_policy(WritePolicy policy, std::size_t max_queued)
+{
+  write_policy_.store(policy, std::memory_order_relaxed);
+  write_max_queued_.store(max_queued, std::memory_order_relaxed);
+
+  // Let blocked writers re-check against the new limit
+  write_depth_.notify_all();
+}
+
+LEClient::WriteStats
+LEClient::get_write_stats() const
+{
+  WriteStats stats;
+  stats.submitted = writes_submitted_.load(std::memory_order_relaxed);
+  stats.dropped = writes_dropped_.load(std::memory_order_relaxed);
+  stats.replaced = writes_replaced_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+LEClient::LatencyStats
+LEClient::get_latency_stats()
+{
+  LatencyStats stats;
+
+  // The histograms are updated on the mainloop thread, so copy them there
+  invoke([this, &stats] {
+      bt_att_get_latency(att_, BT_ATT_LATENCY_REQ_QUEUE, &stats.request_queue);
+      bt_att_get_latency(att_, BT_ATT_LATENCY_CMD_QUEUE, &stats.command_queue);
+      bt_att_get_latency(att_, BT_ATT_LATENCY_NOTIFY_INTERVAL, &stats.notify_interval);
+
+      struct bt_att_histogram round_trip;
+      for (unsigned int opcode = 0; opcode <= UINT8_MAX; opcode++) {
+        if (bt_att_get_rtt(att_, opcode, &round_trip)) {
+          stats.round_trip.emplace(opcode, round_trip);
+        }
+      }
+    });
+
+  return stats;
+}
+
+void
+LEClient::reset_latency_stats()
+{
+  post([this] {bt_att_reset_latency(att_);});
+}
+
+bool
+LEClient::update_connection(const ConnectionParameters & parameters)
+{
+  if (!has_address_) {
+    JERONIBOT_LOG_WARN("Connection parameters can only be updated on Bluetooth connections\n");
+    return false;
+  }
+
+  // Ranges from the Core spec, Vol 6, Part B, 4.5.2; the supervision timeout
+  // has to outlast two of the longest gaps the peripheral may leave
+  const auto & p = parameters;
+  if (p.min_interval < 0x0006 || p.max_interval > 0x0c80 || p.min_interval > p.max_interval ||
+    p.latency > 0x01f3 || p.supervision_timeout < 0x000a || p.supervision_timeout > 0x0c80 ||
+    p.supervision_timeout * 4u <= (1u + p.latency) * p.max_interval)
+  {
+    JERONIBOT_LOG_ERROR("Invalid connection parameters\n");
+    return false;
+  }
+
+  // The socket is replaced on the mainloop thread when reconnecting
+  int handle = -1;
+  int dev_id = -1;
+  invoke([&] {
+      if (connected_.load(std::memory_order_relaxed)) {
+        handle = l2_cap_socket_->get_connection_handle();
+        dev_id = l2_cap_socket_->get_device_id();
+      }
+    });
+
+  if (handle < 0 || dev_id < 0) {
+    JERONIBOT_LOG_ERROR("Failed to look up the HCI connection: %s\n", strerror(errno));
+    return false;
+  }
+
+  int dd = hci_open_dev(dev_id);
+  if (dd < 0) {
+    JERONIBOT_LOG_ERROR("Failed to open hci%d: %s\n", dev_id, strerror(errno));
+    return false;
+  }
+
+  int rc = hci_le_conn_update(dd, handle, p.min_interval, p.max_interval, p.latency, p.supervision_timeout,
+      connection_update_timeout_ms);
+  int err = errno;
+  hci_close_dev(dd);
+
+  if (rc < 0) {
+    JERONIBOT_LOG_ERROR("Connection parameter update failed: %s\n", strerror(err));
+    return false;
+  }
+
+  // The controller may settle anywhere in the range; assume the busiest
+  adapter_lease_.set_interval(p.min_interval);
+  return true;
+}
+
+bool
+LEClient::start_link_monitor()
+{
+  return start_link_monitor(LinkMonitorPolicy());
+}
+
+bool
+LEClient::start_link_monitor(const LinkMonitorPolicy & policy)
+{
+  if (!has_address_) {
+    JERONIBOT_LOG_WARN("The link can only be monitored on Bluetooth connections\n");
+    return false;
+  }
+
+  if (policy.period.count() <= 0 || policy.smoothing <= 0.0f || policy.smoothing > 1.0f ||
+    policy.rssi_strong <= policy.rssi_weak)
+  {
+    JERONIBOT_LOG_ERROR("Invalid link monitor policy\n");
+    return false;
+  }
+
+  // Like the drive pacer's, the timeout is created once and then re-armed;
+  // the first sample is taken right away
+  return invoke([this, &policy] {
+      link_policy_ = policy;
+      link_monitoring_ = true;
+
+      if (link_timeout_id_ < 0) {
+        link_timeout_id_ = mainloop_add_timeout(loop_.get(), 1, link_sample_cb, this, nullptr);
+        link_monitoring_ = link_timeout_id_ >= 0;
+      } else {
+        link_monitoring_ = mainloop_modify_timeout(loop_.get(), link_timeout_id_, 1) >= 0;
+      }
+
+      return link_monitoring_;
+    });
+}
+
+void
+LEClient::stop_link_monitor()
+{
+  // The timeout lapses on its next expiry
+  invoke([this] {
+      link_monitoring_ = false;
+      close_link_monitor();
+    });
+}
+
+LEClient::LinkQuality
+LEClient::get_link_quality() const
+{
+  std::lock_guard<std::mutex> lock(link_mutex_);
+  return link_quality_;
+}
+
+bool
+LEClient::open_link_monitor(int dev_id)
+{
+  close_link_monitor();
+
+  int dd = hci_open_dev(dev_id);
+  if (dd < 0) {
+    JERONIBOT_LOG_ERROR("Failed to open hci%d: %s\n", dev_id, strerror(errno));
+    return false;
+  }
+
+  // Only command completions; the results are matched up by opcode and
+  // connection handle, as other sockets' commands complete here too
+  struct hci_filter filter;
+  hci_filter_clear(&filter);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+  hci_filter_set_event(EVT_CMD_COMPLETE, &filter);
+
+  int flags = fcntl(dd, F_GETFL);
+  if (setsockopt(dd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0 || flags < 0 ||
+    fcntl(dd, F_SETFL, flags | O_NONBLOCK) < 0 || mainloop_add_fd(loop_.get(), dd, EPOLLIN, link_event_cb, this, nullptr) < 0)
+  {
+    JERONIBOT_LOG_ERROR("Failed to set up the link monitor on hci%d\n", dev_id);
+    hci_close_dev(dd);
+    return false;
+  }
+
+  link_dd_ = dd;
+  link_dev_id_ = dev_id;
+  return true;
+}
+
+void
+LEClient::close_link_monitor()
+{
+  if (link_dd_ < 0) {
+    return;
+  }
+
+  mainloop_remove_fd(loop_.get(), link_dd_);
+  hci_close_dev(link_dd_);
+  link_dd_ = -1;
+  link_dev_id_ = -1;
+  link_pending_ = 0;
+}
+
+void
+LEClient::link_sample_cb(int id, void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+
+  if (!This->link_monitoring_) {
+    return;
+  }
+
+  // Nothing to sample while the link is down; the adapter may be another
+  // one once it is back
+  int handle = -1;
+  int dev_id = -1;
+  if (This->connected_.load(std::memory_order_relaxed) && This->l2_cap_socket_) {
+    handle = This->l2_cap_socket_->get_connection_handle();
+    dev_id = This->l2_cap_socket_->get_device_id();
+  }
+
+  if (handle >= 0 && dev_id >= 0 && (dev_id == This->link_dev_id_ || This->open_link_monitor(dev_id))) {
+    // Don't pile commands up behind a slow controller, but don't let one
+    // that never answers stop the monitor either
+    if (!This->link_pending_ || ++This->link_skipped_ >= 4) {
+      This->link_handle_ = handle;
+      This->link_pending_ = 0;
+      This->link_skipped_ = 0;
+
+      uint16_t hci_handle = htobs(handle);
+      read_transmit_power_level_cp tx_power_cp{hci_handle, 0x00};
+
+      // RSSI goes last, as its result is what completes a sample
+      if (hci_send_cmd(This->link_dd_, OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY, sizeof(hci_handle), &hci_handle) == 0) {
+        This->link_pending_++;
+      }
+      if (hci_send_cmd(This->link_dd_, OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL,
+        READ_TRANSMIT_POWER_LEVEL_CP_SIZE, &tx_power_cp) == 0)
+      {
+        This->link_pending_++;
+      }
+      if (hci_send_cmd(This->link_dd_, OGF_STATUS_PARAM, OCF_READ_RSSI, sizeof(hci_handle), &hci_handle) == 0) {
+        This->link_pending_++;
+      }
     }
   }
+
+  mainloop_modify_timeout(This->loop_.get(), id, This->link_policy_.period.count());
+}
+
+void
+LEClient::link_event_cb(int fd, uint32_t events, void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    JERONIBOT_LOG_WARN("LEClient: Lost the link monitor's HCI socket\n");
+    This->close_link_monitor();
+    return;
+  }
+
+  uint8_t buffer[HCI_MAX_EVENT_SIZE];
+  while (true) {
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        JERONIBOT_LOG_WARN("LEClient: Failed to read from hci%d: %s\n", This->link_dev_id_, strerror(errno));
+        This->close_link_monitor();
+      }
+      return;
+    }
+
+    This->handle_link_event(buffer, length);
+  }
+}
+
+void
+LEClient::handle_link_event(const uint8_t * event, std::size_t length)
+{
+  // [HCI_EVENT_PKT][hci_event_hdr][evt_cmd_complete] and then the command's
+  // return parameters, which for all three start with status and handle
+  const std::size_t header = 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_COMPLETE_SIZE;
+  if (length < header + READ_RSSI_RP_SIZE || event[0] != HCI_EVENT_PKT) {
+    return;
+  }
+
+  const evt_cmd_complete * complete = reinterpret_cast<const evt_cmd_complete *>(event + 1 + HCI_EVENT_HDR_SIZE);
+  const uint8_t * rp = event + header;
+
+  uint16_t handle;
+  memcpy(&handle, rp + 1, sizeof(handle));
+  if (btohs(handle) != link_handle_) {
+    return;
+  }
+
+  uint16_t opcode = btohs(complete->opcode);
+  if (opcode != cmd_opcode_pack(OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY) &&
+    opcode != cmd_opcode_pack(OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL) &&
+    opcode != cmd_opcode_pack(OGF_STATUS_PARAM, OCF_READ_RSSI))
+  {
+    return;
+  }
+
+  if (link_pending_) {
+    link_pending_--;
+  }
+
+  uint8_t status = rp[0];
+  uint8_t value = rp[3];
+
+  if (status) {
+    return;
+  }
+
+  if (opcode == cmd_opcode_pack(OGF_STATUS_PARAM, OCF_READ_LINK_QUALITY)) {
+    std::lock_guard<std::mutex> lock(link_mutex_);
+    link_quality_.link_quality = value;
+    return;
+  }
+
+  if (opcode == cmd_opcode_pack(OGF_HOST_CTL, OCF_READ_TRANSMIT_POWER_LEVEL)) {
+    std::lock_guard<std::mutex> lock(link_mutex_);
+    link_quality_.tx_power = static_cast<int8_t>(value);
+    return;
+  }
+
+  // Only this thread writes link_quality_, so it reads it without the lock
+  LinkQuality quality = link_quality_;
+  quality.rssi = static_cast<int8_t>(value);
+
+  const LinkMonitorPolicy & p = link_policy_;
+  float score = std::clamp(float(quality.rssi - p.rssi_weak) / float(p.rssi_strong - p.rssi_weak), 0.0f, 1.0f);
+  if (quality.link_quality) {
+    score = std::min(score, quality.link_quality / 255.0f);
+  }
+
+  quality.score = quality.samples ? quality.score + p.smoothing * (score - quality.score) : score;
+  quality.samples++;
+
+  {
+    std::lock_guard<std::mutex> lock(link_mutex_);
+    link_quality_ = quality;
+  }
+
+  on_link_quality(quality);
+}
+
+void
+LEClient::send_write_command(uint16_t handle, bool signed_write, const uint8_t * value, uint16_t length)
+{
+  // Nothing to queue the command on until the link is back
+  if (!connected_.load(std::memory_order_relaxed)) {
+    writes_dropped_.fetch_add(1, std::memory_order_relaxed);
+    release_write_slot();
+    return;
+  }
+
+  std::array<uint8_t, BT_ATT_MAX_LE_MTU> pdu;
+  if (length > pdu.size() - sizeof(handle)) {
+    JERONIBOT_LOG_ERROR("Failed to initiate write-without-response procedure\n");
+    release_write_slot();
+    return;
+  }
+
+  pdu[0] = handle & 0xff;
+  pdu[1] = handle >> 8;
+  std::copy(value, value + length, pdu.begin() + sizeof(handle));
+  uint16_t pdu_length = sizeof(handle) + length;
+
+  WritePolicy policy = write_policy_.load(std::memory_order_relaxed);
+  uint32_t max_queued = write_max_queued_.load(std::memory_order_relaxed);
+
+  // The newest command for this handle hasn't gone out yet; overwrite it
+  if (policy == WritePolicy::ReplaceSameHandle) {
+    for (auto it = write_commands_.rbegin(); it != write_commands_.rend(); ++it) {
+      if (it->handle != handle) {
+        continue;
+      }
+
+      if (bt_att_replace(att_, it->id, pdu.data(), pdu_length)) {
+        writes_replaced_.fetch_add(1, std::memory_order_relaxed);
+        release_write_slot();
+        return;
+      }
+      break;
+    }
+  }
+
+  // Make room by dropping the oldest; write_command_done_cb retires it
+  if (policy != WritePolicy::Block && max_queued) {
+    while (write_commands_.size() >= max_queued) {
+      // Cancelling runs write_command_done_cb, which pops the front; if it
+      // doesn't, the queue is out of step with ATT and this would spin
+      if (!bt_att_cancel(att_, write_commands_.front().id)) {
+        JERONIBOT_LOG_ERROR("LEClient: Failed to cancel queued write command %u\n", write_commands_.front().id);
+        break;
+      }
+      writes_dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Only use signed write if unencrypted, as bt_gatt_client does
+  uint8_t opcode = BT_ATT_OP_WRITE_CMD;
+  if (signed_write && bt_att_get_security(att_) <= BT_SECURITY_LOW) {
+    opcode = BT_ATT_OP_SIGNED_WRITE_CMD;
+  }
+
+  unsigned int id = bt_att_send(att_, opcode, pdu.data(), pdu_length, nullptr, this, write_command_done_cb);
+  if (!id) {
+    JERONIBOT_LOG_ERROR("Failed to initiate write-without-response procedure\n");
+    release_write_slot();
+    return;
+  }
+
+  write_commands_.push_back({id, handle});
+}
+
+void
+LEClient::write_command_done_cb(void * user_data)
+{
+  LEClient * This = (LEClient *) user_data;
+
+  // Written, dropped or flushed on disconnect
+  This->write_commands_.pop_front();
+  This->release_write_slot();
+}
+
+void
+LEClient::release_write_slot()
+{
+  write_depth_.fetch_sub(1, std::memory_order_relaxed);
+
+  // Writers only ever block on a bounded queue, and set_write_policy()
+  // wakes them when the bound changes
+  if (write_max_queued_.load(std::memory_order_relaxed)) {
+    write_depth_.notify_all();
+  }
+}
+
+void
+LEClient::discover_services_cb(bool success, uint8_t att_ecode, void * user_data)
+{
+  std::promise<bool> * promise = (std::promise<bool> *) user_data;
+
+  if (!success) {
+    JERONIBOT_LOG_ERROR("Service discovery failed: %s (0x%02x)\n", utils::to_string(att_ecode), att_ecode);
+  }
+
+  promise->set_value(success);
+}
+
+bool
+LEClient::discover_services(uint16_t start, uint16_t end)
+{
+  std::promise<bool> promise;
+  std::future<bool> future = promise.get_future();
+
+  // Once the loop has stopped, or with the link down, the response would
+  // never come and the future would never be ready
+  bool started = invoke([&] {
+      return can_request() &&
+             bt_gatt_client_discover_range(gatt_, start, end, discover_services_cb, &promise, nullptr);
+    });
+
+  if (!started) {
+    JERONIBOT_LOG_ERROR("Failed to initiate service discovery\n");
+    return false;
+  }
+
+  if (!future.get()) {
+    return false;
+  }
+
+  invoke([this] {
+      if (!cache_path_.empty() && !GattCache::save(db_, cache_path_)) {
+        JERONIBOT_LOG_WARN("Failed to write GATT cache: %s\n", cache_path_.c_str());
+      }
+    });
+
+  return true;
 }
 
 void
 LEClient::process_input()
 {
-  mainloop_run();
+  // Published before anything can run on the loop, so that callbacks
+  // calling post() or invoke() find themselves on it
+  loop_thread_id_.store(std::this_thread::get_id(), std::memory_order_release);
+
+  mainloop_run(loop_.get());
+
+  // From here on posted commands run on the posting thread; pick up any
+  // that were queued while the loop was shutting down
+  loop_running_.store(false, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  std::lock_guard<std::recursive_mutex> lock(stopped_mutex_);
+  run_commands();
 }
 
 }  // namespace bluetooth
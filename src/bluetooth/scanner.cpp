@@ -0,0 +1,334 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <stdexcept>
+
+#include "bluez.h"
+#include "bluetooth/scanner.hpp"
+#include "util/logger.hpp"
+
+namespace bluetooth
+{
+
+std::span<const uint8_t>
+Advertisement::find(uint8_t type) const
+{
+  // A sequence of [length][type][length - 1 bytes]; a zero length ends it
+  std::size_t offset = 0;
+  while (offset < data.size()) {
+    uint8_t length = data[offset];
+    if (length == 0 || offset + 1 + length > data.size()) {
+      break;
+    }
+
+    if (data[offset + 1] == type) {
+      return data.subspan(offset + 2, length - 1);
+    }
+
+    offset += 1 + length;
+  }
+
+  return {};
+}
+
+std::string_view
+Advertisement::local_name() const
+{
+  std::span<const uint8_t> name = find(CompleteLocalName);
+  if (name.empty()) {
+    name = find(ShortenedLocalName);
+  }
+
+  return std::string_view(reinterpret_cast<const char *>(name.data()), name.size());
+}
+
+bool
+Advertisement::has_service_uuid16(uint16_t uuid) const
+{
+  for (uint8_t type : {CompleteServiceUuid16, IncompleteServiceUuid16}) {
+    std::span<const uint8_t> uuids = find(type);
+    for (std::size_t i = 0; i + 1 < uuids.size(); i += 2) {
+      if ((uuids[i] | (uuids[i + 1] << 8)) == uuid) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+Scanner::Scanner(int dev_id)
+{
+  dev_id_ = dev_id < 0 ? hci_get_route(nullptr) : dev_id;
+  if (dev_id_ < 0) {
+    throw std::runtime_error("Scanner: No Bluetooth adapter available");
+  }
+
+  dd_ = hci_open_dev(dev_id_);
+  if (dd_ < 0) {
+    throw std::runtime_error("Scanner: Failed to open the adapter");
+  }
+
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ < 0) {
+    hci_close_dev(dd_);
+    throw std::runtime_error("Scanner: Failed to create eventfd");
+  }
+}
+
+Scanner::~Scanner()
+{
+  stop();
+  close(stop_fd_);
+  hci_close_dev(dd_);
+}
+
+void
+Scanner::add_device(const std::string & address, uint8_t address_type)
+{
+  if (is_scanning()) {
+    throw std::runtime_error("Scanner: Devices can't be added while scanning");
+  }
+
+  Device device;
+  if (str2ba(address.c_str(), &device.address) < 0) {
+    throw std::invalid_argument("Scanner: Invalid address: " + address);
+  }
+  device.address_type = address_type;
+
+  devices_.push_back(device);
+}
+
+void
+Scanner::clear_devices()
+{
+  if (is_scanning()) {
+    throw std::runtime_error("Scanner: Devices can't be removed while scanning");
+  }
+
+  devices_.clear();
+}
+
+bool
+Scanner::load_accept_list()
+{
+  host_filter_ = false;
+
+  if (hci_le_clear_white_list(dd_, hci_timeout_ms) < 0) {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to clear the accept list: %s\n", strerror(errno));
+    return false;
+  }
+
+  uint8_t size = 0;
+  if (hci_le_read_white_list_size(dd_, &size, hci_timeout_ms) < 0) {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to read the accept list size: %s\n", strerror(errno));
+    return false;
+  }
+
+  // A fleet bigger than the controller can hold is filtered here instead,
+  // which costs a wakeup per advertisement but still gets it right
+  if (devices_.size() > size) {
+    JERONIBOT_LOG_WARN("Scanner: %zu devices don't fit in the accept list (%u); filtering on the host\n",
+      devices_.size(), size);
+    host_filter_ = true;
+    return true;
+  }
+
+  for (const Device & device : devices_) {
+    if (hci_le_add_white_list(dd_, &device.address, device.address_type, hci_timeout_ms) < 0) {
+      JERONIBOT_LOG_ERROR("Scanner: Failed to add to the accept list: %s\n", strerror(errno));
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+Scanner::start(Callback callback)
+{
+  return start(std::move(callback), Parameters());
+}
+
+bool
+Scanner::start(Callback callback, const Parameters & parameters)
+{
+  stop();
+
+  bool filter = !devices_.empty();
+  if (filter && !load_accept_list()) {
+    return false;
+  }
+
+  // Filter policy 0x01 has the controller report only what's on the accept
+  // list; with a host-side filter the controller has to report everything
+  uint8_t filter_policy = filter && !host_filter_ ? 0x01 : 0x00;
+  if (hci_le_set_scan_parameters(dd_, parameters.active ? 0x01 : 0x00, htobs(parameters.interval),
+    htobs(parameters.window), LE_PUBLIC_ADDRESS, filter_policy, hci_timeout_ms) < 0)
+  {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to set the scan parameters: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Only LE meta events make it through to the socket, so nothing else
+  // the controller says wakes up the scanner thread
+  struct hci_filter filter_mask;
+  hci_filter_clear(&filter_mask);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &filter_mask);
+  hci_filter_set_event(EVT_LE_META_EVENT, &filter_mask);
+
+  if (setsockopt(dd_, SOL_HCI, HCI_FILTER, &filter_mask, sizeof(filter_mask)) < 0) {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to set the socket filter: %s\n", strerror(errno));
+    return false;
+  }
+
+  if (hci_le_set_scan_enable(dd_, 0x01, parameters.filter_duplicates ? 0x01 : 0x00, hci_timeout_ms) < 0) {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to enable scanning: %s\n", strerror(errno));
+    return false;
+  }
+
+  callback_ = std::move(callback);
+  thread_ = std::thread(&Scanner::run, this);
+  return true;
+}
+
+void
+Scanner::stop()
+{
+  if (!thread_.joinable()) {
+    return;
+  }
+
+  // The thread has to be out of the way first, as the disable command reads
+  // its response from the same socket
+  uint64_t one = 1;
+  if (write(stop_fd_, &one, sizeof(one)) < 0) {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to signal the scanner thread: %s\n", strerror(errno));
+  }
+  thread_.join();
+
+  uint64_t count;
+  if (read(stop_fd_, &count, sizeof(count)) < 0) {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to reset the eventfd: %s\n", strerror(errno));
+  }
+
+  if (hci_le_set_scan_enable(dd_, 0x00, 0x00, hci_timeout_ms) < 0) {
+    JERONIBOT_LOG_ERROR("Scanner: Failed to disable scanning: %s\n", strerror(errno));
+  }
+
+  callback_ = nullptr;
+}
+
+bool
+Scanner::is_known(const bdaddr_t & address, uint8_t address_type) const
+{
+  for (const Device & device : devices_) {
+    if (device.address_type == address_type && !bacmp(&device.address, &address)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+Scanner::run()
+{
+  uint8_t buffer[HCI_MAX_EVENT_SIZE];
+
+  struct pollfd fds[2];
+  fds[0] = {dd_, POLLIN, 0};
+  fds[1] = {stop_fd_, POLLIN, 0};
+
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      JERONIBOT_LOG_ERROR("Scanner: poll failed: %s\n", strerror(errno));
+      return;
+    }
+
+    if (fds[1].revents) {
+      return;
+    }
+
+    ssize_t length = read(dd_, buffer, sizeof(buffer));
+    if (length < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      JERONIBOT_LOG_ERROR("Scanner: Failed to read from the adapter: %s\n", strerror(errno));
+      return;
+    }
+
+    dispatch(buffer, length);
+  }
+}
+
+void
+Scanner::dispatch(const uint8_t * event, std::size_t length)
+{
+  // [HCI_EVENT_PKT][hci_event_hdr][evt_le_meta_event][num_reports] and then
+  // each report as an le_advertising_info, its data and the RSSI
+  const std::size_t header = 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE + 1;
+  if (length < header || event[0] != HCI_EVENT_PKT) {
+    return;
+  }
+
+  const hci_event_hdr * hdr = reinterpret_cast<const hci_event_hdr *>(event + 1);
+  const evt_le_meta_event * meta = reinterpret_cast<const evt_le_meta_event *>(hdr + 1);
+  if (hdr->evt != EVT_LE_META_EVENT || meta->subevent != EVT_LE_ADVERTISING_REPORT) {
+    return;
+  }
+
+  uint8_t reports = meta->data[0];
+  std::size_t offset = header;
+
+  for (uint8_t i = 0; i < reports; i++) {
+    if (offset + LE_ADVERTISING_INFO_SIZE > length) {
+      return;
+    }
+
+    const le_advertising_info * info = reinterpret_cast<const le_advertising_info *>(event + offset);
+    if (offset + LE_ADVERTISING_INFO_SIZE + info->length + 1 > length) {
+      return;
+    }
+
+    Advertisement advertisement;
+    bacpy(&advertisement.address, &info->bdaddr);
+    advertisement.address_type = info->bdaddr_type;
+    advertisement.event_type = info->evt_type;
+    advertisement.data = std::span<const uint8_t>(info->data, info->length);
+    advertisement.rssi = static_cast<int8_t>(info->data[info->length]);
+
+    offset += LE_ADVERTISING_INFO_SIZE + info->length + 1;
+
+    if (host_filter_ && !is_known(advertisement.address, advertisement.address_type)) {
+      filtered_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    callback_(advertisement);
+  }
+}
+
+}  // namespace bluetooth
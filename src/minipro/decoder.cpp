@@ -0,0 +1,153 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/decoder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace jeronibot::minipro::packet
+{
+
+// The header and the length byte have to be seen before the size of the frame
+// is known
+static constexpr std::size_t preamble_size{3};
+
+Decoder::Decoder(FrameCallback callback)
+: callback_(std::move(callback))
+{
+}
+
+void
+Decoder::feed(std::span<const uint8_t> data)
+{
+  while (!data.empty()) {
+    std::size_t consumed = fill_ ? feed_buffered(data) : feed_unbuffered(data);
+    data = data.subspan(consumed);
+  }
+}
+
+std::size_t
+Decoder::feed_unbuffered(std::span<const uint8_t> data)
+{
+  // Resync on the 0x55aa header, allowing for a header split across calls
+  std::size_t start = 0;
+  while (start < data.size()) {
+    if (data[start] == hi(header) && (start + 1 == data.size() || data[start + 1] == lo(header))) {
+      break;
+    }
+    start++;
+  }
+
+  stats_.discarded_bytes += start;
+  std::span<const uint8_t> frame = data.subspan(start);
+
+  if (frame.size() >= preamble_size) {
+    if (frame[2] < checksum_size) {
+      stats_.discarded_bytes++;
+      return start + 1;
+    }
+
+    std::size_t size = header_size + frame[2];
+    if (frame.size() >= size) {
+      // The whole frame is here, so decode it in place
+      if (!emit(frame.first(size))) {
+        stats_.discarded_bytes++;
+        return start + 1;
+      }
+      return start + size;
+    }
+  }
+
+  // Only the start of a frame is here; hold on to it until the rest arrives
+  std::copy(frame.begin(), frame.end(), buffer_.begin());
+  fill_ = frame.size();
+
+  return data.size();
+}
+
+std::size_t
+Decoder::feed_buffered(std::span<const uint8_t> data)
+{
+  std::size_t consumed = 0;
+
+  while (fill_ < preamble_size && consumed < data.size()) {
+    buffer_[fill_++] = data[consumed++];
+  }
+
+  bool valid = buffer_[1] == lo(header) || fill_ < 2;
+  if (valid && fill_ >= preamble_size) {
+    valid = buffer_[2] >= checksum_size;
+  }
+
+  if (valid && fill_ >= preamble_size) {
+    std::size_t size = header_size + buffer_[2];
+    std::size_t count = std::min(size - fill_, data.size() - consumed);
+
+    std::memcpy(buffer_.data() + fill_, data.data() + consumed, count);
+    fill_ += count;
+    consumed += count;
+
+    if (fill_ < size) {
+      return consumed;
+    }
+
+    valid = emit(std::span<const uint8_t>(buffer_.data(), size));
+    if (valid) {
+      fill_ = 0;
+    }
+  }
+
+  if (!valid) {
+    // Drop the byte that looked like a header and rescan whatever else was
+    // buffered; the rescan can't recurse further since it ends unbuffered
+    std::array<uint8_t, max_frame_size> pending;
+    std::size_t count = fill_ - 1;
+
+    std::memcpy(pending.data(), buffer_.data() + 1, count);
+    fill_ = 0;
+    stats_.discarded_bytes++;
+
+    feed(std::span<const uint8_t>(pending.data(), count));
+  }
+
+  return consumed;
+}
+
+bool
+Decoder::emit(std::span<const uint8_t> frame)
+{
+  std::size_t checksum_offset = frame.size() - checksum_size;
+
+  uint16_t sum = 0;
+  for (std::size_t i = 2; i < checksum_offset; i++) {
+    sum += frame[i];
+  }
+
+  uint16_t checksum = frame[checksum_offset] | (frame[checksum_offset + 1] << 8);
+  if ((sum ^ 0xffff) != checksum) {
+    stats_.checksum_errors++;
+    return false;
+  }
+
+  stats_.frames++;
+
+  Frame decoded{frame[3], frame[4], frame[5], frame.subspan(header_size, checksum_offset - header_size)};
+  callback_(decoded);
+
+  return true;
+}
+
+}  // namespace jeronibot::minipro::packet
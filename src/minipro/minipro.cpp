@@ -17,94 +17,328 @@
 #include "minipro/drive.hpp"
 #include "minipro/enter_remote_control_mode.hpp"
 #include "minipro/exit_remote_control_mode.hpp"
-#include "minipro/packet.hpp"
 
 #include <netinet/in.h>
 
+#include <algorithm>
+#include <stdexcept>
 #include <string>
-#include <vector>
+
+#include "util/logger.hpp"
+
+extern "C" {
+#include "mainloop.h"
+}
 
 namespace jeronibot::minipro
 {
 
-MiniPro::MiniPro(const std::string & bt_addr)
-: LEClient(bt_addr)
+MiniPro::MiniPro(const std::string & bt_addr, const std::string & cache_dir)
+: LEClient(bt_addr, BDADDR_LE_RANDOM, BT_SECURITY_LOW, 0, cache_dir, {{0x0001, 0xffff, uart_service_uuid}}),
+  decoder_([this](const packet::Frame & frame) {handle_frame(frame);})
+{
+}
+
+MiniPro::MiniPro(int fd, const std::string & cache_path)
+: LEClient(fd, 0, cache_path, {{0x0001, 0xffff, uart_service_uuid}}),
+  decoder_([this](const packet::Frame & frame) {handle_frame(frame);})
 {
 }
 
+MiniPro::~MiniPro()
+{
+  // The pacer and the decoder call back into this object from the mainloop
+  // thread, so it has to be stopped before any members go away
+  stop();
+
+  if (connection_update_.valid()) {
+    connection_update_.wait();
+  }
+}
+
 units::velocity::miles_per_hour_t
-MiniPro::get_current_speed()
+MiniPro::get_current_speed() const
 {
-  // TODO(mjeronimo):
-  return 0_mph;
+  return units::velocity::kilometers_per_hour_t(get_telemetry().speed / 1000.0);
 }
 
 units::current::ampere_t
-MiniPro::get_battery_level()
+MiniPro::get_battery_level() const
 {
-  // TODO(mjeronimo):
-  return 0_A;
+  return units::current::ampere_t(get_telemetry().battery_current / 100.0);
 }
 
 units::voltage::volt_t
-MiniPro::get_voltage()
+MiniPro::get_voltage() const
 {
-  // TODO(mjeronimo):
-  return 0_V;
+  return units::voltage::volt_t(get_telemetry().voltage / 100.0);
 }
 
 units::temperature::fahrenheit_t
-MiniPro::get_vehicle_temperature()
+MiniPro::get_vehicle_temperature() const
 {
-  // TODO(mjeronimo):
-  return 0_degF;
+  return units::temperature::celsius_t(get_telemetry().temperature / 10.0);
 }
 
 void
 MiniPro::enable_notifications()
 {
+  if (!notify_id_) {
+    notify_id_ = subscribe_telemetry();
+  }
+
+  notifications_enabled_.store(true, std::memory_order_relaxed);
   write_config_value(0x0001);
 }
 
 void
 MiniPro::disable_notifications()
 {
+  notifications_enabled_.store(false, std::memory_order_relaxed);
   write_config_value(0x0000);
 }
 
 void
 MiniPro::enter_remote_control_mode()
 {
-  packet::EnterRemoteControlMode packet;
+  // Chosen on the mainloop thread, where set_link_adaptation() writes the
+  // degraded profile
+  switch_connection_profile(invoke([this] {return get_driving_profile();}));
+
+  remote_control_.store(true, std::memory_order_relaxed);
+  static constexpr packet::EnterRemoteControlMode packet;
   send_packet(packet);
 }
 
 void
 MiniPro::exit_remote_control_mode()
 {
-  packet::ExitRemoteControlMode packet;
+  remote_control_.store(false, std::memory_order_relaxed);
+  static constexpr packet::ExitRemoteControlMode packet;
   send_packet(packet);
+
+  switch_connection_profile(invoke([this] {return parked_profile_;}));
+}
+
+void
+MiniPro::set_connection_profiles(const ConnectionParameters & driving, const ConnectionParameters & parked)
+{
+  // on_link_quality() reads them on the mainloop thread
+  invoke([this, &driving, &parked] {
+      driving_profile_ = driving;
+      parked_profile_ = parked;
+    });
+}
+
+void
+MiniPro::switch_connection_profile(const ConnectionParameters & profile)
+{
+  if (!can_update_connection()) {
+    return;
+  }
+
+  // Chained on the previous update, so that they're applied in order
+  std::lock_guard<std::mutex> lock(connection_update_mutex_);
+  connection_update_ = std::async(std::launch::async,
+      [this, profile, previous = std::move(connection_update_)]() mutable {
+        if (previous.valid()) {
+          previous.wait();
+        }
+        return update_connection(profile);
+      });
+}
+
+MiniPro::ConnectionParameters
+MiniPro::get_driving_profile() const
+{
+  return link_degraded_.load(std::memory_order_relaxed) ? link_adaptation_.degraded_profile : driving_profile_;
+}
+
+void
+MiniPro::set_link_adaptation(const LinkAdaptation & adaptation)
+{
+  unsigned int hz = units::unit_cast<unsigned int>(adaptation.degraded_rate);
+  if (hz == 0 || hz > 1000 || adaptation.degraded_score > adaptation.recovered_score) {
+    throw std::runtime_error("MiniPro: invalid link adaptation");
+  }
+
+  // on_link_quality() reads it on the mainloop thread
+  invoke([this, &adaptation, hz] {
+      link_adaptation_ = adaptation;
+      link_adaptation_enabled_ = true;
+      degraded_period_ms_.store(1000 / hz, std::memory_order_relaxed);
+    });
+}
+
+void
+MiniPro::disable_link_adaptation()
+{
+  invoke([this] {
+      link_adaptation_enabled_ = false;
+      if (link_degraded_.exchange(false, std::memory_order_relaxed) && remote_control_.load(std::memory_order_relaxed)) {
+        switch_connection_profile(driving_profile_);
+      }
+    });
+}
+
+void
+MiniPro::on_link_quality(const LinkQuality & quality)
+{
+  if (!link_adaptation_enabled_) {
+    return;
+  }
+
+  // Between the two thresholds nothing changes, so a link hovering around
+  // one of them doesn't flap
+  bool degraded = link_degraded_.load(std::memory_order_relaxed);
+  if (!degraded && quality.score < link_adaptation_.degraded_score) {
+    degraded = true;
+  } else if (degraded && quality.score > link_adaptation_.recovered_score) {
+    degraded = false;
+  } else {
+    return;
+  }
+
+  link_degraded_.store(degraded, std::memory_order_relaxed);
+  JERONIBOT_LOG_INFO("MiniPro: Link %s (score %.2f, RSSI %d dBm)\n", degraded ? "degraded" : "recovered",
+    quality.score, quality.rssi);
+
+  if (remote_control_.load(std::memory_order_relaxed)) {
+    switch_connection_profile(get_driving_profile());
+  }
 }
 
 void
 MiniPro::drive(int16_t throttle, int16_t steering)
 {
-  packet::Drive packet(throttle, steering);
-  send_packet(packet);
+  // The mailbox also remembers the last command for restoring a dropped link
+  uint64_t command = static_cast<uint64_t>(static_cast<uint16_t>(throttle)) |
+    (static_cast<uint64_t>(static_cast<uint16_t>(steering)) << 16);
+  drive_mailbox_.store(command | has_command, std::memory_order_release);
+  last_drive_ns_.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+
+  if (pacer_period_ms_.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  send_packet(packet::Drive(throttle, steering));
+}
+
+void
+MiniPro::start_drive_pacer(units::frequency::hertz_t rate)
+{
+  unsigned int hz = units::unit_cast<unsigned int>(rate);
+  if (hz == 0 || hz > 1000) {
+    throw std::runtime_error("MiniPro: invalid drive pacer rate");
+  }
+
+  unsigned int period_ms = 1000 / hz;
+  pacer_period_ms_.store(period_ms, std::memory_order_relaxed);
+
+  // The timeout is created once and is then only re-armed; the callback
+  // lets it lapse when the pacer is stopped. Timeouts belong to the
+  // mainloop, so they're only touched on its thread
+  bool started = invoke([this, period_ms] {
+      if (pacer_timeout_id_ < 0) {
+        pacer_timeout_id_ = mainloop_add_timeout(loop_.get(), period_ms, drive_pacer_cb, this, nullptr);
+        return pacer_timeout_id_ >= 0;
+      }
+
+      return mainloop_modify_timeout(loop_.get(), pacer_timeout_id_, period_ms) >= 0;
+    });
+
+  if (!started) {
+    pacer_period_ms_.store(0, std::memory_order_relaxed);
+    throw std::runtime_error("MiniPro: Failed to start drive pacer");
+  }
+}
+
+void
+MiniPro::stop_drive_pacer()
+{
+  pacer_period_ms_.store(0, std::memory_order_relaxed);
+}
+
+void
+MiniPro::drive_pacer_cb(int id, void * user_data)
+{
+  MiniPro * This = (MiniPro *) user_data;
+
+  unsigned int period_ms = This->pacer_period_ms_.load(std::memory_order_relaxed);
+  if (!period_ms) {
+    return;
+  }
+
+  // A weak link gets fewer, not more, chances to fall behind
+  if (This->link_degraded_.load(std::memory_order_relaxed)) {
+    period_ms = std::max(period_ms, This->degraded_period_ms_.load(std::memory_order_relaxed));
+  }
+
+  // Don't stack a drive behind commands still waiting for the link; the
+  // mailbox keeps the newest one for the next tick
+  uint64_t command = This->drive_mailbox_.load(std::memory_order_acquire);
+  if ((command & has_command) && This->is_connected() && This->get_write_queue_depth() == 0) {
+    This->send_packet(packet::Drive(command & 0xffff, (command >> 16) & 0xffff));
+  }
+
+  mainloop_modify_timeout(This->loop_.get(), id, period_ms);
+}
+
+void
+MiniPro::on_reconnected()
+{
+  // A frame cut off by the disconnect won't be completed
+  decoder_.reset();
+
+  // The old registration went away with the old GATT client
+  if (notifications_enabled_.load(std::memory_order_relaxed)) {
+    notify_id_ = subscribe_telemetry();
+    write_config_value(0x0001, false);
+  }
+
+  // The vehicle left remote control mode when the link dropped
+  if (remote_control_.load(std::memory_order_relaxed)) {
+    switch_connection_profile(get_driving_profile());
+
+    static constexpr packet::EnterRemoteControlMode packet;
+    send_packet(packet);
+
+    auto age = std::chrono::steady_clock::now().time_since_epoch() -
+      std::chrono::steady_clock::duration(last_drive_ns_.load(std::memory_order_relaxed));
+    uint64_t command = drive_mailbox_.load(std::memory_order_acquire);
+    if (!(command & has_command) || age > restore_drive_max_age) {
+      // Keep the pacer from picking the stale command back up, unless a new
+      // one has just come in
+      drive_mailbox_.compare_exchange_strong(command, has_command, std::memory_order_acq_rel);
+      command = 0;
+    }
+
+    send_packet(packet::Drive(command & 0xffff, (command >> 16) & 0xffff));
+  }
+}
+
+unsigned int
+MiniPro::subscribe_telemetry()
+{
+  return register_notify(notify_value_handle_,
+           [this](uint16_t /*value_handle*/, std::span<const uint8_t> value) {decoder_.feed(value);});
 }
 
 void
-MiniPro::send_packet(packet::Packet & packet)
+MiniPro::handle_frame(const packet::Frame & frame)
 {
-  std::vector<uint8_t> bytes = packet.get_bytes();
-  write_value(tx_service_handle_, bytes.data(), bytes.size(), true);
+  telemetry_.update(frame);
 }
 
 void
-MiniPro::write_config_value(uint16_t value)
+MiniPro::write_config_value(uint16_t value, bool wait)
 {
   uint16_t htons_value = htons(value);
-  write_value(config_service_handle_, (uint8_t *) &htons_value, sizeof(htons_value));
+  if (wait) {
+    write_value(config_service_handle_, (uint8_t *) &htons_value, sizeof(htons_value));
+  } else {
+    write_value_async(config_service_handle_, (uint8_t *) &htons_value, sizeof(htons_value));
+  }
 }
 
 }  // namespace jeronibot::minipro
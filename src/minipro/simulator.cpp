@@ -0,0 +1,811 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/simulator.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "att-types.h"
+}
+
+#include "minipro/packet.hpp"
+
+using namespace std::chrono_literals;
+
+namespace jeronibot::minipro
+{
+
+namespace
+{
+
+// A register report as sent by the vehicle: one 16-bit register value
+template<uint8_t Parameter>
+class Report : public packet::Packet<packet::Notification, packet::GetSetValue, Parameter, 2>
+{
+public:
+  using Base = packet::Packet<packet::Notification, packet::GetSetValue, Parameter, 2>;
+
+  constexpr explicit Report(uint16_t value)
+  : Base({packet::lo(value), packet::hi(value)})
+  {
+  }
+};
+
+constexpr uint16_t primary_service_uuid{0x2800};
+constexpr uint16_t secondary_service_uuid{0x2801};
+constexpr uint16_t characteristic_uuid{0x2803};
+constexpr uint16_t ccc_uuid{0x2902};
+
+// Largest MTU the simulated vehicle accepts
+constexpr uint16_t server_mtu{247};
+
+// Top speed of the vehicle and the time constant of its response to throttle
+constexpr double max_speed{18.0};  // km/h
+constexpr double speed_time_constant{0.5};  // s
+
+// The battery sags under load
+constexpr double nominal_voltage{63.0};  // V
+constexpr double internal_resistance{0.05};  // ohm
+
+std::vector<uint8_t>
+uuid16(uint16_t uuid)
+{
+  return {packet::lo(uuid), packet::hi(uuid)};
+}
+
+// Little-endian bytes of a UUID written in the usual string form
+std::vector<uint8_t>
+uuid128(const std::string & uuid)
+{
+  std::vector<uint8_t> bytes;
+  std::string hex;
+
+  std::copy_if(uuid.begin(), uuid.end(), std::back_inserter(hex), [](char c) {return c != '-';});
+  for (std::size_t i = 0; i + 1 < hex.size(); i += 2) {
+    bytes.push_back(static_cast<uint8_t>(std::stoul(hex.substr(i, 2), nullptr, 16)));
+  }
+
+  std::reverse(bytes.begin(), bytes.end());
+  return bytes;
+}
+
+// Expand a 16-bit UUID onto the Bluetooth base UUID; 128-bit ones pass through
+std::vector<uint8_t>
+to_uuid128(const std::vector<uint8_t> & uuid)
+{
+  if (uuid.size() != 2) {
+    return uuid;
+  }
+
+  std::vector<uint8_t> base = uuid128("00000000-0000-1000-8000-00805f9b34fb");
+  base[12] = uuid[0];
+  base[13] = uuid[1];
+  return base;
+}
+
+uint16_t
+get_le16(const uint8_t * p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+void
+put_le16(std::vector<uint8_t> & pdu, uint16_t value)
+{
+  pdu.push_back(packet::lo(value));
+  pdu.push_back(packet::hi(value));
+}
+
+}  // namespace
+
+Simulator::Simulator(units::frequency::hertz_t telemetry_rate, std::chrono::microseconds link_latency)
+: link_latency_(link_latency),
+  decoder_([this](const packet::Frame & frame) {handle_frame(frame);})
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+    throw std::runtime_error("Simulator: Failed to create socketpair");
+  }
+
+  fd_ = fds[0];
+  client_fd_ = fds[1];
+
+  wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakeup_fd_ < 0) {
+    close(fd_);
+    close(client_fd_);
+    throw std::runtime_error("Simulator: Failed to create eventfd");
+  }
+
+  build_attribute_table();
+  set_telemetry_rate(telemetry_rate);
+
+  last_step_ = std::chrono::steady_clock::now();
+  thread_ = std::make_unique<std::thread>(&Simulator::run, this);
+}
+
+Simulator::~Simulator()
+{
+  should_exit_ = true;
+  wakeup();
+  thread_->join();
+
+  close(wakeup_fd_);
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (next_fd_ >= 0) {
+    close(next_fd_);
+  }
+}
+
+void
+Simulator::wakeup()
+{
+  uint64_t one = 1;
+  if (write(wakeup_fd_, &one, sizeof(one)) < 0) {
+    // The thread still notices on its next wakeup
+  }
+}
+
+void
+Simulator::disconnect()
+{
+  drop_link_ = true;
+  wakeup();
+}
+
+int
+Simulator::connect()
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+    return -1;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (next_fd_ >= 0) {
+      close(next_fd_);
+    }
+    next_fd_ = fds[0];
+  }
+
+  wakeup();
+  return fds[1];
+}
+
+void
+Simulator::set_telemetry_rate(units::frequency::hertz_t rate)
+{
+  double hz = units::unit_cast<double>(rate);
+  telemetry_period_us_ = hz > 0 ? static_cast<unsigned int>(1e6 / hz) : 0;
+  wakeup();
+}
+
+Simulator::VehicleState
+Simulator::get_vehicle_state()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return state_;
+}
+
+void
+Simulator::build_attribute_table()
+{
+  // Generic Access
+  add_service(0x0001, 0x0005, uuid16(0x1800));
+  add_characteristic(0x0002, BT_GATT_CHRC_PROP_READ, uuid16(0x2a00), {'M', 'i', 'n', 'i', 'P', 'R', 'O'});
+  add_characteristic(0x0004, BT_GATT_CHRC_PROP_READ, uuid16(0x2a01), {0x00, 0x00});
+
+  // Generic Attribute, with Service Changed
+  add_service(0x0006, 0x0008, uuid16(0x1801));
+  add_characteristic(0x0007, BT_GATT_CHRC_PROP_INDICATE, uuid16(0x2a05), {});
+
+  // The vehicle's serial service; the handles are what MiniPro expects
+  add_service(0x0009, 0x000e, uuid128("6e400001-b5a3-f393-e0a9-e50e24dcca9e"));
+  add_characteristic(0x000a, BT_GATT_CHRC_PROP_NOTIFY, uuid128("6e400003-b5a3-f393-e0a9-e50e24dcca9e"), {});
+  add_descriptor(config_handle, ccc_uuid, {0x00, 0x00});
+  add_characteristic(0x000d, BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP,
+    uuid128("6e400002-b5a3-f393-e0a9-e50e24dcca9e"), {});
+}
+
+void
+Simulator::add_service(uint16_t handle, uint16_t end, std::vector<uint8_t> uuid)
+{
+  attributes_.push_back({handle, uuid16(primary_service_uuid), std::move(uuid), end});
+}
+
+void
+Simulator::add_characteristic(uint16_t handle, uint8_t properties, std::vector<uint8_t> uuid, std::vector<uint8_t> value)
+{
+  std::vector<uint8_t> declaration{properties};
+  put_le16(declaration, handle + 1);
+  declaration.insert(declaration.end(), uuid.begin(), uuid.end());
+
+  attributes_.push_back({handle, uuid16(characteristic_uuid), std::move(declaration), 0});
+  attributes_.push_back({static_cast<uint16_t>(handle + 1), std::move(uuid), std::move(value), 0});
+}
+
+void
+Simulator::add_descriptor(uint16_t handle, uint16_t uuid, std::vector<uint8_t> value)
+{
+  attributes_.push_back({handle, uuid16(uuid), std::move(value), 0});
+}
+
+Simulator::Attribute *
+Simulator::find_attribute(uint16_t handle)
+{
+  for (auto & attribute : attributes_) {
+    if (attribute.handle == handle) {
+      return &attribute;
+    }
+  }
+  return nullptr;
+}
+
+void
+Simulator::run()
+{
+  auto next_report = std::chrono::steady_clock::now();
+  bool connected = true;
+  uint8_t buffer[BT_ATT_MAX_LE_MTU];
+
+  while (!should_exit_) {
+    auto now = std::chrono::steady_clock::now();
+    auto period = std::chrono::microseconds(telemetry_period_us_.load());
+    bool reporting = period.count() && get_vehicle_state().notifications;
+
+    // Wake up for the next report or the next PDU to deliver, whichever is first
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    if (reporting) {
+      deadline = next_report;
+    }
+    if (!pending_.empty() && (!deadline || pending_.front().first < *deadline)) {
+      deadline = pending_.front().first;
+    }
+
+    struct timespec timeout;
+    struct timespec * ptimeout = nullptr;
+    if (deadline) {
+      auto wait = std::max(std::chrono::nanoseconds(0), *deadline - now);
+      timeout.tv_sec = wait.count() / 1000000000;
+      timeout.tv_nsec = wait.count() % 1000000000;
+      ptimeout = &timeout;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = connected ? fd_ : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup_fd_;
+    fds[1].events = POLLIN;
+
+    if (ppoll(fds, 2, ptimeout, nullptr) < 0) {
+      continue;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      if (read(wakeup_fd_, &count, sizeof(count)) < 0) {
+        // Nothing to do; the eventfd is only used to interrupt ppoll
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      ssize_t length = recv(fd_, buffer, sizeof(buffer), 0);
+      if (length > 0) {
+        handle_pdu(buffer, length);
+      } else {
+        connected = false;
+      }
+    } else if (fds[0].revents & (POLLHUP | POLLERR)) {
+      connected = false;
+    }
+
+    if (drop_link_.exchange(false)) {
+      connected = false;
+    }
+
+    if (!connected && fd_ >= 0) {
+      close(fd_);
+      fd_ = -1;
+      reset_link();
+    }
+
+    // A connection accepted by connect() replaces whatever was there
+    int next_fd;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      next_fd = std::exchange(next_fd_, -1);
+    }
+    if (next_fd >= 0) {
+      if (fd_ >= 0) {
+        close(fd_);
+      }
+      fd_ = next_fd;
+      connected = true;
+      reset_link();
+    }
+
+    now = std::chrono::steady_clock::now();
+    flush_pending(now);
+    step_model(std::chrono::duration<double>(now - last_step_).count());
+    last_step_ = now;
+
+    if (!reporting) {
+      next_report = now + period;
+    } else if (now >= next_report) {
+      if (connected) {
+        send_telemetry();
+      }
+
+      // After a stall, skip the missed reports rather than bursting them
+      next_report += period;
+      if (next_report < now) {
+        next_report = now + period;
+      }
+    }
+  }
+}
+
+void
+Simulator::reset_link()
+{
+  pending_.clear();
+  decoder_.reset();
+  mtu_ = BT_ATT_DEFAULT_LE_MTU;
+
+  Attribute * ccc = find_attribute(config_handle);
+  ccc->value.assign(ccc->value.size(), 0);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  state_.remote_control = false;
+  state_.notifications = false;
+  state_.throttle = 0;
+  state_.steering = 0;
+}
+
+void
+Simulator::handle_pdu(const uint8_t * pdu, std::size_t length)
+{
+  uint8_t opcode = pdu[0];
+  const uint8_t * params = pdu + 1;
+  std::size_t params_length = length - 1;
+
+  switch (opcode) {
+    case BT_ATT_OP_MTU_REQ:
+      if (params_length != 2) {
+        send_error(opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+        return;
+      } else {
+        uint16_t client_mtu = get_le16(params);
+        mtu_ = std::max<uint16_t>(BT_ATT_DEFAULT_LE_MTU, std::min(client_mtu, server_mtu));
+
+        std::vector<uint8_t> rsp{BT_ATT_OP_MTU_RSP};
+        put_le16(rsp, server_mtu);
+        send_pdu(rsp);
+      }
+      break;
+
+    case BT_ATT_OP_READ_BY_GRP_TYPE_REQ:
+      handle_read_by_group_type(params, params_length);
+      break;
+
+    case BT_ATT_OP_FIND_BY_TYPE_VAL_REQ:
+      handle_find_by_type_value(params, params_length);
+      break;
+
+    case BT_ATT_OP_READ_BY_TYPE_REQ:
+      handle_read_by_type(params, params_length);
+      break;
+
+    case BT_ATT_OP_FIND_INFO_REQ:
+      handle_find_information(params, params_length);
+      break;
+
+    case BT_ATT_OP_READ_REQ:
+      handle_read(params, params_length);
+      break;
+
+    case BT_ATT_OP_READ_MULT_REQ:
+      handle_read_multiple(params, params_length);
+      break;
+
+    case BT_ATT_OP_WRITE_REQ:
+    case BT_ATT_OP_WRITE_CMD:
+    case BT_ATT_OP_SIGNED_WRITE_CMD:
+      handle_write(opcode, params, params_length);
+      break;
+
+    case BT_ATT_OP_HANDLE_VAL_CONF:
+      break;
+
+    default:
+      // Commands don't get a response, even when they aren't supported
+      if (!(opcode & 0x40)) {
+        send_error(opcode, 0, BT_ATT_ERROR_REQUEST_NOT_SUPPORTED);
+      }
+      break;
+  }
+}
+
+void
+Simulator::handle_read_by_group_type(const uint8_t * pdu, std::size_t length)
+{
+  if (length != 6 && length != 20) {
+    send_error(BT_ATT_OP_READ_BY_GRP_TYPE_REQ, 0, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t start = get_le16(pdu);
+  uint16_t end = get_le16(pdu + 2);
+  uint16_t type = length == 6 ? get_le16(pdu + 4) : 0;
+
+  if (type != primary_service_uuid && type != secondary_service_uuid) {
+    send_error(BT_ATT_OP_READ_BY_GRP_TYPE_REQ, start, BT_ATT_ERROR_UNSUPPORTED_GROUP_TYPE);
+    return;
+  }
+
+  std::vector<uint8_t> rsp{BT_ATT_OP_READ_BY_GRP_TYPE_RSP, 0};
+  std::size_t entry_length = 0;
+
+  for (const auto & attribute : attributes_) {
+    if (attribute.handle < start || attribute.handle > end || attribute.type != uuid16(type)) {
+      continue;
+    }
+
+    // All entries in a response have the same length
+    std::size_t this_length = 4 + attribute.value.size();
+    if (entry_length && this_length != entry_length) {
+      break;
+    }
+    if (rsp.size() + this_length > mtu_) {
+      break;
+    }
+
+    entry_length = this_length;
+    put_le16(rsp, attribute.handle);
+    put_le16(rsp, attribute.group_end);
+    rsp.insert(rsp.end(), attribute.value.begin(), attribute.value.end());
+  }
+
+  if (!entry_length) {
+    send_error(BT_ATT_OP_READ_BY_GRP_TYPE_REQ, start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  rsp[1] = entry_length;
+  send_pdu(rsp);
+}
+
+void
+Simulator::handle_find_by_type_value(const uint8_t * pdu, std::size_t length)
+{
+  if (length < 6) {
+    send_error(BT_ATT_OP_FIND_BY_TYPE_VAL_REQ, 0, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t start = get_le16(pdu);
+  uint16_t end = get_le16(pdu + 2);
+  uint16_t type = get_le16(pdu + 4);
+  std::vector<uint8_t> value(pdu + 6, pdu + length);
+
+  std::vector<uint8_t> rsp{BT_ATT_OP_FIND_BY_TYPE_VAL_RSP};
+
+  // Only service discovery by UUID uses this request
+  if (type == primary_service_uuid) {
+    for (const auto & attribute : attributes_) {
+      if (attribute.handle < start || attribute.handle > end || attribute.type != uuid16(type)) {
+        continue;
+      }
+      if (to_uuid128(attribute.value) != to_uuid128(value)) {
+        continue;
+      }
+      if (rsp.size() + 4 > mtu_) {
+        break;
+      }
+
+      put_le16(rsp, attribute.handle);
+      put_le16(rsp, attribute.group_end);
+    }
+  }
+
+  if (rsp.size() == 1) {
+    send_error(BT_ATT_OP_FIND_BY_TYPE_VAL_REQ, start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  send_pdu(rsp);
+}
+
+void
+Simulator::handle_read_by_type(const uint8_t * pdu, std::size_t length)
+{
+  if (length != 6 && length != 20) {
+    send_error(BT_ATT_OP_READ_BY_TYPE_REQ, 0, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t start = get_le16(pdu);
+  uint16_t end = get_le16(pdu + 2);
+  std::vector<uint8_t> type(pdu + 4, pdu + length);
+
+  std::vector<uint8_t> rsp{BT_ATT_OP_READ_BY_TYPE_RSP, 0};
+  std::size_t entry_length = 0;
+
+  for (const auto & attribute : attributes_) {
+    if (attribute.handle < start || attribute.handle > end || attribute.type != type) {
+      continue;
+    }
+
+    std::size_t value_length = std::min<std::size_t>(attribute.value.size(), mtu_ - 4);
+    std::size_t this_length = 2 + value_length;
+    if (entry_length && this_length != entry_length) {
+      break;
+    }
+    if (rsp.size() + this_length > mtu_) {
+      break;
+    }
+
+    entry_length = this_length;
+    put_le16(rsp, attribute.handle);
+    rsp.insert(rsp.end(), attribute.value.begin(), attribute.value.begin() + value_length);
+  }
+
+  if (!entry_length) {
+    send_error(BT_ATT_OP_READ_BY_TYPE_REQ, start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  rsp[1] = entry_length;
+  send_pdu(rsp);
+}
+
+void
+Simulator::handle_find_information(const uint8_t * pdu, std::size_t length)
+{
+  if (length != 4) {
+    send_error(BT_ATT_OP_FIND_INFO_REQ, 0, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t start = get_le16(pdu);
+  uint16_t end = get_le16(pdu + 2);
+
+  std::vector<uint8_t> rsp{BT_ATT_OP_FIND_INFO_RSP, 0};
+  std::size_t uuid_length = 0;
+
+  for (const auto & attribute : attributes_) {
+    if (attribute.handle < start || attribute.handle > end) {
+      continue;
+    }
+
+    if (uuid_length && attribute.type.size() != uuid_length) {
+      break;
+    }
+    if (rsp.size() + 2 + attribute.type.size() > mtu_) {
+      break;
+    }
+
+    uuid_length = attribute.type.size();
+    put_le16(rsp, attribute.handle);
+    rsp.insert(rsp.end(), attribute.type.begin(), attribute.type.end());
+  }
+
+  if (!uuid_length) {
+    send_error(BT_ATT_OP_FIND_INFO_REQ, start, BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND);
+    return;
+  }
+
+  // Format 0x01 is a list of 16-bit UUIDs, 0x02 a list of 128-bit ones
+  rsp[1] = uuid_length == 2 ? 0x01 : 0x02;
+  send_pdu(rsp);
+}
+
+void
+Simulator::handle_read(const uint8_t * pdu, std::size_t length)
+{
+  if (length != 2) {
+    send_error(BT_ATT_OP_READ_REQ, 0, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  uint16_t handle = get_le16(pdu);
+  Attribute * attribute = find_attribute(handle);
+  if (!attribute) {
+    send_error(BT_ATT_OP_READ_REQ, handle, BT_ATT_ERROR_INVALID_HANDLE);
+    return;
+  }
+
+  std::size_t value_length = std::min<std::size_t>(attribute->value.size(), mtu_ - 1);
+  std::vector<uint8_t> rsp{BT_ATT_OP_READ_RSP};
+  rsp.insert(rsp.end(), attribute->value.begin(), attribute->value.begin() + value_length);
+  send_pdu(rsp);
+}
+
+void
+Simulator::handle_read_multiple(const uint8_t * pdu, std::size_t length)
+{
+  if (length < 4 || length % 2) {
+    send_error(BT_ATT_OP_READ_MULT_REQ, 0, BT_ATT_ERROR_INVALID_PDU);
+    return;
+  }
+
+  std::vector<uint8_t> rsp{BT_ATT_OP_READ_MULT_RSP};
+  for (std::size_t i = 0; i < length; i += 2) {
+    uint16_t handle = get_le16(pdu + i);
+    Attribute * attribute = find_attribute(handle);
+    if (!attribute) {
+      send_error(BT_ATT_OP_READ_MULT_REQ, handle, BT_ATT_ERROR_INVALID_HANDLE);
+      return;
+    }
+
+    rsp.insert(rsp.end(), attribute->value.begin(), attribute->value.end());
+  }
+
+  rsp.resize(std::min<std::size_t>(rsp.size(), mtu_));
+  send_pdu(rsp);
+}
+
+void
+Simulator::handle_write(uint8_t opcode, const uint8_t * pdu, std::size_t length)
+{
+  // Signed writes carry a 12-byte signature, which the simulator accepts as is
+  if (opcode == BT_ATT_OP_SIGNED_WRITE_CMD) {
+    if (length < 2 + 12) {
+      return;
+    }
+    length -= 12;
+  }
+
+  if (length < 2) {
+    if (opcode == BT_ATT_OP_WRITE_REQ) {
+      send_error(opcode, 0, BT_ATT_ERROR_INVALID_PDU);
+    }
+    return;
+  }
+
+  uint16_t handle = get_le16(pdu);
+  const uint8_t * value = pdu + 2;
+  std::size_t value_length = length - 2;
+
+  Attribute * attribute = find_attribute(handle);
+  if (!attribute) {
+    if (opcode == BT_ATT_OP_WRITE_REQ) {
+      send_error(opcode, handle, BT_ATT_ERROR_INVALID_HANDLE);
+    }
+    return;
+  }
+
+  if (handle == tx_value_handle) {
+    decoder_.feed(std::span<const uint8_t>(value, value_length));
+  } else if (handle == config_handle) {
+    attribute->value.assign(value, value + value_length);
+
+    // Any non-zero value enables notifications; MiniPro writes the CCC
+    // value byte-swapped
+    bool enable = std::any_of(value, value + value_length, [](uint8_t b) {return b != 0;});
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      state_.notifications = enable;
+    }
+  }
+
+  if (opcode == BT_ATT_OP_WRITE_REQ) {
+    send_pdu({BT_ATT_OP_WRITE_RSP});
+  }
+}
+
+void
+Simulator::handle_frame(const packet::Frame & frame)
+{
+  if (frame.type != packet::Command || frame.operation != packet::ControlDriveBase) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  if (frame.parameter == packet::EnableRemoteControl && frame.payload.size() == 2) {
+    state_.remote_control = get_le16(frame.payload.data()) != 0;
+    if (!state_.remote_control) {
+      state_.throttle = 0;
+      state_.steering = 0;
+    }
+  } else if (frame.parameter == packet::SetDrive && frame.payload.size() == 4) {
+    state_.throttle = static_cast<int16_t>(get_le16(frame.payload.data()));
+    state_.steering = static_cast<int16_t>(get_le16(frame.payload.data() + 2));
+    drive_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void
+Simulator::step_model(double dt)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  double target = state_.remote_control ? max_speed * state_.throttle / INT16_MAX : 0.0;
+  state_.speed += (target - state_.speed) * std::min(1.0, dt / speed_time_constant);
+
+  state_.current = 0.5 + 15.0 * std::fabs(state_.speed) / max_speed;
+  state_.voltage = nominal_voltage - internal_resistance * state_.current;
+  state_.temperature += (25.0 + state_.current - state_.temperature) * std::min(1.0, dt / 60.0);
+}
+
+void
+Simulator::send_telemetry()
+{
+  VehicleState state = get_vehicle_state();
+
+  auto notify = [this](const auto & report) {
+      const auto & bytes = report.get_bytes();
+
+      std::vector<uint8_t> pdu{BT_ATT_OP_HANDLE_VAL_NOT};
+      put_le16(pdu, notify_value_handle);
+      pdu.insert(pdu.end(), bytes.begin(), bytes.end());
+
+      send_pdu(pdu);
+      notification_count_.fetch_add(1, std::memory_order_relaxed);
+    };
+
+  notify(Report<packet::CurrentSpeed>(static_cast<int16_t>(std::lround(state.speed * 1000))));
+  notify(Report<packet::BatteryCurrent>(static_cast<int16_t>(std::lround(state.current * 100))));
+  notify(Report<packet::BatteryVoltage>(static_cast<uint16_t>(std::lround(state.voltage * 100))));
+  notify(Report<packet::BodyTemperature>(static_cast<int16_t>(std::lround(state.temperature * 10))));
+}
+
+void
+Simulator::send_pdu(std::vector<uint8_t> pdu)
+{
+  pending_.emplace_back(std::chrono::steady_clock::now() + link_latency_, std::move(pdu));
+  if (link_latency_.count() == 0) {
+    flush_pending(pending_.back().first);
+  }
+}
+
+void
+Simulator::flush_pending(std::chrono::steady_clock::time_point now)
+{
+  while (!pending_.empty() && pending_.front().first <= now) {
+    const auto & pdu = pending_.front().second;
+    if (send(fd_, pdu.data(), pdu.size(), MSG_NOSIGNAL) < 0) {
+      // The client went away; the read side will notice
+    }
+    pending_.pop_front();
+  }
+}
+
+void
+Simulator::send_error(uint8_t request_opcode, uint16_t handle, uint8_t ecode)
+{
+  std::vector<uint8_t> rsp{BT_ATT_OP_ERROR_RSP, request_opcode};
+  put_le16(rsp, handle);
+  rsp.push_back(ecode);
+  send_pdu(rsp);
+}
+
+}  // namespace jeronibot::minipro
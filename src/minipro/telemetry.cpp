@@ -0,0 +1,63 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "minipro/telemetry.hpp"
+
+#include <chrono>
+
+namespace jeronibot::minipro
+{
+
+bool
+TelemetryCache::update(const packet::Frame & frame)
+{
+  if (frame.type != packet::Notification) {
+    return false;
+  }
+
+  // A register report carries one or more consecutive 16-bit little-endian
+  // registers, starting with the one named by the frame's parameter
+  bool changed = false;
+  for (std::size_t i = 0; i + 1 < frame.payload.size(); i += 2) {
+    uint16_t value = frame.payload[i] | (frame.payload[i + 1] << 8);
+
+    switch (frame.parameter + i / 2) {
+      case packet::CurrentSpeed:
+        current_.speed = static_cast<int16_t>(value);
+        break;
+      case packet::BatteryCurrent:
+        current_.battery_current = static_cast<int16_t>(value);
+        break;
+      case packet::BatteryVoltage:
+        current_.voltage = value;
+        break;
+      case packet::BodyTemperature:
+        current_.temperature = static_cast<int16_t>(value);
+        break;
+      default:
+        continue;
+    }
+
+    changed = true;
+  }
+
+  if (changed) {
+    current_.timestamp = std::chrono::steady_clock::now();
+    snapshot_.store(current_);
+  }
+
+  return changed;
+}
+
+}  // namespace jeronibot::minipro
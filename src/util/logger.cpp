@@ -0,0 +1,176 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "util/logger.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace jeronibot::util
+{
+
+namespace
+{
+
+// How long records may sit in the rings before they are written out
+constexpr auto drain_period{10ms};
+
+}  // namespace
+
+Logger &
+Logger::instance()
+{
+  // Never destroyed: threads may still log while static objects are torn
+  // down. Whatever is left in the rings is written out at exit
+  static Logger * logger = [] {
+      Logger * logger = new Logger;
+      std::atexit([] {instance().flush();});
+      return logger;
+    }();
+
+  return *logger;
+}
+
+Logger::Logger()
+{
+  thread_ = std::thread(&Logger::run, this);
+  thread_.detach();
+}
+
+void
+Logger::set_output(FILE * output)
+{
+  flush();
+  output_.store(output, std::memory_order_relaxed);
+}
+
+Logger::BufferHandle::BufferHandle()
+{
+  Logger & logger = instance();
+  std::lock_guard<std::mutex> lock(logger.mutex_);
+
+  // Rings of threads that have exited are reused once they have drained
+  for (Buffer * candidate : logger.buffers_) {
+    if (candidate->retired_.load(std::memory_order_acquire) &&
+      candidate->tail_.load(std::memory_order_acquire) == candidate->head_.load(std::memory_order_relaxed))
+    {
+      candidate->retired_.store(false, std::memory_order_relaxed);
+      buffer = candidate;
+      return;
+    }
+  }
+
+  buffer = new Buffer;
+  logger.buffers_.push_back(buffer);
+}
+
+Logger::BufferHandle::~BufferHandle()
+{
+  buffer->retired_.store(true, std::memory_order_release);
+}
+
+void
+Logger::flush()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  uint64_t target = ++flush_requested_;
+  wakeup_.notify_one();
+  flushed_cv_.wait(lock, [this, target] {return flushed_ >= target;});
+}
+
+void
+Logger::run()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wakeup_.wait_for(lock, drain_period, [this] {return flush_requested_ != flushed_;});
+    uint64_t target = flush_requested_;
+
+    lock.unlock();
+    drain();
+    lock.lock();
+
+    flushed_ = target;
+    flushed_cv_.notify_all();
+  }
+}
+
+void
+Logger::drain()
+{
+  struct Pending
+  {
+    int64_t timestamp;
+    const Record * record;
+  };
+
+  // Only ever touched by the logging thread
+  static std::vector<Buffer *> buffers;
+  static std::vector<uint64_t> ends;
+  static std::vector<Pending> pending;
+  static std::deque<std::string> scratch;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers = buffers_;
+  }
+
+  ends.clear();
+  pending.clear();
+
+  for (Buffer * buffer : buffers) {
+    uint64_t head = buffer->head_.load(std::memory_order_acquire);
+    uint64_t position = buffer->tail_.load(std::memory_order_relaxed);
+
+    while (position < head) {
+      std::size_t offset = position & (Buffer::capacity - 1);
+      if (Buffer::capacity - offset < sizeof(Record)) {
+        position += Buffer::capacity - offset;
+        continue;
+      }
+
+      const Record * record = reinterpret_cast<const Record *>(buffer->data_.get() + offset);
+      if (record->print) {
+        pending.push_back({record->timestamp, record});
+      }
+      position += record->size;
+    }
+
+    ends.push_back(position);
+  }
+
+  // Each ring is in order already; this interleaves the threads
+  std::stable_sort(pending.begin(), pending.end(),
+    [](const Pending & a, const Pending & b) {return a.timestamp < b.timestamp;});
+
+  FILE * output = output_.load(std::memory_order_relaxed);
+  for (const Pending & entry : pending) {
+    const Record * record = entry.record;
+    record->print(output, record->format, reinterpret_cast<const uint8_t *>(record + 1), scratch);
+    scratch.clear();
+  }
+  if (!pending.empty()) {
+    fflush(output);
+  }
+
+  // Only now may the producers reuse the space
+  for (std::size_t i = 0; i < buffers.size(); i++) {
+    buffers[i]->tail_.store(ends[i], std::memory_order_release);
+  }
+}
+
+}  // namespace jeronibot::util
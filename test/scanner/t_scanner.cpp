@@ -0,0 +1,73 @@
+// Copyright (c) 2020 Michael Jeronimo
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include "bluetooth/scanner.hpp"
+
+using bluetooth::Advertisement;
+using bluetooth::Scanner;
+
+static std::atomic<bool> should_exit{false};
+
+void signal_handler(int signum)
+{
+  should_exit = true;
+}
+
+// Lists the LE devices around; with addresses on the command line, only
+// those are reported (through the controller's accept list)
+int main(int argc, char ** argv)
+{
+  try {
+    signal(SIGINT, signal_handler);
+
+    Scanner scanner;
+    for (int i = 1; i < argc; i++) {
+      scanner.add_device(argv[i]);
+    }
+
+    Scanner::Parameters parameters;
+    parameters.active = true;
+
+    bool started = scanner.start(
+      [](const Advertisement & advertisement) {
+        char address[18];
+        ba2str(&advertisement.address, address);
+        std::cout << address << " rssi=" << static_cast<int>(advertisement.rssi) << " name=\"" <<
+          advertisement.local_name() << "\"" << std::endl;
+      }, parameters);
+
+    if (!started) {
+      std::cerr << "Failed to start scanning" << std::endl;
+      return -1;
+    }
+
+    while (!should_exit) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    scanner.stop();
+  } catch (std::exception & ex) {
+    std::cerr << "Exception: " << ex.what() << std::endl;
+    return -1;
+  }
+
+  return 0;
+}